@@ -1,7 +1,10 @@
 #include <cassert>
+#include <cmath>
 #include <numeric>
+#include <stdexcept>
 
 #include "buttontext.hh"
+#include "metrics.hh"
 
 // XYZ Debug
 // #include <iostream>
@@ -13,26 +16,115 @@
 using Magick::Quantum;
 
 
-render_to_image::slice::slice(int x_, int y_, FT_GlyphSlot slot)
-: x(x_), y(y_), width(slot->bitmap.width), height(slot->bitmap.rows)
+namespace {
+
+  // Conversion between 8-bit sRGB values and linear light.  Linear values use 16 bits,
+  // for the conversion back the top 12 bits are enough to reproduce every sRGB value.
+  struct srgb_tables {
+    srgb_tables()
+    {
+      for (unsigned i = 0; i < 256; ++i) {
+        double c = i / 255.0;
+        double l = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+        decode[i] = uint16_t(l * 65535.0 + 0.5);
+      }
+      // Each entry covers 16 linear values, use the center.
+      for (unsigned i = 0; i < 4096; ++i) {
+        double l = (i * 16 + 8) / 65535.0;
+        double c = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+        encode[i] = uint8_t(c * 255.0 + 0.5);
+      }
+    }
+
+    uint16_t decode[256];
+    uint8_t encode[4096];
+  };
+  const srgb_tables srgb;
+
+
+  inline unsigned to_8bit(Quantum q)
+  {
+    return unsigned(q * 255u / QuantumRange);
+  }
+
+
+  inline Quantum from_8bit(unsigned v)
+  {
+    return Quantum(v * QuantumRange / 255u);
+  }
+
+
+  // Composite the color with the given coverage (0 to 255) over the pixel.  All
+  // arithmetic is done in integers, the weights are scaled by 255*255.
+  void blend_linear(Magick::PixelPacket& px, const uint16_t (&fg)[3], unsigned cov)
+  {
+    // The background images are usually opaque, this case needs no division.
+    if (px.opacity == 0) {
+      px.red = from_8bit(srgb.encode[(cov * fg[0] + (255u - cov) * srgb.decode[to_8bit(px.red)]) / 255u >> 4]);
+      px.green = from_8bit(srgb.encode[(cov * fg[1] + (255u - cov) * srgb.decode[to_8bit(px.green)]) / 255u >> 4]);
+      px.blue = from_8bit(srgb.encode[(cov * fg[2] + (255u - cov) * srgb.decode[to_8bit(px.blue)]) / 255u >> 4]);
+      return;
+    }
+
+    unsigned alphamem = 255u - to_8bit(px.opacity);
+    unsigned wfg = cov * 255u;
+    unsigned wmem = (255u - cov) * alphamem;
+    unsigned wres = wfg + wmem;
+    if (wres == 0)
+      return;
+
+    auto mix = [&](Quantum& q, uint16_t f) {
+      uint32_t l = (wfg * uint32_t(f) + wmem * uint32_t(srgb.decode[to_8bit(q)])) / wres;
+      q = from_8bit(srgb.encode[l >> 4]);
+    };
+    mix(px.red, fg[0]);
+    mix(px.green, fg[1]);
+    mix(px.blue, fg[2]);
+    px.opacity = QuantumRange - Quantum(uint64_t(wres) * QuantumRange / (255u * 255u));
+  }
+
+} // anonymous namespace
+
+
+render_to_image::blend_mode render_to_image::blend_from_name(const std::string& name)
+{
+  if (name == "linear")
+    return blend_mode::linear;
+  if (name != "srgb")
+    throw std::runtime_error("invalid blend mode " + name);
+  return blend_mode::srgb;
+}
+
+
+render_to_image::slice::slice(int x_, int y_, const FT_Bitmap& bitmap_)
+: x(x_), y(y_), width(bitmap_.width), height(bitmap_.rows)
 {
   bitmap.resize(width * height);
-  std::copy_n(slot->bitmap.buffer, width * height, bitmap.begin());
+  if (bitmap_.pixel_mode == FT_PIXEL_MODE_BGRA) {
+    color.resize(4 * width * height);
+    for (unsigned r = 0; r < height; ++r) {
+      std::copy_n(bitmap_.buffer + r * bitmap_.pitch, 4 * width, color.begin() + 4 * r * width);
+      for (unsigned c = 0; c < width; ++c)
+        bitmap[r * width + c] = bitmap_.buffer[r * bitmap_.pitch + 4 * c + 3];
+    }
+  } else
+    for (unsigned r = 0; r < height; ++r)
+      std::copy_n(bitmap_.buffer + r * bitmap_.pitch, width, bitmap.begin() + r * width);
 }
 
 
-void render_to_image::render(FT_GlyphSlot slot, FT_Int x)
+// The Y offset is positive upwards.
+void render_to_image::render(const FT_Bitmap& bitmap, FT_Int left, FT_Int top, FT_Int x, FT_Int y)
 {
-  auto bitmap = &slot->bitmap;
   auto& line = lines.back();
   auto& slices = line.slices;
 
-  assert(bitmap->pixel_mode == FT_PIXEL_MODE_GRAY);
-  assert(bitmap->num_grays == 256);
+  assert(bitmap.pixel_mode == FT_PIXEL_MODE_BGRA || (bitmap.pixel_mode == FT_PIXEL_MODE_GRAY && bitmap.num_grays == 256));
   try {
-    auto& ref = slices.emplace_back(x + slot->bitmap_left, -slot->bitmap_top, slot);
-    line.ymin = std::min(line.ymin, int(slot->bitmap_top - ref.height));
-    line.ymax = std::max(line.ymax, slot->bitmap_top);
+    top += y;
+    auto& ref = slices.emplace_back(x + left, -top, bitmap);
+    line.ymin = std::min(line.ymin, int(top - ref.height));
+    line.ymax = std::max(line.ymax, top);
   }
   catch (std::runtime_error&) {
     // Ignore.
@@ -40,10 +132,10 @@ void render_to_image::render(FT_GlyphSlot slot, FT_Int x)
 }
 
 
-std::pair<double,FT_UInt> render_to_image::first_font_size()
+std::pair<double,FT_UInt> render_to_image::first_font_size(double hint)
 {
   experiments.clear();
-  return { current_fontsize = 24.0, 122 };
+  return { current_fontsize = hint > 0.0 ? hint : 24.0, 122 };
 }
 
 
@@ -112,11 +204,22 @@ bool render_to_image::goodenough(unsigned w, unsigned h) const
 }
 
 
-Magick::Image render_to_image::finish(Magick::Color foreground, double posx, double posy)
+Magick::Image render_to_image::finish(Magick::Color foreground, double posx, double posy, blend_mode blend)
 {
+  static auto& srgb_time = metrics::get_histogram("text.blend_srgb");
+  static auto& linear_time = metrics::get_histogram("text.blend_linear");
+
   Magick::Image image(background);
   image.modifyImage();
 
+  metrics::timer t(blend == blend_mode::linear ? linear_time : srgb_time);
+
+  const uint16_t fglinear[3] = {
+    srgb.decode[to_8bit(foreground.redQuantum())],
+    srgb.decode[to_8bit(foreground.greenQuantum())],
+    srgb.decode[to_8bit(foreground.blueQuantum())]
+  };
+
   Magick::Pixels view(image);
   auto imwidth = image.columns();
   auto imheight = image.rows();
@@ -152,6 +255,34 @@ Magick::Image render_to_image::finish(Magick::Color foreground, double posx, dou
 
           auto memoffset = memy * imwidth + memx;
 
+          if (blend == blend_mode::linear) {
+            if (s.bitmap[offset] == 0)
+              continue;
+            if (s.color.empty())
+              blend_linear(mem[memoffset], fglinear, s.bitmap[offset]);
+            else {
+              auto bgra = &s.color[4 * offset];
+              const uint16_t colorlinear[3] = {
+                srgb.decode[255u * std::min(bgra[2], bgra[3]) / bgra[3]],
+                srgb.decode[255u * std::min(bgra[1], bgra[3]) / bgra[3]],
+                srgb.decode[255u * std::min(bgra[0], bgra[3]) / bgra[3]]
+              };
+              blend_linear(mem[memoffset], colorlinear, s.bitmap[offset]);
+            }
+            continue;
+          }
+
+          // Color glyphs provide their own color for each pixel.
+          double fgred = foreground.redQuantum();
+          double fggreen = foreground.greenQuantum();
+          double fgblue = foreground.blueQuantum();
+          if (! s.color.empty() && s.bitmap[offset] != 0) {
+            auto bgra = &s.color[4 * offset];
+            fgred = double(QuantumRange) * std::min(bgra[2], bgra[3]) / bgra[3];
+            fggreen = double(QuantumRange) * std::min(bgra[1], bgra[3]) / bgra[3];
+            fgblue = double(QuantumRange) * std::min(bgra[0], bgra[3]) / bgra[3];
+          }
+
           auto foreground_alpha = QuantumRange * ~s.bitmap[offset] / 255;
           if (mem[memoffset].opacity != QuantumRange && foreground_alpha != QuantumRange) {
             // This code is a mess.  It implements alpha-blending but with three different units
@@ -168,13 +299,13 @@ Magick::Image render_to_image::finish(Magick::Color foreground, double posx, dou
             auto alphares = 1.0 - mem[memoffset].opacity / double(QuantumRange);
             auto alphatext = s.bitmap[offset] / 255.0;
 
-            mem[memoffset].red = 1.0 / alphares * (alphatext * foreground.redQuantum() + (1.0 - alphatext) * alphamem * mem[memoffset].red);
-            mem[memoffset].green = 1.0 / alphares * (alphatext * foreground.greenQuantum() + (1.0 - alphatext) * alphamem * mem[memoffset].green);
-            mem[memoffset].blue = 1.0 / alphares * (alphatext * foreground.blueQuantum() + (1.0 - alphatext) * alphamem * mem[memoffset].blue);
+            mem[memoffset].red = 1.0 / alphares * (alphatext * fgred + (1.0 - alphatext) * alphamem * mem[memoffset].red);
+            mem[memoffset].green = 1.0 / alphares * (alphatext * fggreen + (1.0 - alphatext) * alphamem * mem[memoffset].green);
+            mem[memoffset].blue = 1.0 / alphares * (alphatext * fgblue + (1.0 - alphatext) * alphamem * mem[memoffset].blue);
           } else if (mem[memoffset].opacity == 0) {
-            mem[memoffset].red = foreground.redQuantum();
-            mem[memoffset].green = foreground.greenQuantum();
-            mem[memoffset].blue = foreground.blueQuantum();
+            mem[memoffset].red = fgred;
+            mem[memoffset].green = fggreen;
+            mem[memoffset].blue = fgblue;
             mem[memoffset].opacity = foreground_alpha;
           }
         }
@@ -1,6 +1,7 @@
 #ifndef _BUTTONTEXT_HH
 #define _BUTTONTEXT_HH 1
 
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -10,6 +11,15 @@
 
 
 struct render_to_image {
+  // How the text is composited onto the background.  The sRGB values can be blended
+  // directly (the traditional way) or the blending happens in linear light which gives
+  // thin strokes the correct weight, especially for light text on dark backgrounds.
+  enum struct blend_mode {
+    srgb,
+    linear,
+  };
+  static blend_mode blend_from_name(const std::string& name);
+
   render_to_image(const Magick::Color& background_, unsigned targetwidth_, unsigned targetheight_)
   : background(Magick::Geometry(targetwidth_, targetheight_), background_), targetwidth(targetwidth_ ?: UINT_MAX), targetheight(targetheight_ ?: UINT_MAX)
   {
@@ -22,22 +32,29 @@ struct render_to_image {
 
   void start() { lines.emplace_back(); }
 
-  void operator()(FT_GlyphSlot slot, FT_Int x){ render(slot, x); }
+  void operator()(FT_GlyphSlot slot, FT_Int x, FT_Int y = 0){ render(slot->bitmap, slot->bitmap_left, slot->bitmap_top, x, y); }
+  void operator()(const FT_Bitmap& bitmap, FT_Int left, FT_Int top, FT_Int x, FT_Int y = 0){ render(bitmap, left, top, x, y); }
 
-  std::pair<double,FT_UInt> first_font_size();
+  std::pair<double,FT_UInt> first_font_size(double hint = 0.0);
   void compute_dimensions();
   std::pair<bool,double> check_size();
 
   bool goodenough(unsigned w, unsigned h) const;
 
-  Magick::Image finish(Magick::Color foreground = Magick::Color("black"), double posx = 0.5, double posy = 0.5);
+  Magick::Image finish(Magick::Color foreground = Magick::Color("black"), double posx = 0.5, double posy = 0.5, blend_mode blend = blend_mode::srgb);
 
   void reset() {
     lines.clear();
   }
 
+  unsigned target_width() const { return targetwidth; }
+  unsigned target_height() const { return targetheight; }
+
+  // Separation of lines relative to the line height.
+  static constexpr double frac_linesep = 0.15;
+
 private:
-  void render(FT_GlyphSlot slot, FT_Int x);
+  void render(const FT_Bitmap& bitmap, FT_Int left, FT_Int top, FT_Int x, FT_Int y);
 
   // Magick::Color background;
   Magick::Image background;
@@ -48,13 +65,16 @@ private:
   using experiment_type = std::tuple<double,unsigned,unsigned>;
   std::vector<experiment_type> experiments;
   struct slice {
-    slice(int x_, int y_, FT_GlyphSlot slot_);
+    slice(int x_, int y_, const FT_Bitmap& bitmap_);
 
     int x;
     int y;
     unsigned width;
     unsigned height;
+    // The coverage.
     std::vector<uint8_t> bitmap;
+    // For color glyphs the premultiplied BGRA values, otherwise empty.
+    std::vector<uint8_t> color;
   };
   struct line_type {
     std::vector<slice> slices;
@@ -62,7 +82,6 @@ private:
     int ymax = INT_MIN;
   };
   std::vector<line_type> lines;
-  static constexpr double frac_linesep = 0.15;
   unsigned maxwidth = 0;
   unsigned totalheight = 0;
   unsigned linesep = 0;
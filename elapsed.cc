@@ -0,0 +1,141 @@
+#include "elapsed.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "metrics.hh"
+
+
+namespace {
+
+  constexpr char cells[] = "00:00:00";
+  constexpr unsigned ncells = sizeof(cells) - 1;
+
+} // anonymous namespace
+
+
+elapsed_display::elapsed_display(ftface& face, const Magick::Image& base_, const Magick::Color& color, double posy)
+: width(base_.columns()), height(base_.rows())
+{
+  Magick::Image src(base_);
+  base.resize(4 * width * height);
+  src.write(0, 0, width, height, "RGBA", Magick::CharPixel, base.data());
+  frame = base;
+  shown.assign(ncells, ' ');
+
+  rgb[0] = unsigned(color.redQuantum()) * 255u / QuantumRange;
+  rgb[1] = unsigned(color.greenQuantum()) * 255u / QuantumRange;
+  rgb[2] = unsigned(color.blueQuantum()) * 255u / QuantumRange;
+
+  // Determine the size at which the text fills 90% of the width, but not more than
+  // 30% of the height.  The size is in pixels, at 72 dpi this is the same as points.
+  constexpr double refsize = 64.0;
+  face.set_size(refsize, 72);
+  auto ftf = face.glyph_face(0);
+  auto advance = [ftf](char ch) {
+    if (FT_Load_Char(ftf, ch, FT_LOAD_DEFAULT) != 0)
+      return 0.0;
+    return ftf->glyph->advance.x / 64.0;
+  };
+  double digitadv = 0.0;
+  for (char ch = '0'; ch <= '9'; ++ch)
+    digitadv = std::max(digitadv, advance(ch));
+  double total = 6 * digitadv + 2 * advance(':');
+  double size = total == 0.0 ? refsize : std::min(refsize * 0.9 * width / total, 0.3 * height);
+  face.set_size(size, 72);
+
+  cellwidth = 0;
+  colonwidth = 0;
+  int ascent = 0;
+  int descent = 0;
+  for (unsigned i = 0; i < glyphs.size(); ++i) {
+    char ch = i < 10 ? '0' + i : ':';
+    auto& g = glyphs[i];
+    g = glyph{ 0, 0, 0, 0, {} };
+    if (FT_Load_Char(ftf, ch, FT_LOAD_RENDER) != 0)
+      continue;
+    const auto& bm = ftf->glyph->bitmap;
+    g.left = ftf->glyph->bitmap_left;
+    g.top = ftf->glyph->bitmap_top;
+    g.width = bm.width;
+    g.rows = bm.rows;
+    g.coverage.resize(g.width * g.rows);
+    for (unsigned r = 0; r < g.rows; ++r)
+      std::copy_n(bm.buffer + r * bm.pitch, g.width, g.coverage.begin() + r * g.width);
+
+    unsigned adv = std::ceil(ftf->glyph->advance.x / 64.0);
+    if (i < 10)
+      cellwidth = std::max({ cellwidth, adv, g.width });
+    else
+      colonwidth = std::max(adv, g.width);
+    ascent = std::max(ascent, g.top);
+    descent = std::max(descent, int(g.rows) - g.top);
+  }
+
+  unsigned total_width = 6 * cellwidth + 2 * colonwidth;
+  x0 = total_width < width ? (width - total_width) / 2 : 0;
+  baseline = std::clamp(int(posy * height) + (ascent - descent) / 2, ascent, std::max(ascent, int(height) - descent));
+  ymin = std::max(0, baseline - ascent);
+  ymax = std::min(int(height), baseline + descent);
+}
+
+
+unsigned elapsed_display::cell_x(unsigned idx) const
+{
+  // Cells 2 and 5 are the colons.
+  return x0 + (idx - idx / 3) * cellwidth + (idx / 3) * colonwidth;
+}
+
+
+void elapsed_display::draw_cell(unsigned idx, char ch)
+{
+  unsigned x = cell_x(idx);
+  unsigned w = std::min(ch == ':' ? colonwidth : cellwidth, width - std::min(width, x));
+
+  for (unsigned y = ymin; y < ymax; ++y)
+    std::copy_n(base.begin() + 4 * (y * width + x), 4 * w, frame.begin() + 4 * (y * width + x));
+
+  const auto& g = glyphs[ch == ':' ? 10 : ch - '0'];
+  int gx = x + (int(w) - int(g.width)) / 2;
+  int gy = baseline - g.top;
+  for (unsigned r = 0; r < g.rows; ++r) {
+    int y = gy + r;
+    if (y < int(ymin) || y >= int(ymax))
+      continue;
+    for (unsigned c = 0; c < g.width; ++c) {
+      int px = gx + c;
+      if (px < int(x) || px >= int(x + w))
+        continue;
+      unsigned a = g.coverage[r * g.width + c];
+      if (a == 0)
+        continue;
+      auto p = &frame[4 * (y * width + px)];
+      for (unsigned k = 0; k < 3; ++k)
+        p[k] = (rgb[k] * a + p[k] * (255u - a) + 127) / 255;
+      p[3] = a + (p[3] * (255u - a) + 127) / 255;
+    }
+  }
+}
+
+
+Magick::Image elapsed_display::draw(std::chrono::seconds elapsed)
+{
+  static auto& draw_time = metrics::get_histogram("obs.elapsed_draw");
+  static auto& ncellsdrawn = metrics::get_counter("obs.elapsed_cells");
+
+  metrics::timer t(draw_time);
+
+  auto secs = std::clamp<long long>(elapsed.count(), 0, 99 * 3600 + 59 * 60 + 59);
+  char buf[ncells + 1];
+  snprintf(buf, sizeof(buf), "%02lld:%02lld:%02lld", secs / 3600, secs / 60 % 60, secs % 60);
+
+  for (unsigned i = 0; i < ncells; ++i)
+    if (buf[i] != shown[i]) {
+      draw_cell(i, buf[i]);
+      shown[i] = buf[i];
+      ++ncellsdrawn;
+    }
+
+  return Magick::Image(width, height, "RGBA", Magick::CharPixel, frame.data());
+}
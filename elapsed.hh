@@ -0,0 +1,53 @@
+#ifndef _ELAPSED_HH
+#define _ELAPSED_HH 1
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Magick++.h>
+
+#include "ftlibrary.hh"
+
+
+// Elapsed time (HH:MM:SS) drawn over an image.  The digits and the colon are rendered
+// once, each character gets a cell of the same width.  An update only redraws the cells
+// whose character changed, restoring the pixels of the image first.
+struct elapsed_display {
+  elapsed_display(ftface& face, const Magick::Image& base_, const Magick::Color& color, double posy = 0.8);
+
+  Magick::Image draw(std::chrono::seconds elapsed);
+
+private:
+  struct glyph {
+    FT_Int left;
+    FT_Int top;
+    unsigned width;
+    unsigned rows;
+    std::vector<uint8_t> coverage;
+  };
+  // The digits followed by the colon.
+  std::array<glyph,11> glyphs;
+
+  unsigned width;
+  unsigned height;
+  // Position of the cells and the rows they cover.
+  unsigned cellwidth;
+  unsigned colonwidth;
+  unsigned x0;
+  int baseline;
+  unsigned ymin;
+  unsigned ymax;
+  uint8_t rgb[3];
+
+  std::vector<uint8_t> base;
+  std::vector<uint8_t> frame;
+  std::string shown;
+
+  unsigned cell_x(unsigned idx) const;
+  void draw_cell(unsigned idx, char ch);
+};
+
+#endif // elapsed.hh
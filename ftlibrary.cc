@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <limits>
 #include <stdexcept>
 
 #include "ftlibrary.hh"
+#include "metrics.hh"
 
 using namespace std::string_literals;
 
@@ -16,12 +19,80 @@ ftlibrary::ftlibrary()
 
 ftlibrary::~ftlibrary()
 {
+  // The faces must be gone before the library.
+  faces.clear();
+  atlases.clear();
+  for (auto& [name, chain] : fallback_chains)
+    if (chain.fonts != nullptr)
+      FcFontSetDestroy(chain.fonts);
   FcConfigDestroy(fcconfig);
   FcFini();
   FT_Done_FreeType(library);
 }
 
 
+sdf_atlas& ftlibrary::find_atlas(const std::filesystem::path& path)
+{
+  std::lock_guard<std::mutex> guard(atlases_lock);
+  auto it = atlases.find(path);
+  if (it == atlases.end())
+    it = atlases.emplace(std::piecewise_construct, std::forward_as_tuple(path), std::forward_as_tuple(library, face_lock, path)).first;
+  return it->second;
+}
+
+
+const std::filesystem::path* ftlibrary::find_fallback(const std::string& facename, utf8proc_int32_t wch)
+{
+  static auto& lookups = metrics::get_counter("text.fallback_lookups");
+
+  std::lock_guard<std::mutex> guard(fallback_lock);
+  auto& chain = fallback_chains[facename];
+  if (chain.fonts == nullptr) {
+    auto pat = FcNameParse((const FcChar8*) facename.c_str());
+    FcConfigSubstitute(fcconfig, pat, FcMatchPattern);
+    FcDefaultSubstitute(pat);
+    FcResult fcres;
+    chain.fonts = FcFontSort(fcconfig, pat, FcTrue, nullptr, &fcres);
+    FcPatternDestroy(pat);
+    if (chain.fonts == nullptr)
+      chain.fonts = FcFontSetCreate();
+
+    for (int i = 0; i < chain.fonts->nfont; ++i) {
+      FcChar8* fname = nullptr;
+      FcCharSet* charset = nullptr;
+      FcBool color = FcFalse;
+      if (FcPatternGetString(chain.fonts->fonts[i], FC_FILE, 0, &fname) != FcResultMatch
+          || FcPatternGetCharSet(chain.fonts->fonts[i], FC_CHARSET, 0, &charset) != FcResultMatch)
+        continue;
+      FcPatternGetBool(chain.fonts->fonts[i], FC_COLOR, 0, &color);
+      chain.paths.emplace_back((const char*) fname);
+      chain.charsets.push_back(charset);
+      chain.color.push_back(color);
+    }
+  }
+
+  auto [it, inserted] = chain.resolved.try_emplace(wch, -1);
+  if (inserted) {
+    ++lookups;
+    // For pictographs prefer color fonts even if they come later in the chain.
+    if (wch >= 0x1f000)
+      for (size_t i = 0; i < chain.paths.size(); ++i)
+        if (chain.color[i] && FcCharSetHasChar(chain.charsets[i], wch)) {
+          it->second = i;
+          break;
+        }
+    if (it->second == -1)
+      for (size_t i = 0; i < chain.paths.size(); ++i)
+        if (FcCharSetHasChar(chain.charsets[i], wch)) {
+          it->second = i;
+          break;
+        }
+  }
+
+  return it->second == -1 ? nullptr : &chain.paths[it->second];
+}
+
+
 ftface& ftlibrary::find_font(const std::string& fontface)
 {
   auto it = faces.find(fontface);
@@ -34,14 +105,17 @@ ftface& ftlibrary::find_font(const std::string& fontface)
 
 
 
-ftface::ftface(ftlibrary& library_, const std::string& facename)
-: library(library_)
+ftface::ftface(ftlibrary& library_, const std::string& facename_)
+: library(library_), facename(facename_)
 {
-  auto fname = find_face_path(facename);
-  if (! fname.empty()) {
-    auto error = FT_New_Face(library.library, fname.c_str(), 0, &face);
+  path = find_face_path(facename);
+  if (! path.empty()) {
+    std::lock_guard<std::mutex> guard(library.face_lock);
+    auto error = FT_New_Face(library.library, path.c_str(), 0, &face);
     if (! error) {
       use_kerning = FT_HAS_KERNING(face);
+      hbfont = hb_ft_font_create_referenced(face);
+      hbbuf = hb_buffer_create();
       return;
     }
   }
@@ -49,8 +123,281 @@ ftface::ftface(ftlibrary& library_, const std::string& facename)
 }
 
 
+ftface::ftface(ftface&& other)
+: face(other.face), hbfont(other.hbfont), hbbuf(other.hbbuf), use_kerning(other.use_kerning), library(other.library),
+  facename(std::move(other.facename)), path(std::move(other.path)), atlas(other.atlas),
+  fallbacks(std::move(other.fallbacks)), fallback_index(std::move(other.fallback_index)),
+  cur_size(other.cur_size), cur_dpi(other.cur_dpi), shape_cache(std::move(other.shape_cache))
+{
+  other.face = nullptr;
+  other.hbfont = nullptr;
+  other.hbbuf = nullptr;
+}
+
+
 ftface::~ftface()
 {
+  hb_buffer_destroy(hbbuf);
+  // The HarfBuzz font holds its own reference to the face.
+  std::lock_guard<std::mutex> guard(library.face_lock);
+  hb_font_destroy(hbfont);
+  if (face != nullptr)
+    FT_Done_Face(face);
+}
+
+
+void ftface::set_size(double s, unsigned hdpi, unsigned vdpi)
+{
+  cur_size = FT_F26Dot6(s * 64);
+  cur_dpi = hdpi;
+  FT_Set_Char_Size(face, 0, cur_size, hdpi, vdpi);
+  hb_ft_font_changed(hbfont);
+  for (auto& f : fallbacks)
+    f->set_size(cur_size, cur_dpi);
+}
+
+
+ftface::fallback::fallback(ftlibrary& library, const std::filesystem::path& path)
+: face_lock(library.face_lock)
+{
+  std::lock_guard<std::mutex> guard(face_lock);
+  if (FT_New_Face(library.library, path.c_str(), 0, &face) != 0)
+    throw std::runtime_error("cannot load font "s + path.string());
+  hbfont = hb_ft_font_create_referenced(face);
+  hb_ft_font_set_load_flags(hbfont, FT_LOAD_DEFAULT | FT_LOAD_COLOR);
+}
+
+
+ftface::fallback::~fallback()
+{
+  std::lock_guard<std::mutex> guard(face_lock);
+  hb_font_destroy(hbfont);
+  FT_Done_Face(face);
+}
+
+
+void ftface::fallback::set_size(FT_F26Dot6 size, FT_UInt dpi)
+{
+  if (FT_IS_SCALABLE(face)) {
+    FT_Set_Char_Size(face, 0, size, dpi, dpi);
+    bitmap_scale = 1.0;
+  } else if (face->num_fixed_sizes > 0) {
+    // Use the smallest bitmap size which is large enough, otherwise the largest.
+    auto ppem = size / 64.0 * dpi / 72.0;
+    int best = 0;
+    for (int i = 1; i < face->num_fixed_sizes; ++i) {
+      auto cur = face->available_sizes[i].y_ppem / 64.0;
+      auto bestppem = face->available_sizes[best].y_ppem / 64.0;
+      if ((bestppem < ppem && cur > bestppem) || (cur >= ppem && cur < bestppem))
+        best = i;
+    }
+    FT_Select_Size(face, best);
+    bitmap_scale = ppem / (face->available_sizes[best].y_ppem / 64.0);
+  }
+  hb_ft_font_changed(hbfont);
+}
+
+
+// Determine which font to use for the character.  Combining marks, joiners, and
+// variation selectors use the font of the preceding character.
+unsigned ftface::font_for(utf8proc_int32_t wch, unsigned prev)
+{
+  auto cat = utf8proc_category(wch);
+  if (cat == UTF8PROC_CATEGORY_MN || cat == UTF8PROC_CATEGORY_ME || cat == UTF8PROC_CATEGORY_CF || (wch >= 0x1f3fb && wch <= 0x1f3ff))
+    return prev;
+  if (FT_Get_Char_Index(face, wch) != 0)
+    return 0;
+
+  auto fpath = library.find_fallback(facename, wch);
+  if (fpath == nullptr)
+    return 0;
+  if (auto it = fallback_index.find(*fpath); it != fallback_index.end())
+    return it->second;
+
+  unsigned res = 0;
+  try {
+    fallbacks.emplace_back(std::make_unique<fallback>(library, *fpath));
+    fallbacks.back()->set_size(cur_size, cur_dpi);
+    res = fallbacks.size();
+  }
+  catch (std::runtime_error&) {
+    // Use the .notdef glyph of this face.
+  }
+  fallback_index.emplace(*fpath, res);
+  return res;
+}
+
+
+const std::vector<ftface::shaped_glyph>& ftface::shape(const std::vector<utf8proc_int32_t>& wbuf)
+{
+  static auto& shape_time = metrics::get_histogram("text.shape");
+  static auto& cache_hits = metrics::get_counter("text.shape_cache_hits");
+  metrics::timer t(shape_time);
+
+  if (! library.shaping) {
+    unshaped.clear();
+    FT_UInt prevglyphidx = 0;
+    unsigned font = 0;
+    for (auto wch : wbuf) {
+      auto prevfont = font;
+      font = font_for(wch, font);
+      auto f = glyph_face(font);
+      auto glyphidx = FT_Get_Char_Index(f, wch);
+
+      if (font == 0 && prevfont == 0 && use_kerning && prevglyphidx != 0 && glyphidx != 0) {
+        FT_Vector kern;
+        FT_Get_Kerning(face, prevglyphidx, glyphidx, FT_KERNING_DEFAULT, &kern);
+        if (! unshaped.empty())
+          unshaped.back().x_advance += kern.x;
+      }
+
+      FT_Pos advance = 0;
+      if (FT_Load_Glyph(f, glyphidx, FT_LOAD_DEFAULT | FT_LOAD_COLOR) == 0)
+        advance = f->glyph->advance.x * bitmap_scale(font);
+      unshaped.emplace_back(glyphidx, advance, 0, 0, font);
+      prevglyphidx = glyphidx;
+    }
+    return unshaped;
+  }
+
+  shape_key key{ cur_size, cur_dpi, std::u32string(wbuf.begin(), wbuf.end()) };
+  if (auto it = shape_cache.find(key); it != shape_cache.end()) {
+    ++cache_hits;
+    return it->second;
+  }
+
+  // The cache only has to hold the labels of the keys using this face.  Just start
+  // over if something unexpected happens.
+  if (shape_cache.size() >= max_shape_cache)
+    shape_cache.clear();
+
+  // Split the text into runs which use the same font and shape them separately.  The
+  // whole text is passed as context.
+  std::vector<unsigned> fonts(wbuf.size());
+  for (size_t i = 0; i < wbuf.size(); ++i)
+    fonts[i] = font_for(wbuf[i], i == 0 ? 0 : fonts[i - 1]);
+
+  std::vector<shaped_glyph> res;
+  for (size_t start = 0; start < wbuf.size(); ) {
+    auto end = start + 1;
+    while (end < wbuf.size() && fonts[end] == fonts[start])
+      ++end;
+    auto font = fonts[start];
+
+    hb_buffer_clear_contents(hbbuf);
+    hb_buffer_add_codepoints(hbbuf, reinterpret_cast<const hb_codepoint_t*>(wbuf.data()), wbuf.size(), start, end - start);
+    hb_buffer_guess_segment_properties(hbbuf);
+    hb_shape(font == 0 ? hbfont : fallbacks[font - 1]->hbfont, hbbuf, nullptr, 0);
+
+    unsigned n;
+    auto infos = hb_buffer_get_glyph_infos(hbbuf, &n);
+    auto positions = hb_buffer_get_glyph_positions(hbbuf, &n);
+    auto scale = bitmap_scale(font);
+    for (unsigned i = 0; i < n; ++i)
+      res.emplace_back(infos[i].codepoint, FT_Pos(positions[i].x_advance * scale), FT_Pos(positions[i].x_offset * scale), FT_Pos(positions[i].y_offset * scale), font);
+
+    start = end;
+  }
+
+  return shape_cache.emplace(std::move(key), std::move(res)).first->second;
+}
+
+
+bool ftface::sdf_glyph(FT_UInt index, sdf_glyph_image& out)
+{
+  if (atlas == nullptr)
+    atlas = &library.find_atlas(path);
+  auto scale = cur_size / 64.0 * cur_dpi / 72.0 / sdf_atlas::ref_size;
+  return atlas->get(index, scale, out);
+}
+
+
+text_layout ftface::layout(const std::vector<utf8proc_int32_t>& wbuf, double refsize, FT_UInt dpi, unsigned width, unsigned height, double linesep)
+{
+  static auto& layout_time = metrics::get_histogram("text.layout");
+  metrics::timer t(layout_time);
+
+  std::vector<std::vector<utf8proc_int32_t>> words;
+  bool in_word = false;
+  for (auto wch : wbuf)
+    if (wch == ' ' || wch == '\t' || wch == '\n')
+      in_word = false;
+    else {
+      if (! in_word)
+        words.emplace_back();
+      words.back().push_back(wch);
+      in_word = true;
+    }
+  if (words.empty())
+    return { { wbuf }, 0.0 };
+
+  // All widths are in pixels at the reference size.  They scale linearly with the font size.
+  set_size(refsize, dpi);
+  auto advance = [this](const std::vector<utf8proc_int32_t>& text) {
+    FT_Pos res = 0;
+    for (const auto& g : shape(text))
+      res += g.x_advance;
+    return res / 64.0;
+  };
+  auto n = words.size();
+  std::vector<double> prefix(n + 1, 0.0);
+  for (size_t i = 0; i < n; ++i)
+    prefix[i + 1] = prefix[i] + advance(words[i]);
+  auto space = advance({ ' ' });
+  auto linewidth = [&prefix,space](size_t i, size_t j) { return prefix[j] - prefix[i] + (j - i - 1) * space; };
+  auto lineheight = (face->size->metrics.ascender - face->size->metrics.descender) / 64.0;
+
+  constexpr auto inf = std::numeric_limits<double>::infinity();
+
+  // maxw[k][j] is the smallest possible width of the widest line if the first j words
+  // are set in k lines.  The number of lines determines the height and therefore the font
+  // size is determined by the better of the two limits.
+  std::vector<std::vector<double>> maxw(n + 1, std::vector<double>(n + 1, inf));
+  maxw[0][0] = 0.0;
+  size_t best_k = 1;
+  double best_scale = 0.0;
+  for (size_t k = 1; k <= n; ++k) {
+    for (size_t j = k; j <= n; ++j)
+      for (size_t i = k - 1; i < j; ++i)
+        maxw[k][j] = std::min(maxw[k][j], std::max(maxw[k - 1][i], linewidth(i, j)));
+
+    auto totalheight = k * lineheight + (k - 1) * linesep * lineheight;
+    auto scale = std::min(width / maxw[k][n], height / totalheight);
+    if (scale > best_scale) {
+      best_scale = scale;
+      best_k = k;
+    }
+  }
+
+  // Among the line breaks which do not exceed the width choose the one with the smallest
+  // sum of the squared differences to the widest line.
+  auto limit = maxw[best_k][n] * (1.0 + 1e-9);
+  std::vector<std::vector<double>> cost(best_k + 1, std::vector<double>(n + 1, inf));
+  std::vector<std::vector<size_t>> from(best_k + 1, std::vector<size_t>(n + 1, 0));
+  cost[0][0] = 0.0;
+  for (size_t k = 1; k <= best_k; ++k)
+    for (size_t j = k; j <= n; ++j)
+      for (size_t i = k - 1; i < j; ++i)
+        if (cost[k - 1][i] < inf)
+          if (auto w = linewidth(i, j); w <= limit) {
+            auto c = cost[k - 1][i] + (limit - w) * (limit - w);
+            if (c < cost[k][j]) {
+              cost[k][j] = c;
+              from[k][j] = i;
+            }
+          }
+
+  text_layout res{ std::vector<std::vector<utf8proc_int32_t>>(best_k), refsize * best_scale };
+  for (size_t k = best_k, j = n; k > 0; j = from[k][j], --k) {
+    auto& line = res.lines[k - 1];
+    for (auto i = from[k][j]; i < j; ++i) {
+      if (! line.empty())
+        line.push_back(' ');
+      line.insert(line.end(), words[i].begin(), words[i].end());
+    }
+  }
+
+  return res;
 }
 
 
@@ -74,6 +421,40 @@ std::filesystem::path ftface::find_face_path(const std::string& facename)
 }
 
 
+void scale_bitmap(const FT_Bitmap& in, double scale, std::vector<uint8_t>& buf, FT_Bitmap& out)
+{
+  unsigned bpp = in.pixel_mode == FT_PIXEL_MODE_BGRA ? 4 : 1;
+  unsigned ow = std::max(1u, unsigned(std::lround(in.width * scale)));
+  unsigned oh = std::max(1u, unsigned(std::lround(in.rows * scale)));
+  if (in.width == 0 || in.rows == 0)
+    ow = oh = 0;
+  buf.assign(ow * oh * bpp, 0);
+
+  // Each output pixel is the average of the input pixels it covers, at least one.
+  for (unsigned oy = 0; oy < oh; ++oy) {
+    unsigned y0 = std::min(in.rows - 1, unsigned(oy / scale));
+    unsigned y1 = std::clamp(unsigned((oy + 1) / scale), y0 + 1, in.rows);
+    for (unsigned ox = 0; ox < ow; ++ox) {
+      unsigned x0 = std::min(in.width - 1, unsigned(ox / scale));
+      unsigned x1 = std::clamp(unsigned((ox + 1) / scale), x0 + 1, in.width);
+      for (unsigned c = 0; c < bpp; ++c) {
+        unsigned sum = 0;
+        for (unsigned y = y0; y < y1; ++y)
+          for (unsigned x = x0; x < x1; ++x)
+            sum += in.buffer[y * in.pitch + x * bpp + c];
+        buf[(oy * ow + ox) * bpp + c] = sum / ((y1 - y0) * (x1 - x0));
+      }
+    }
+  }
+
+  out = in;
+  out.width = ow;
+  out.rows = oh;
+  out.pitch = ow * bpp;
+  out.buffer = buf.data();
+}
+
+
 bool convert_string(const std::string& s, std::vector<utf8proc_int32_t>& wbuf)
 {
   wbuf.resize(s.size() + 1);
@@ -1,15 +1,27 @@
 #ifndef _FTLIBRARY_HH
 #define _FTLIBRARY_HH 1
 
+#include <cmath>
 #include <filesystem>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include <fontconfig/fontconfig.h>
+#include <hb.h>
+#include <hb-ft.h>
 #include <Magick++.h>
 #include <utf8proc.h>
 
+#include "metrics.hh"
+#include "sdfatlas.hh"
+
 static_assert(__cpp_static_assert >= 200410, "extended static_assert missing");
 static_assert(__cpp_lib_filesystem >= 201703);
 static_assert(__cpp_range_based_for >= 200907);
@@ -21,16 +33,80 @@ static_assert(__cpp_variadic_templates >= 200704);
 struct ftlibrary;
 
 
+// Lines of a text and the estimated font size at which they fill the box.
+struct text_layout {
+  std::vector<std::vector<utf8proc_int32_t>> lines;
+  double fontsize;
+};
+
+
 struct ftface {
   ftface(ftlibrary& library_, const std::string& facename);
+  ftface(const ftface&) = delete;
+  ftface(ftface&& other);
   ~ftface();
 
-  void set_size(double s, unsigned hdpi, unsigned vdpi = 0) { FT_Set_Char_Size(face, 0, FT_UInt(s * 64), hdpi, vdpi); }
+  void set_size(double s, unsigned hdpi, unsigned vdpi = 0);
+
+  // One glyph of a shaped text.  The positions are in 26.6 fixed point format.
+  struct shaped_glyph {
+    FT_UInt index;
+    FT_Pos x_advance;
+    FT_Pos x_offset;
+    FT_Pos y_offset;
+    // Zero for this face, otherwise the number of the fallback font.
+    unsigned font;
+  };
+  // Map the text to glyphs at the current size.  With HarfBuzz the result is cached.
+  const std::vector<shaped_glyph>& shape(const std::vector<utf8proc_int32_t>& wbuf);
+
+  // Break the text at white space into lines so that it can be shown with the largest
+  // possible font size in a box of the given size.  Among the line breaks with the same
+  // number of lines the one with the least raggedness is used.  Only the advances of the
+  // shaped words at the reference size are used, nothing is rendered.
+  text_layout layout(const std::vector<utf8proc_int32_t>& wbuf, double refsize, FT_UInt dpi, unsigned width, unsigned height, double linesep);
+
+  // Compute the glyph at the current size from the signed distance field.
+  bool sdf_glyph(FT_UInt index, sdf_glyph_image& out);
+
+  // The face containing the glyph and, for fonts with only fixed bitmap sizes (as
+  // used for color emoji), the factor by which the bitmaps have to be scaled.
+  FT_Face glyph_face(unsigned font) const { return font == 0 ? face : fallbacks[font - 1]->face; }
+  double bitmap_scale(unsigned font) const { return font == 0 ? 1.0 : fallbacks[font - 1]->bitmap_scale; }
 
 private:
-  FT_Face face;
+  FT_Face face = nullptr;
+  hb_font_t* hbfont;
+  hb_buffer_t* hbbuf;
   bool use_kerning;
   ftlibrary& library;
+  std::string facename;
+  std::filesystem::path path;
+  sdf_atlas* atlas = nullptr;
+
+  // Fonts used for characters not provided by this face.  They are loaded when needed.
+  struct fallback {
+    fallback(ftlibrary& library, const std::filesystem::path& path);
+    ~fallback();
+
+    void set_size(FT_F26Dot6 size, FT_UInt dpi);
+
+    std::mutex& face_lock;
+    FT_Face face = nullptr;
+    hb_font_t* hbfont = nullptr;
+    double bitmap_scale = 1.0;
+  };
+  std::vector<std::unique_ptr<fallback>> fallbacks;
+  std::map<std::filesystem::path,unsigned> fallback_index;
+  unsigned font_for(utf8proc_int32_t wch, unsigned prev);
+
+  FT_F26Dot6 cur_size = 0;
+  FT_UInt cur_dpi = 0;
+
+  static constexpr size_t max_shape_cache = 256;
+  using shape_key = std::tuple<FT_F26Dot6,FT_UInt,std::u32string>;
+  std::map<shape_key,std::vector<shaped_glyph>> shape_cache;
+  std::vector<shaped_glyph> unshaped;
 
   std::filesystem::path find_face_path(const std::string& facename);
 
@@ -46,16 +122,47 @@ struct ftlibrary {
 
   ftface& find_font(const std::string& fontface);
 
+  // Use HarfBuzz to shape the text.  Otherwise characters are mapped one to one to glyphs
+  // and only the kerning table is used.
+  bool shaping = true;
+
+  // Render the glyphs from signed distance fields instead of using FreeType directly.
+  bool sdf = false;
+
 private:
   FT_Library library;
   FcConfig* fcconfig;
+  // FreeType requires that faces of one library are created and destroyed one at a
+  // time.  The labels are rendered by several threads, all of them use this lock.
+  std::mutex face_lock;
 
   std::map<std::string,ftface> faces;
 
+  // The fonts fontconfig considers as substitutes for a font, in order of preference.
+  // The font used for a character is determined once and then remembered.
+  struct fallback_chain {
+    FcFontSet* fonts = nullptr;
+    std::vector<std::filesystem::path> paths;
+    std::vector<FcCharSet*> charsets;
+    std::vector<bool> color;
+    std::unordered_map<utf8proc_int32_t,int> resolved;
+  };
+  const std::filesystem::path* find_fallback(const std::string& facename, utf8proc_int32_t wch);
+  std::mutex fallback_lock;
+  std::map<std::string,fallback_chain> fallback_chains;
+
+  sdf_atlas& find_atlas(const std::filesystem::path& path);
+  std::mutex atlases_lock;
+  std::map<std::filesystem::path,sdf_atlas> atlases;
+
   friend struct ftface;
 };
 
 
+// Resize a gray or BGRA bitmap by averaging the covered pixels.
+void scale_bitmap(const FT_Bitmap& in, double scale, std::vector<uint8_t>& buf, FT_Bitmap& out);
+
+
 template<typename T>
 struct font_render {
   using render_type = T;
@@ -67,12 +174,20 @@ struct font_render {
   Magick::Image draw(const std::string& s, Args... args);
   template<typename... Args>
   Magick::Image draw(const std::vector<std::string>& vs, Args... args);
+  // Like draw but the text is broken into lines as needed.
+  template<typename... Args>
+  Magick::Image draw_wrapped(const std::string& s, Args... args);
 private:
   void call_render(double fontsize, FT_UInt dpi, const std::vector<utf8proc_int32_t>& wch);
   void call_render(double fontsize, FT_UInt dpi, const std::vector<std::vector<utf8proc_int32_t>>& wch);
 
   template<typename Strings, typename... Args>
-  Magick::Image draw2(const Strings& vs, Args... args);
+  Magick::Image draw2(const Strings& vs, double fontsize_hint, Args... args);
+
+  void render_glyph(const ftface::shaped_glyph& g, FT_Pos x);
+  sdf_glyph_image sdfimage;
+  std::vector<uint8_t> scaledbuf;
+  FT_Bitmap scaled;
 
   ftface& fontface;
   render_type renderer;
@@ -87,6 +202,32 @@ font_render<T>::font_render(ftface& fontface_, Args... args)
 }
 
 
+template<typename T>
+void font_render<T>::render_glyph(const ftface::shaped_glyph& g, FT_Pos x)
+{
+  static auto& ft_time = metrics::get_histogram("text.glyph_freetype");
+  static auto& sdf_time = metrics::get_histogram("text.glyph_sdf");
+
+  auto px = (x + g.x_offset + 0x20) >> 6;
+  auto py = (g.y_offset + 0x20) >> 6;
+  if (fontface.library.sdf && g.font == 0) {
+    metrics::timer t(sdf_time);
+    if (fontface.sdf_glyph(g.index, sdfimage))
+      renderer(sdfimage.bitmap, sdfimage.left, sdfimage.top, px, py);
+  } else {
+    metrics::timer t(ft_time);
+    auto face = fontface.glyph_face(g.font);
+    if (auto error = FT_Load_Glyph(face, g.index, FT_LOAD_RENDER | FT_LOAD_COLOR); ! error) {
+      if (auto scale = fontface.bitmap_scale(g.font); scale != 1.0) {
+        scale_bitmap(face->glyph->bitmap, scale, scaledbuf, scaled);
+        renderer(scaled, std::lround(face->glyph->bitmap_left * scale), std::lround(face->glyph->bitmap_top * scale), px, py);
+      } else
+        renderer(face->glyph, px, py);
+    }
+  }
+}
+
+
 template<typename T>
 void font_render<T>::call_render(double fontsize, FT_UInt dpi, const std::vector<utf8proc_int32_t>& wbuf)
 {
@@ -95,26 +236,12 @@ void font_render<T>::call_render(double fontsize, FT_UInt dpi, const std::vector
   renderer.reset();
 
   FT_Vector pen{ 0, 0 };
-  FT_UInt prevglyphidx = 0;
 
   renderer.start();
 
-  for (auto wch : wbuf) {
-    auto glyphidx = FT_Get_Char_Index(fontface.face, wch);
-
-    if (fontface.use_kerning && prevglyphidx != 0 && glyphidx != 0) {
-      FT_Vector kern;
-      FT_Get_Kerning(fontface.face, prevglyphidx, glyphidx, FT_KERNING_DEFAULT, &kern);
-      pen.x += kern.x;
-    }
-
-    if (auto error = FT_Load_Glyph(fontface.face, glyphidx, FT_LOAD_RENDER); error)
-      continue;
-
-    renderer(fontface.face->glyph, (pen.x + 0x20) >> 6);
-
-    pen.x += fontface.face->glyph->advance.x;
-    prevglyphidx = glyphidx;
+  for (const auto& g : fontface.shape(wbuf)) {
+    render_glyph(g, pen.x);
+    pen.x += g.x_advance;
   }
 
   renderer.compute_dimensions();
@@ -130,26 +257,12 @@ void font_render<T>::call_render(double fontsize, FT_UInt dpi, const std::vector
 
   for (const auto& wbuf : wbufs) {
     FT_Vector pen{ 0, 0 };
-    FT_UInt prevglyphidx = 0;
 
     renderer.start();
 
-    for (auto wch : wbuf) {
-      auto glyphidx = FT_Get_Char_Index(fontface.face, wch);
-
-      if (fontface.use_kerning && prevglyphidx != 0 && glyphidx != 0) {
-        FT_Vector kern;
-        FT_Get_Kerning(fontface.face, prevglyphidx, glyphidx, FT_KERNING_DEFAULT, &kern);
-        pen.x += kern.x;
-      }
-
-      if (auto error = FT_Load_Glyph(fontface.face, glyphidx, FT_LOAD_RENDER); error)
-        continue;
-
-      renderer(fontface.face->glyph, (pen.x + 0x20) >> 6);
-
-      pen.x += fontface.face->glyph->advance.x;
-      prevglyphidx = glyphidx;
+    for (const auto& g : fontface.shape(wbuf)) {
+      render_glyph(g, pen.x);
+      pen.x += g.x_advance;
     }
   }
 
@@ -162,9 +275,9 @@ bool convert_string(const std::string& s, std::vector<utf8proc_int32_t>& wbuf);
 
 template<typename T>
 template<typename Strings, typename... Args>
-Magick::Image font_render<T>::draw2(const Strings& wbuf, Args... args)
+Magick::Image font_render<T>::draw2(const Strings& wbuf, double fontsize_hint, Args... args)
 {
-  auto [fontsize, dpi] = renderer.first_font_size();
+  auto [fontsize, dpi] = renderer.first_font_size(fontsize_hint);
   while (true) {
     call_render(fontsize, dpi, wbuf);
     
@@ -189,7 +302,7 @@ Magick::Image font_render<T>::draw(const std::string& s, Args... args)
   if (! convert_string(s, wbuf))
     throw std::runtime_error("invalid character");
 
-  return draw2(wbuf, std::forward<Args>(args)...);
+  return draw2(wbuf, 0.0, std::forward<Args>(args)...);
 }
 
 
@@ -205,7 +318,22 @@ Magick::Image font_render<T>::draw(const std::vector<std::string>& vs, Args... a
       throw std::runtime_error("invalid character");
   }
 
-  return draw2(vwbuf, std::forward<Args>(args)...);
+  return draw2(vwbuf, 0.0, std::forward<Args>(args)...);
+}
+
+
+template<typename T>
+template<typename... Args>
+Magick::Image font_render<T>::draw_wrapped(const std::string& s, Args... args)
+{
+  std::vector<utf8proc_int32_t> wbuf;
+  if (! convert_string(s, wbuf))
+    throw std::runtime_error("invalid character");
+
+  auto [fontsize, dpi] = renderer.first_font_size();
+  auto layout = fontface.layout(wbuf, fontsize, dpi, renderer.target_width(), renderer.target_height(), renderer.frac_linesep);
+
+  return draw2(layout.lines, layout.fontsize, std::forward<Args>(args)...);
 }
 
 #endif // ftlibrary.hh
@@ -0,0 +1,196 @@
+#include "imagescale.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+
+#include "metrics.hh"
+
+
+scale_filter::scale_filter(unsigned src, unsigned dst)
+: first(dst)
+{
+  // Triangle filter.  When reducing the size it is widened so that every source pixel
+  // contributes, when enlarging this is bilinear interpolation.
+  double ratio = double(src) / dst;
+  double support = std::max(1.0, ratio);
+
+  std::vector<double> centers(dst);
+  taps = 1;
+  for (unsigned i = 0; i < dst; ++i) {
+    centers[i] = (i + 0.5) * ratio - 0.5;
+    int lo = std::max(0, int(std::floor(centers[i] - support)) + 1);
+    int hi = std::min(int(src) - 1, int(std::ceil(centers[i] + support)) - 1);
+    first[i] = lo;
+    taps = std::max(taps, unsigned(std::max(hi - lo + 1, 1)));
+  }
+
+  weights.resize(dst * taps);
+  const int one = 1 << weight_bits;
+  for (unsigned i = 0; i < dst; ++i) {
+    first[i] = std::min(first[i], src - taps);
+
+    std::vector<double> w(taps);
+    double sum = 0.0;
+    for (unsigned k = 0; k < taps; ++k) {
+      w[k] = std::max(0.0, 1.0 - std::abs(first[i] + k - centers[i]) / support);
+      sum += w[k];
+    }
+    if (sum == 0.0) {
+      // Only possible at the border, use the nearest pixel.
+      auto k = std::clamp(int(std::lround(centers[i])) - int(first[i]), 0, int(taps) - 1);
+      w[k] = sum = 1.0;
+    }
+
+    // The rounding errors are added to the largest weight so that the sum is exact.
+    auto ws = &weights[i * taps];
+    int isum = 0;
+    unsigned kmax = 0;
+    for (unsigned k = 0; k < taps; ++k) {
+      ws[k] = int16_t(std::lround(w[k] / sum * one));
+      isum += ws[k];
+      if (ws[k] > ws[kmax])
+        kmax = k;
+    }
+    ws[kmax] += one - isum;
+  }
+}
+
+
+const scale_filter& get_scale_filter(unsigned src, unsigned dst)
+{
+  static std::mutex lock;
+  static std::map<std::pair<unsigned,unsigned>,scale_filter> filters;
+  static auto& nfilters = metrics::get_counter("image.scale_filters");
+
+  std::lock_guard<std::mutex> guard(lock);
+  auto [it, inserted] = filters.try_emplace({ src, dst }, src, dst);
+  if (inserted)
+    nfilters.set(filters.size());
+  return it->second;
+}
+
+
+void scale_rgba(const uint8_t* in, unsigned width, unsigned height, uint8_t* out, unsigned newwidth, unsigned newheight)
+{
+  const auto& hf = get_scale_filter(width, newwidth);
+  const auto& vf = get_scale_filter(height, newheight);
+
+  // Horizontal pass.  The color values are premultiplied by the alpha value on the fly,
+  // otherwise the colors of transparent pixels would bleed into the visible parts.  The
+  // intermediate values keep eight more bits than the input.  The buffers are reused,
+  // allocating them each time costs more than the computation.
+  constexpr unsigned mid_shift = scale_filter::weight_bits - 8;
+  constexpr uint32_t mid_div = 255u << mid_shift;
+  thread_local std::vector<uint16_t> mid;
+  mid.resize(4 * newwidth * height);
+  for (unsigned y = 0; y < height; ++y) {
+    const uint8_t* src = in + 4 * y * width;
+    uint16_t* dst = mid.data() + 4 * y * newwidth;
+    for (unsigned x = 0; x < newwidth; ++x) {
+      const uint8_t* s = src + 4 * hf.first[x];
+      const int16_t* w = hf.weights.data() + x * hf.taps;
+      uint32_t acc[4] = { 0, 0, 0, 0 };
+      for (unsigned k = 0; k < hf.taps; ++k) {
+        uint32_t wa = uint32_t(w[k]) * s[4 * k + 3];
+        acc[0] += wa * s[4 * k + 0];
+        acc[1] += wa * s[4 * k + 1];
+        acc[2] += wa * s[4 * k + 2];
+        acc[3] += wa * 255u;
+      }
+      for (unsigned c = 0; c < 4; ++c)
+        dst[4 * x + c] = (acc[c] + mid_div / 2) / mid_div;
+    }
+  }
+
+  // Vertical pass.  Complete rows are accumulated, this is the part which profits most
+  // from vectorization.
+  const unsigned rowlen = 4 * newwidth;
+  constexpr unsigned out_shift = scale_filter::weight_bits + 8;
+  thread_local std::vector<uint32_t> acc;
+  acc.resize(rowlen);
+  for (unsigned y = 0; y < newheight; ++y) {
+    std::fill(acc.begin(), acc.end(), 0u);
+    const int16_t* w = vf.weights.data() + y * vf.taps;
+    for (unsigned k = 0; k < vf.taps; ++k) {
+      const uint16_t* src = mid.data() + (vf.first[y] + k) * rowlen;
+      const uint32_t wk = w[k];
+      for (unsigned i = 0; i < rowlen; ++i)
+        acc[i] += wk * src[i];
+    }
+
+    // Undo the premultiplication with the full precision of the sums.
+    uint8_t* dst = out + y * rowlen;
+    for (unsigned x = 0; x < newwidth; ++x) {
+      uint32_t a = acc[4 * x + 3];
+      dst[4 * x + 3] = std::min(255u, (a + (1u << (out_shift - 1))) >> out_shift);
+      for (unsigned c = 0; c < 3; ++c)
+        dst[4 * x + c] = a == 0 ? 0 : std::min(uint64_t(255), (uint64_t(acc[4 * x + c]) * 255u + a / 2) / a);
+    }
+  }
+}
+
+
+Magick::Image scale_image(const Magick::Image& image, unsigned width, unsigned height)
+{
+  static auto& scale_time = metrics::get_histogram("image.scale");
+
+  if (image.columns() == width && image.rows() == height)
+    return image;
+
+  metrics::timer t(scale_time);
+
+  Magick::Image src(image);
+  unsigned oldwidth = src.columns();
+  unsigned oldheight = src.rows();
+  std::vector<uint8_t> in(4 * oldwidth * oldheight);
+  src.write(0, 0, oldwidth, oldheight, "RGBA", Magick::CharPixel, in.data());
+
+  std::vector<uint8_t> out(4 * width * height);
+  scale_rgba(in.data(), oldwidth, oldheight, out.data(), width, height);
+
+  return Magick::Image(width, height, "RGBA", Magick::CharPixel, out.data());
+}
+
+
+bool is_opaque(const Magick::Image& image)
+{
+  Magick::Image src(image);
+  if (! src.alpha())
+    return true;
+
+  std::vector<uint8_t> a(src.columns() * src.rows());
+  src.write(0, 0, src.columns(), src.rows(), "A", Magick::CharPixel, a.data());
+  return std::ranges::all_of(a, [](auto v){ return v == 255; });
+}
+
+
+std::vector<Magick::Image> slice_image(const Magick::Image& image, unsigned cols, unsigned rows, unsigned width, unsigned height, unsigned gap)
+{
+  unsigned fullwidth = cols * width + (cols - 1) * gap;
+  unsigned fullheight = rows * height + (rows - 1) * gap;
+  double f = std::max(double(fullwidth) / image.columns(), double(fullheight) / image.rows());
+  unsigned scaledwidth = std::max(fullwidth, unsigned(std::lround(image.columns() * f)));
+  unsigned scaledheight = std::max(fullheight, unsigned(std::lround(image.rows() * f)));
+  Magick::Image scaled(scale_image(image, scaledwidth, scaledheight));
+  unsigned offx = (scaledwidth - fullwidth) / 2;
+  unsigned offy = (scaledheight - fullheight) / 2;
+
+  std::vector<Magick::Image> res;
+  std::vector<uint8_t> buf(4 * width * height);
+  for (unsigned r = 0; r < rows; ++r)
+    for (unsigned c = 0; c < cols; ++c) {
+      scaled.write(offx + c * (width + gap), offy + r * (height + gap), width, height, "RGBA", Magick::CharPixel, buf.data());
+      for (unsigned i = 0; i < width * height; ++i) {
+        unsigned a = buf[4 * i + 3];
+        buf[4 * i + 0] = (buf[4 * i + 0] * a + 127) / 255;
+        buf[4 * i + 1] = (buf[4 * i + 1] * a + 127) / 255;
+        buf[4 * i + 2] = (buf[4 * i + 2] * a + 127) / 255;
+        buf[4 * i + 3] = 255;
+      }
+      res.emplace_back(width, height, "RGBA", Magick::CharPixel, buf.data());
+    }
+
+  return res;
+}
@@ -0,0 +1,47 @@
+#ifndef _IMAGESCALE_HH
+#define _IMAGESCALE_HH 1
+
+#include <cstdint>
+#include <vector>
+
+#include <Magick++.h>
+
+
+// Resampling of the icons and labels to the size of the keys.  There are only a few
+// different image sizes and key sizes and the filter coefficients are computed once
+// for each combination.  The two passes use integer arithmetic and are simple enough
+// to be vectorized by the compiler.
+
+// Coefficients for one dimension.  Every output pixel uses the same number of source
+// pixels, unused taps have weight zero.
+struct scale_filter {
+  scale_filter(unsigned src, unsigned dst);
+
+  unsigned taps;
+  // First source pixel for each output pixel.
+  std::vector<unsigned> first;
+  // The weights, taps entries for each output pixel.  The sum is 1 << weight_bits.
+  std::vector<int16_t> weights;
+
+  static constexpr unsigned weight_bits = 14;
+};
+
+
+// The filter for the given dimensions.  The objects are never deallocated.
+const scale_filter& get_scale_filter(unsigned src, unsigned dst);
+
+// Scale an image with four 8-bit channels (RGBA, not premultiplied).
+void scale_rgba(const uint8_t* in, unsigned width, unsigned height, uint8_t* out, unsigned newwidth, unsigned newheight);
+
+// Return an image of the given size.  If it already has the size it is returned unchanged.
+Magick::Image scale_image(const Magick::Image& image, unsigned width, unsigned height);
+
+// True if the image has no transparent pixels.
+bool is_opaque(const Magick::Image& image);
+
+// Cut an image spanning the whole key grid into the images for the individual keys, row
+// by row.  The image is scaled to cover the keys and the gaps between them, keeping the
+// aspect ratio, and the parts behind the gaps are dropped.  Transparent parts are black.
+std::vector<Magick::Image> slice_image(const Magick::Image& image, unsigned cols, unsigned rows, unsigned width, unsigned height, unsigned gap);
+
+#endif // imagescale.hh
@@ -0,0 +1,201 @@
+#include "jsonview.hh"
+
+#include <charconv>
+
+
+namespace {
+
+  unsigned hex4(std::string_view s)
+  {
+    unsigned res = 0;
+    if (s.size() < 4 || std::from_chars(s.data(), s.data() + 4, res, 16).ptr != s.data() + 4)
+      return 0xfffd;
+    return res;
+  }
+
+
+  void append_utf8(std::string& res, unsigned c)
+  {
+    if (c < 0x80)
+      res += char(c);
+    else if (c < 0x800) {
+      res += char(0xc0 | (c >> 6));
+      res += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      res += char(0xe0 | (c >> 12));
+      res += char(0x80 | ((c >> 6) & 0x3f));
+      res += char(0x80 | (c & 0x3f));
+    } else {
+      res += char(0xf0 | (c >> 18));
+      res += char(0x80 | ((c >> 12) & 0x3f));
+      res += char(0x80 | ((c >> 6) & 0x3f));
+      res += char(0x80 | (c & 0x3f));
+    }
+  }
+
+} // anonymous namespace
+
+
+json_view::json_view(std::string_view text_)
+: text(skip_ws(text_))
+{
+  while (! text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r' || text.back() == '\n'))
+    text.remove_suffix(1);
+}
+
+
+std::string_view json_view::skip_ws(std::string_view s)
+{
+  size_t i = 0;
+  while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n'))
+    ++i;
+  return s.substr(i);
+}
+
+
+size_t json_view::value_length(std::string_view s)
+{
+  if (s.empty())
+    return 0;
+
+  size_t i = 0;
+  switch (s[0]) {
+  case '"':
+    for (i = 1; i < s.size(); ++i)
+      if (s[i] == '\\')
+        ++i;
+      else if (s[i] == '"')
+        return i + 1;
+    return 0;
+  case '{':
+  case '[':
+    {
+      unsigned depth = 0;
+      for (; i < s.size(); ++i)
+        switch (s[i]) {
+        case '"':
+          for (++i; i < s.size() && s[i] != '"'; ++i)
+            if (s[i] == '\\')
+              ++i;
+          break;
+        case '{':
+        case '[':
+          ++depth;
+          break;
+        case '}':
+        case ']':
+          if (--depth == 0)
+            return i + 1;
+          break;
+        default:
+          break;
+        }
+    }
+    return 0;
+  default:
+    while (i < s.size() && s[i] != ',' && s[i] != '}' && s[i] != ']' && s[i] != ' ' && s[i] != '\t' && s[i] != '\r' && s[i] != '\n')
+      ++i;
+    return i;
+  }
+}
+
+
+json_view json_view::operator[](std::string_view key) const
+{
+  if (! is_object())
+    return {};
+
+  auto p = skip_ws(text.substr(1));
+  while (! p.empty() && p.front() == '"') {
+    auto klen = value_length(p);
+    if (klen == 0)
+      return {};
+    json_view k(p.substr(0, klen));
+    p = skip_ws(p.substr(klen));
+    if (p.empty() || p.front() != ':')
+      return {};
+    p = skip_ws(p.substr(1));
+    auto vlen = value_length(p);
+    if (vlen == 0)
+      return {};
+    if (k == key)
+      return json_view(p.substr(0, vlen));
+    p = skip_ws(p.substr(vlen));
+    if (p.empty() || p.front() != ',')
+      return {};
+    p = skip_ws(p.substr(1));
+  }
+  return {};
+}
+
+
+bool json_view::operator==(std::string_view s) const
+{
+  if (! is_string() || text.size() < 2)
+    return false;
+  auto raw = text.substr(1, text.size() - 2);
+  if (raw.find('\\') == std::string_view::npos)
+    return raw == s;
+  return as_string() == s;
+}
+
+
+std::string json_view::as_string() const
+{
+  if (! is_string())
+    return valid() && text != "null" ? std::string(text) : std::string();
+
+  std::string res;
+  auto raw = text.substr(1, text.size() - 2);
+  res.reserve(raw.size());
+  for (size_t i = 0; i < raw.size(); ++i) {
+    if (raw[i] != '\\' || i + 1 == raw.size()) {
+      res += raw[i];
+      continue;
+    }
+    switch (raw[++i]) {
+    case 'b': res += '\b'; break;
+    case 'f': res += '\f'; break;
+    case 'n': res += '\n'; break;
+    case 'r': res += '\r'; break;
+    case 't': res += '\t'; break;
+    case 'u':
+      {
+        unsigned c = hex4(raw.substr(i + 1));
+        i += 4;
+        if (c >= 0xd800 && c < 0xdc00 && i + 6 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+          unsigned lo = hex4(raw.substr(i + 3));
+          if (lo >= 0xdc00 && lo < 0xe000) {
+            c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+            i += 6;
+          }
+        }
+        append_utf8(res, c);
+      }
+      break;
+    default:
+      res += raw[i];
+      break;
+    }
+  }
+  return res;
+}
+
+
+bool json_view::as_bool() const
+{
+  if (text == "true")
+    return true;
+  if (text.empty() || is_string() || text == "false" || text == "null")
+    return false;
+  // A number.
+  return text.find_first_not_of("-0.eE+") != std::string_view::npos;
+}
+
+
+unsigned json_view::as_uint() const
+{
+  unsigned res = 0;
+  std::from_chars(text.data(), text.data() + text.size(), res);
+  return res;
+}
@@ -0,0 +1,58 @@
+#ifndef _JSONVIEW_HH
+#define _JSONVIEW_HH 1
+
+#include <string>
+#include <string_view>
+
+
+// Access to single fields of a JSON text without building a document.  A view refers
+// to one value in the text, looking up a member or iterating over an array only scans
+// as far as needed.  Strings are decoded only when asked for.  The text must outlive
+// the views.
+struct json_view {
+  json_view() = default;
+  explicit json_view(std::string_view text_);
+
+  bool valid() const { return ! text.empty(); }
+  bool is_string() const { return valid() && text.front() == '"'; }
+  bool is_object() const { return valid() && text.front() == '{'; }
+  bool is_array() const { return valid() && text.front() == '['; }
+
+  // The member of an object, an invalid view if there is none.
+  json_view operator[](std::string_view key) const;
+
+  // Like the jsoncpp functions: strings are decoded, other values are returned as they
+  // appear in the text, missing values give an empty string.
+  std::string as_string() const;
+  bool as_bool() const;
+  unsigned as_uint() const;
+
+  // Compare a string value without decoding it.
+  bool operator==(std::string_view s) const;
+
+  // Call the function for each element of an array.
+  template<typename F>
+  void for_each(F fct) const
+  {
+    if (! is_array())
+      return;
+    for (auto p = skip_ws(text.substr(1)); ! p.empty() && p.front() != ']'; ) {
+      auto len = value_length(p);
+      if (len == 0)
+        return;
+      fct(json_view(p.substr(0, len)));
+      p = skip_ws(p.substr(len));
+      if (p.empty() || p.front() != ',')
+        return;
+      p = skip_ws(p.substr(1));
+    }
+  }
+
+  std::string_view text;
+
+  // Length of the value at the start of the text, zero if it is malformed or incomplete.
+  static size_t value_length(std::string_view s);
+  static std::string_view skip_ws(std::string_view s);
+};
+
+#endif // jsonview.hh
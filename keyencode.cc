@@ -0,0 +1,128 @@
+#include "keyencode.hh"
+
+#include <stdexcept>
+
+#include <turbojpeg.h>
+
+#include "imagescale.hh"
+#include "metrics.hh"
+
+
+namespace {
+
+  struct compressor {
+    compressor()
+    : handle(tjInitCompress())
+    {
+      if (handle == nullptr)
+        throw std::runtime_error("cannot create JPEG compressor");
+    }
+    ~compressor()
+    {
+      tjDestroy(handle);
+      if (buf != nullptr)
+        tjFree(buf);
+    }
+
+    tjhandle handle;
+    // The output buffer is allocated for the largest possible size and reused.
+    unsigned char* buf = nullptr;
+    unsigned long bufsize = 0;
+    std::vector<unsigned char> pixels;
+    std::vector<unsigned char> oriented;
+  };
+  thread_local compressor tls;
+
+
+  int tj_subsampling(unsigned subsampling)
+  {
+    switch (subsampling) {
+    case 420:
+      return TJSAMP_420;
+    case 422:
+      return TJSAMP_422;
+    case 444:
+      return TJSAMP_444;
+    default:
+      throw std::runtime_error("invalid JPEG subsampling " + std::to_string(subsampling));
+    }
+  }
+
+} // anonymous namespace
+
+
+jpeg_encoder::jpeg_encoder(unsigned width_, unsigned height_, unsigned rotation, bool hor_flip, bool ver_flip, const jpeg_settings& settings_)
+: width(width_), height(height_), outwidth(width_), outheight(height_), settings(settings_)
+{
+  tj_subsampling(settings.subsampling);
+  if (rotation % 90 != 0)
+    throw std::runtime_error("invalid key rotation " + std::to_string(rotation));
+  rotation %= 360;
+  if (rotation == 0 && ! hor_flip && ! ver_flip)
+    return;
+
+  // The image is flipped and then rotated clockwise.
+  if (rotation == 90 || rotation == 270)
+    std::swap(outwidth, outheight);
+  remap.resize(outwidth * outheight);
+  for (unsigned dy = 0; dy < outheight; ++dy)
+    for (unsigned dx = 0; dx < outwidth; ++dx) {
+      unsigned x = dx;
+      unsigned y = dy;
+      if (rotation == 90) {
+        x = dy;
+        y = height - 1 - dx;
+      } else if (rotation == 180) {
+        x = width - 1 - dx;
+        y = height - 1 - dy;
+      } else if (rotation == 270) {
+        x = width - 1 - dy;
+        y = dx;
+      }
+      if (hor_flip)
+        x = width - 1 - x;
+      if (ver_flip)
+        y = height - 1 - y;
+      remap[dy * outwidth + dx] = y * width + x;
+    }
+}
+
+
+std::span<const unsigned char> jpeg_encoder::encode(const Magick::Image& image, bool reduced)
+{
+  static auto& encode_time = metrics::get_histogram("deck.encode");
+
+  metrics::timer t(encode_time);
+
+  Magick::Image src(scale_image(image, width, height));
+  tls.pixels.resize(3 * width * height);
+  src.write(0, 0, width, height, "RGB", Magick::CharPixel, tls.pixels.data());
+
+  const unsigned char* in = tls.pixels.data();
+  if (! remap.empty()) {
+    tls.oriented.resize(3 * outwidth * outheight);
+    for (unsigned i = 0; i < outwidth * outheight; ++i) {
+      tls.oriented[3 * i + 0] = in[3 * remap[i] + 0];
+      tls.oriented[3 * i + 1] = in[3 * remap[i] + 1];
+      tls.oriented[3 * i + 2] = in[3 * remap[i] + 2];
+    }
+    in = tls.oriented.data();
+  }
+
+  auto samp = tj_subsampling(settings.subsampling);
+  auto needed = tjBufSize(outwidth, outheight, samp);
+  if (tls.bufsize < needed) {
+    if (tls.buf != nullptr)
+      tjFree(tls.buf);
+    tls.buf = tjAlloc(needed);
+    tls.bufsize = tls.buf == nullptr ? 0 : needed;
+    if (tls.buf == nullptr)
+      return {};
+  }
+
+  unsigned long len = tls.bufsize;
+  if (tjCompress2(tls.handle, in, outwidth, 0, outheight, TJPF_RGB, &tls.buf, &len, samp, reduced ? settings.reduced_quality : settings.quality, TJFLAG_NOREALLOC | TJFLAG_FASTDCT) != 0)
+    return {};
+
+  return { tls.buf, len };
+}
@@ -0,0 +1,43 @@
+#ifndef _KEYENCODE_HH
+#define _KEYENCODE_HH 1
+
+#include <span>
+#include <vector>
+
+#include <Magick++.h>
+
+
+// Parameters of the JPEG compression of key images.
+struct jpeg_settings {
+  int quality = 90;
+  // Used for keys which are not critical while the device falls behind.
+  int reduced_quality = 50;
+  // Chroma subsampling: 444, 422, or 420.  Without subsampling colored text stays sharp.
+  unsigned subsampling = 444;
+};
+
+
+// Encoder for the key images of devices using JPEG.  The images are brought into the
+// orientation the device expects and compressed directly from the pixel data, without
+// going through ImageMagick's encoder.  The compressor is kept for each thread, one
+// object can be used by several threads.
+struct jpeg_encoder {
+  jpeg_encoder(unsigned width_, unsigned height_, unsigned rotation, bool hor_flip, bool ver_flip, const jpeg_settings& settings_);
+
+  // The result remains valid until the next call in the same thread.  It is empty
+  // if the image could not be encoded.
+  std::span<const unsigned char> encode(const Magick::Image& image, bool reduced = false);
+
+private:
+  const unsigned width;
+  const unsigned height;
+  // Size of the image sent to the device.  Differs from the key size if rotated.
+  unsigned outwidth;
+  unsigned outheight;
+  const jpeg_settings settings;
+  // For each pixel of the output image the index of the pixel in the key image.  Empty
+  // if the orientation of the device matches.
+  std::vector<unsigned> remap;
+};
+
+#endif // keyencode.hh
@@ -0,0 +1,89 @@
+#include "keylayers.hh"
+
+#include <cassert>
+
+#include "imagescale.hh"
+#include "metrics.hh"
+
+
+void key_layers::set(layer l, const std::string& id, const Magick::Image& image)
+{
+  auto idx = unsigned(l);
+  auto& lv = levels[idx];
+  if (lv.image && lv.id == id)
+    return;
+
+  lv.id = id;
+  lv.image = image;
+  lv.fct = nullptr;
+  invalidate(idx);
+}
+
+
+void key_layers::draw(layer l, const std::string& id, draw_fct fct)
+{
+  auto idx = unsigned(l);
+  assert(idx > 0);
+  auto& lv = levels[idx];
+  if (lv.fct && lv.id == id)
+    return;
+
+  lv.id = id;
+  lv.image.reset();
+  lv.fct = std::move(fct);
+  invalidate(idx);
+}
+
+
+void key_layers::clear(layer l)
+{
+  auto idx = unsigned(l);
+  auto& lv = levels[idx];
+  if (! lv.image && ! lv.fct)
+    return;
+
+  lv.id.clear();
+  lv.image.reset();
+  lv.fct = nullptr;
+  invalidate(idx);
+}
+
+
+void key_layers::invalidate(unsigned idx)
+{
+  for (; idx < nlayers; ++idx)
+    levels[idx].composite.reset();
+}
+
+
+const Magick::Image& key_layers::composite(unsigned idx)
+{
+  static std::array<metrics::histogram*,nlayers> layer_time{
+    &metrics::get_histogram("layer.background"),
+    &metrics::get_histogram("layer.icon"),
+    &metrics::get_histogram("layer.text"),
+    &metrics::get_histogram("layer.overlay")
+  };
+
+  auto& lv = levels[idx];
+  if (lv.composite)
+    return *lv.composite;
+
+  if (idx == 0) {
+    assert(lv.image);
+    lv.composite = *lv.image;
+  } else {
+    const auto& below = composite(idx - 1);
+    if (lv.fct) {
+      metrics::timer t(*layer_time[idx]);
+      lv.composite = lv.fct(below);
+    } else if (lv.image) {
+      metrics::timer t(*layer_time[idx]);
+      lv.composite = below;
+      lv.composite->composite(scale_image(*lv.image, below.columns(), below.rows()), 0, 0, Magick::OverCompositeOp);
+    } else
+      lv.composite = below;
+  }
+
+  return *lv.composite;
+}
@@ -0,0 +1,54 @@
+#ifndef _KEYLAYERS_HH
+#define _KEYLAYERS_HH 1
+
+#include <array>
+#include <functional>
+#include <optional>
+#include <string>
+
+#include <Magick++.h>
+
+
+// The image of a key is built from layers, from the bottom: background, icon, text, and
+// overlay.  The composite of the layers up to each level is kept so that a change of a
+// layer only requires the layers above it to be drawn again.  Each layer content has an
+// identifier, setting a layer to the content it already has costs nothing.
+struct key_layers {
+  enum struct layer : unsigned {
+    background,
+    icon,
+    text,
+    overlay,
+  };
+  static constexpr unsigned nlayers = 4;
+
+  // The function draws the layer onto a copy of the composite of the lower layers.  It
+  // is called again if a lower layer changes and therefore must not refer to temporary
+  // objects.
+  using draw_fct = std::function<Magick::Image(const Magick::Image& below)>;
+
+  // Use the image for the layer, it is composited over the lower layers.
+  void set(layer l, const std::string& id, const Magick::Image& image);
+  // Draw the layer with the function.
+  void draw(layer l, const std::string& id, draw_fct fct);
+  // Remove the layer.
+  void clear(layer l);
+
+  // The composite of all layers.  The background layer must be set.
+  const Magick::Image& image() { return composite(nlayers - 1); }
+
+private:
+  const Magick::Image& composite(unsigned idx);
+  void invalidate(unsigned idx);
+
+  struct level {
+    std::string id;
+    std::optional<Magick::Image> image;
+    draw_fct fct;
+    // The composite of this and all lower layers, if known.
+    std::optional<Magick::Image> composite;
+  };
+  std::array<level,nlayers> levels;
+};
+
+#endif // keylayers.hh
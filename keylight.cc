@@ -0,0 +1,304 @@
+#include "keylight.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "jsonview.hh"
+
+
+using namespace std::string_literals;
+
+
+namespace {
+
+  int connect_to(const std::string& host, const std::string& port)
+  {
+    addrinfo hints;
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+      throw std::runtime_error("cannot resolve "s + host);
+
+    int fd = -1;
+    for (auto ai = res; ai != nullptr; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+      if (fd == -1)
+        continue;
+      if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+      throw std::runtime_error("cannot connect to "s + host);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // The lights answer within a few milliseconds.  Do not let one which dropped off
+    // the network hold up later requests forever.
+    timeval tv{ 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    return fd;
+  }
+
+
+  // Read one response.  Returns the status code, zero if the connection failed.
+  unsigned read_response(int fd, bool& keep, std::string* body)
+  {
+    std::string buf;
+    char tmp[1024];
+    size_t hdrend;
+    while ((hdrend = buf.find("\r\n\r\n")) == std::string::npos) {
+      auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+      if (n <= 0)
+        return 0;
+      buf.append(tmp, n);
+    }
+
+    std::string hdr = buf.substr(0, hdrend);
+    std::transform(hdr.begin(), hdr.end(), hdr.begin(), [](char c){ return std::tolower(c); });
+    if (! hdr.starts_with("http/1."))
+      return 0;
+    unsigned status = std::atoi(hdr.c_str() + 9);
+    keep = hdr.find("\r\nconnection: close") == std::string::npos;
+
+    size_t len = 0;
+    if (auto cl = hdr.find("\r\ncontent-length:"); cl != std::string::npos)
+      len = std::strtoul(hdr.c_str() + cl + 17, nullptr, 10);
+    else
+      keep = false;
+    while (buf.size() < hdrend + 4 + len) {
+      auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+      if (n <= 0)
+        return 0;
+      buf.append(tmp, n);
+    }
+
+    if (body != nullptr)
+      *body = buf.substr(hdrend + 4, len);
+    return status;
+  }
+
+
+  keylight::settings parse_state(const std::string& body)
+  {
+    keylight::settings res;
+    json_view(body)["lights"].for_each([&res](json_view l){
+      if (res.on != -1)
+        return;
+      res.on = l["on"].as_uint() != 0;
+      res.brightness = l["brightness"].as_uint();
+      // The lights use mired, the settings Kelvin.
+      res.temperature = std::lround(1000000.0 / std::max(1u, l["temperature"].as_uint()));
+    });
+    if (res.on == -1)
+      throw std::runtime_error("invalid light state");
+    return res;
+  }
+
+} // anonymous namespace
+
+
+keylight::keylight(const std::string& serial_, const std::string& url)
+: serial(serial_), call_latency(metrics::get_histogram("keylight." + serial_ + ".call")),
+  preset_latency(metrics::get_histogram("keylight." + serial_ + ".preset")),
+  failures(metrics::get_counter("keylight." + serial_ + ".failures")),
+  superseded(metrics::get_counter("keylight." + serial_ + ".superseded"))
+{
+  // The URL has the form http://HOST:PORT with an optional path.
+  std::string_view u(url);
+  if (auto p = u.find("://"); p != std::string_view::npos)
+    u.remove_prefix(p + 3);
+  u = u.substr(0, u.find('/'));
+  auto colon = u.rfind(':');
+  if (colon != std::string_view::npos && u.find(']', colon) == std::string_view::npos) {
+    host = u.substr(0, colon);
+    port = u.substr(colon + 1);
+  } else {
+    host = u;
+    port = "9123";
+  }
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+    host = host.substr(1, host.size() - 2);
+
+  thread = std::thread([this]{ run(); });
+}
+
+
+keylight::~keylight()
+{
+  {
+    std::lock_guard guard(lock);
+    stop = true;
+    cv.notify_one();
+  }
+  thread.join();
+}
+
+
+std::string keylight::request(const settings& s) const
+{
+  std::string body = "{\"numberOfLights\":1,\"lights\":[{";
+  const char* sep = "";
+  if (s.on != -1) {
+    body += "\"on\":"s + (s.on ? "1" : "0");
+    sep = ",";
+  }
+  if (s.brightness != -1) {
+    body += sep + "\"brightness\":"s + std::to_string(std::clamp(s.brightness, 0, 100));
+    sep = ",";
+  }
+  if (s.temperature != -1) {
+    auto mired = std::lround(1000000.0 / std::clamp(s.temperature, 2900, 7000));
+    body += sep + "\"temperature\":"s + std::to_string(std::clamp(mired, 143l, 344l));
+  }
+  body += "}]}";
+
+  return "PUT /elgato/lights HTTP/1.1\r\nHost: "s + host + ":" + port +
+    "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) +
+    "\r\n\r\n" + body;
+}
+
+
+void keylight::submit(op o, int delta, std::shared_ptr<completion> done)
+{
+  std::lock_guard guard(lock);
+  commands.emplace_back(o, delta, std::move(done));
+  cv.notify_one();
+}
+
+
+void keylight::set_preset(const std::string* req)
+{
+  std::lock_guard guard(lock);
+  if (preset != nullptr)
+    ++superseded;
+  preset = req;
+  cv.notify_one();
+}
+
+
+void keylight::run()
+{
+  std::unique_lock guard(lock);
+  while (true) {
+    cv.wait(guard, [this]{ return stop || preset != nullptr || ! commands.empty(); });
+    if (stop)
+      break;
+
+    if (auto req = std::exchange(preset, nullptr); req != nullptr) {
+      guard.unlock();
+      try {
+        {
+          metrics::timer t(preset_latency);
+          transfer(*req, nullptr);
+        }
+        // The state is shown in the icons of the keys.
+        execute(op::query, 0);
+      }
+      catch (const std::exception& e) {
+        ++failures;
+        std::cout << "keylight " << serial << ": " << e.what() << std::endl;
+      }
+    } else {
+      auto c = std::move(commands.front());
+      commands.pop_front();
+      guard.unlock();
+      try {
+        metrics::timer t(call_latency);
+        execute(c.o, c.delta);
+      }
+      catch (const std::exception& e) {
+        ++failures;
+        std::cout << "keylight " << serial << ": " << e.what() << std::endl;
+      }
+      if (c.done)
+        c.done->arrive();
+    }
+
+    guard.lock();
+  }
+
+  if (fd != -1)
+    close(fd);
+}
+
+
+void keylight::execute(op o, int delta)
+{
+  // Other programs change the lights as well, the relative changes start from the
+  // current state.
+  std::string body;
+  transfer("GET /elgato/lights HTTP/1.1\r\nHost: "s + host + ":" + port + "\r\n\r\n", &body);
+  auto cur = parse_state(body);
+  on = cur.on;
+
+  settings s;
+  switch (o) {
+  case op::query:
+    return;
+  case op::toggle:
+    s.on = ! cur.on;
+    break;
+  case op::brightness:
+    s.brightness = cur.brightness + delta;
+    break;
+  case op::temperature:
+    s.temperature = cur.temperature + delta;
+    break;
+  }
+  transfer(request(s), nullptr);
+  if (s.on != -1)
+    on = s.on;
+}
+
+
+unsigned keylight::transfer(const std::string& req, std::string* body)
+{
+  // The light might have closed an idle connection, try once more on a new one.
+  for (unsigned attempt = 0; attempt < 2; ++attempt) {
+    if (fd == -1)
+      fd = connect_to(host, port);
+
+    bool keep = false;
+    unsigned status = 0;
+    size_t off = 0;
+    while (off < req.size()) {
+      auto n = ::send(fd, req.data() + off, req.size() - off, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      off += n;
+    }
+    if (off == req.size())
+      status = read_response(fd, keep, body);
+
+    if (status == 0 || ! keep) {
+      close(fd);
+      fd = -1;
+    }
+    if (status != 0) {
+      if (status < 200 || status >= 300)
+        throw std::runtime_error("request rejected with status "s + std::to_string(status));
+      return status;
+    }
+  }
+  throw std::runtime_error("cannot send request to "s + host);
+}
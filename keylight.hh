@@ -0,0 +1,91 @@
+#ifndef _KEYLIGHT_HH
+#define _KEYLIGHT_HH 1
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "metrics.hh"
+
+
+// One Elgato light.  All requests are sent by the light's own thread over a persistent
+// HTTP connection to the /elgato/lights endpoint, none of the functions wait for the
+// network.  Commands are executed in order, of the presets only the most recent one is
+// kept.
+struct keylight {
+  keylight(const std::string& serial_, const std::string& url);
+  ~keylight();
+
+  // Absolute settings, -1 for those which are not changed.  The temperature is in Kelvin.
+  struct settings {
+    int on = -1;
+    int brightness = -1;
+    int temperature = -1;
+  };
+  // The HTTP request setting the light.
+  std::string request(const settings& s) const;
+
+  // Counts down as the lights of one command finish, the last one calls the function
+  // from its thread.
+  struct completion {
+    completion(unsigned n, std::function<void()> fct_) : remaining(n), fct(std::move(fct_)) { }
+
+    void arrive() { if (--remaining == 0 && fct) fct(); }
+
+  private:
+    std::atomic<unsigned> remaining;
+    std::function<void()> fct;
+  };
+
+  // The changes are relative to the current state of the light, the brightness in
+  // percent, the temperature in Kelvin.
+  enum struct op {
+    query,
+    toggle,
+    brightness,
+    temperature,
+  };
+  void submit(op o, int delta, std::shared_ptr<completion> done);
+
+  // The request must outlive the light.
+  void set_preset(const std::string* req);
+
+  // The last known state, -1 if it is not known yet.
+  int is_on() const { return on; }
+
+  const std::string serial;
+  std::string host;
+  std::string port;
+
+private:
+  void run();
+  void execute(op o, int delta);
+  unsigned transfer(const std::string& req, std::string* body);
+
+  int fd = -1;
+  std::atomic<int> on = -1;
+
+  struct command {
+    op o;
+    int delta;
+    std::shared_ptr<completion> done;
+  };
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<command> commands;
+  const std::string* preset = nullptr;
+  bool stop = false;
+  std::thread thread;
+
+  metrics::histogram& call_latency;
+  metrics::histogram& preset_latency;
+  metrics::counter& failures;
+  metrics::counter& superseded;
+};
+
+#endif // keylight.hh
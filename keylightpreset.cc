@@ -0,0 +1,66 @@
+#include "keylightpreset.hh"
+
+#include <map>
+#include <stdexcept>
+
+
+keylight_presets::keylight_presets(const libconfig::Setting& config, std::list<keylight>& lights)
+{
+  if (! config.isList())
+    throw std::runtime_error("keylight_presets must be a list");
+
+  // Entries for the same scene are merged in order, later ones override.
+  std::map<std::string,std::vector<keylight::settings>> merged;
+  for (const auto& entry : config) {
+    std::string scene;
+    if (! entry.isGroup() || ! entry.lookupValue("scene", scene))
+      throw std::runtime_error("keylight preset needs a scene name");
+    std::string serial;
+    entry.lookupValue("serial", serial);
+
+    keylight::settings s;
+    bool on;
+    if (entry.lookupValue("on", on))
+      s.on = on;
+    entry.lookupValue("brightness", s.brightness);
+    entry.lookupValue("temperature", s.temperature);
+    if (s.on == -1 && (s.brightness != -1 || s.temperature != -1))
+      s.on = 1;
+
+    auto& v = merged[scene];
+    v.resize(lights.size());
+    unsigned i = 0;
+    for (auto& l : lights) {
+      if (serial.empty() || serial == l.serial) {
+        if (s.on != -1)
+          v[i].on = s.on;
+        if (s.brightness != -1)
+          v[i].brightness = s.brightness;
+        if (s.temperature != -1)
+          v[i].temperature = s.temperature;
+      }
+      ++i;
+    }
+  }
+
+  for (auto& [scene, v] : merged) {
+    auto& reqs = presets[scene];
+    unsigned i = 0;
+    for (auto& l : lights) {
+      auto& s = v[i++];
+      if (s.on != -1 || s.brightness != -1 || s.temperature != -1)
+        reqs.emplace_back(&l, l.request(s));
+    }
+  }
+}
+
+
+void keylight_presets::apply(const std::string& scene)
+{
+  auto it = presets.find(scene);
+  if (it == presets.end())
+    return;
+
+  for (auto& [l, req] : it->second)
+    l->set_preset(&req);
+}
@@ -0,0 +1,31 @@
+#ifndef _KEYLIGHTPRESET_HH
+#define _KEYLIGHTPRESET_HH 1
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <libconfig.h++>
+
+#include "keylight.hh"
+
+
+// Light settings which follow the OBS program scene.  The configuration is a list of
+// entries with the scene name and the absolute settings, optionally restricted to the
+// light with the given serial number.  The HTTP requests setting the lights are created
+// when the configuration is read and handed to the threads of the lights.  Only the most
+// recent request for a light is kept, a preset which has not been sent yet when the
+// scene changes again is dropped.
+struct keylight_presets {
+  keylight_presets(const libconfig::Setting& config, std::list<keylight>& lights);
+
+  // Does not block.
+  void apply(const std::string& scene);
+
+private:
+  std::unordered_map<std::string,std::vector<std::pair<keylight*,std::string>>> presets;
+};
+
+#endif // keylightpreset.hh
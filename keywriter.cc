@@ -0,0 +1,301 @@
+#include "keywriter.hh"
+
+#include <cassert>
+#include <string_view>
+
+#include "imagescale.hh"
+#include "realtime.hh"
+
+
+local_device::local_device(streamdeck::device_type& dev_, const jpeg_settings& jpeg)
+: key_device(dev_.key_count, dev_.key_cols, dev_.key_pixel_width, dev_.key_pixel_height), dev(dev_)
+{
+  if (std::string_view(dev.key_image_format) == "JPEG")
+    encoder.emplace(key_pixel_width, key_pixel_height, dev.key_rotation, dev.key_hor_flip, dev.key_ver_flip, jpeg);
+}
+
+
+std::vector<unsigned char> local_device::read()
+{
+  auto ss = dev.read();
+  return std::vector<unsigned char>(ss.begin(), ss.end());
+}
+
+
+size_t local_device::set_key_image(unsigned key, Magick::Image&& image, bool reduced)
+{
+  if (encoder)
+    if (auto data = encoder->encode(image, reduced); ! data.empty()) {
+      dev.set_key_image(key, data.data(), data.size());
+      return data.size();
+    }
+
+  dev.set_key_image(key / key_cols, key % key_cols, std::move(image));
+  return 0;
+}
+
+
+key_writer::key_writer(key_device& dev_, const std::string& name)
+: dev(dev_), keys(dev.key_count), reduced(dev.key_count),
+  writes(metrics::get_counter("deck." + name + ".writes")),
+  coalesced(metrics::get_counter("deck." + name + ".coalesced")),
+  queue_latency(metrics::get_histogram("deck." + name + ".queue_latency")),
+  write_time(metrics::get_histogram("deck." + name + ".write")),
+  bytes(metrics::get_counter("deck." + name + ".bytes")),
+  bytes_per_second(metrics::get_counter("deck." + name + ".bytes_per_second")),
+  pressure_count(metrics::get_counter("deck." + name + ".pressure")),
+  reduced_writes(metrics::get_counter("deck." + name + ".reduced")),
+  restored_writes(metrics::get_counter("deck." + name + ".restored"))
+{
+  thread = std::thread(&key_writer::run, this);
+}
+
+
+key_writer::~key_writer()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    terminate = true;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+
+int key_writer::register_image(Magick::Image&& image)
+{
+  auto scaled = scale_image(image, dev.key_pixel_width, dev.key_pixel_height);
+  std::lock_guard<std::mutex> guard(devlock);
+  return dev.register_image(std::move(scaled));
+}
+
+
+void key_writer::set_key_image(unsigned key, int handle)
+{
+  enqueue(key, handle, nullptr, true);
+}
+
+
+void key_writer::set_key_image(unsigned key, const Magick::Image& image, bool critical)
+{
+  enqueue(key, -1, &image, critical);
+}
+
+
+void key_writer::set_brightness(unsigned percent)
+{
+  std::lock_guard<std::mutex> guard(devlock);
+  dev.set_brightness(percent);
+}
+
+
+void key_writer::enqueue(unsigned key, int handle, const Magick::Image* image, bool critical)
+{
+  assert(key < keys.size());
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto& e = keys[key];
+    if (e.pending) {
+      ++coalesced;
+      if (critical && ! e.critical) {
+        std::erase(order_low, key);
+        order.push_back(key);
+        e.critical = true;
+      }
+    } else {
+      e.pending = true;
+      e.critical = critical;
+      e.queued = metrics::clock_type::now();
+      (critical ? order : order_low).push_back(key);
+    }
+    reduced[key].reset();
+    e.handle = handle;
+    if (image != nullptr)
+      // Magick::Image objects share the pixel data, this is no deep copy.
+      e.image = *image;
+    else
+      e.image.reset();
+  }
+  cv.notify_one();
+}
+
+
+void key_writer::run()
+{
+  realtime::enter("writer");
+
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    cv.wait(guard, [this]{ return terminate || ! order.empty() || ! order_low.empty(); });
+    if (terminate)
+      break;
+
+    auto& queue = order.empty() ? order_low : order;
+    auto key = queue.front();
+    queue.pop_front();
+    auto e = std::move(keys[key]);
+    keys[key] = entry();
+
+    auto waited = metrics::clock_type::now() - e.queued;
+    if (! pressure && waited >= pressure_latency) {
+      pressure = true;
+      ++pressure_count;
+    }
+    bool lowq = pressure && ! e.critical && e.image;
+    guard.unlock();
+
+    queue_latency.add(waited);
+
+    std::optional<Magick::Image> kept;
+    if (e.image) {
+      e.image = scale_image(*e.image, dev.key_pixel_width, dev.key_pixel_height);
+      if (lowq)
+        kept = *e.image;
+    }
+
+    size_t n = 0;
+    auto start = metrics::clock_type::now();
+    {
+      std::lock_guard<std::mutex> devguard(devlock);
+      if (e.image)
+        n = dev.set_key_image(key, std::move(*e.image), lowq);
+      else
+        dev.set_key_image(key, e.handle);
+    }
+    auto duration = metrics::clock_type::now() - start;
+    write_time.add(duration);
+    ++writes;
+    bytes += n;
+
+    // The rate is that of the writes alone, idle time does not count.
+    rate_bytes += n;
+    rate_time += duration;
+    if (rate_time >= std::chrono::milliseconds(250)) {
+      bytes_per_second.set(rate_bytes * 1000000 / std::chrono::duration_cast<std::chrono::microseconds>(rate_time).count());
+      rate_bytes = 0;
+      rate_time = {};
+    }
+
+    guard.lock();
+    if (lowq) {
+      ++reduced_writes;
+      // Unless a newer image was queued in the meantime.
+      if (! keys[key].pending)
+        reduced[key] = std::move(kept);
+    }
+
+    if (pressure && order.empty() && order_low.empty()) {
+      pressure = false;
+      auto now = metrics::clock_type::now();
+      for (unsigned k = 0; k < reduced.size(); ++k)
+        if (reduced[k]) {
+          keys[k] = entry{ true, false, -1, std::move(reduced[k]), now };
+          reduced[k].reset();
+          order_low.push_back(k);
+          ++restored_writes;
+        }
+    }
+  }
+}
+
+
+void deck_output::add(key_device& dev, const std::string& name)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  assert(handles.empty());
+  writers.emplace_back(std::make_unique<key_writer>(dev, name));
+}
+
+
+int deck_output::add_image(Magick::Image&& image, bool keep)
+{
+  // Scale only once if all devices have the same key size.
+  image = scale_image(image, writers.front()->dev.key_pixel_width, writers.front()->dev.key_pixel_height);
+  bool seethrough = ! is_opaque(image);
+  std::optional<Magick::Image> kept;
+  if (keep || seethrough)
+    kept = image;
+
+  std::vector<int> hs;
+  for (size_t i = 1; i < writers.size(); ++i)
+    hs.emplace_back(writers[i]->register_image(Magick::Image(image)));
+  hs.insert(hs.begin(), writers.front()->register_image(std::move(image)));
+
+  std::lock_guard<std::mutex> guard(lock);
+  handles.emplace_back(std::move(hs));
+  images.emplace_back(std::move(kept));
+  transparent.push_back(seethrough);
+  return handles.size() - 1;
+}
+
+
+void deck_output::set_key_image(unsigned key, int handle)
+{
+  static auto& composite_time = metrics::get_histogram("deck.composite");
+
+  std::unique_lock<std::mutex> guard(lock);
+  if (key < background.size() && background[key] != -1 && transparent[handle]) {
+    auto tile = background[key];
+    if (auto it = composites.find({ tile, handle }); it != composites.end())
+      handle = it->second;
+    else {
+      Magick::Image image(*images[tile]);
+      Magick::Image icon(*images[handle]);
+      guard.unlock();
+
+      {
+        metrics::timer t(composite_time);
+        image.composite(scale_image(icon, image.columns(), image.rows()), 0, 0, Magick::OverCompositeOp);
+      }
+      auto newhandle = register_image(std::move(image));
+
+      guard.lock();
+      handle = composites.try_emplace({ tile, handle }, newhandle).first->second;
+    }
+  }
+
+  const auto& hs = handles[handle];
+  for (size_t i = 0; i < writers.size(); ++i)
+    writers[i]->set_key_image(key, hs[i]);
+}
+
+
+void deck_output::set_key_image(unsigned key, Magick::Image&& image, bool critical)
+{
+  static auto& composite_time = metrics::get_histogram("deck.composite");
+
+  std::unique_lock<std::mutex> guard(lock);
+  if (key < background.size() && background[key] != -1 && ! is_opaque(image)) {
+    Magick::Image tile(*images[background[key]]);
+    guard.unlock();
+
+    metrics::timer t(composite_time);
+    tile.composite(scale_image(image, tile.columns(), tile.rows()), 0, 0, Magick::OverCompositeOp);
+    image = std::move(tile);
+  } else
+    guard.unlock();
+
+  for (auto& w : writers)
+    w->set_key_image(key, image, critical);
+}
+
+
+bool deck_output::valid_handle(int handle)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return handle >= 0 && size_t(handle) < handles.size();
+}
+
+
+void deck_output::set_background(const std::vector<int>& tiles)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  background = tiles;
+}
+
+
+void deck_output::set_brightness(unsigned percent)
+{
+  for (auto& w : writers)
+    w->set_brightness(percent);
+}
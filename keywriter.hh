@@ -0,0 +1,172 @@
+#ifndef _KEYWRITER_HH
+#define _KEYWRITER_HH 1
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <streamdeckpp.hh>
+#include <Magick++.h>
+
+#include "keyencode.hh"
+#include "metrics.hh"
+
+
+// The devices used by the daemon.  Either a directly attached device or a device
+// attached to a remote agent.
+struct key_device {
+  key_device(unsigned key_count_, unsigned key_cols_, unsigned key_pixel_width_, unsigned key_pixel_height_)
+  : key_count(key_count_), key_cols(key_cols_), key_pixel_width(key_pixel_width_), key_pixel_height(key_pixel_height_)
+  {
+  }
+  virtual ~key_device() = default;
+
+  // Wait for the next change of the key states.
+  virtual std::vector<unsigned char> read() = 0;
+  // Called after the result of read has been handled.
+  virtual void input_handled() { }
+
+  virtual int register_image(Magick::Image&& image) = 0;
+  virtual void set_key_image(unsigned key, int handle) = 0;
+  // With reduced set the image can be sent with lower quality.  Returns the number of
+  // bytes sent, zero if not known.
+  virtual size_t set_key_image(unsigned key, Magick::Image&& image, bool reduced) = 0;
+  virtual void set_brightness(unsigned percent) = 0;
+
+  const unsigned key_count;
+  const unsigned key_cols;
+  const unsigned key_pixel_width;
+  const unsigned key_pixel_height;
+};
+
+
+struct local_device final : key_device {
+  local_device(streamdeck::device_type& dev_, const jpeg_settings& jpeg = jpeg_settings());
+
+  std::vector<unsigned char> read() override;
+
+  int register_image(Magick::Image&& image) override { return dev.register_image(std::move(image)); }
+  void set_key_image(unsigned key, int handle) override { dev.set_key_image(key, handle); }
+  size_t set_key_image(unsigned key, Magick::Image&& image, bool reduced) override;
+  void set_brightness(unsigned percent) override { dev.set_brightness(percent); }
+
+private:
+  streamdeck::device_type& dev;
+  // Only for devices using JPEG images.
+  std::optional<jpeg_encoder> encoder;
+};
+
+
+// Asynchronous writer of the key images of one device.  Requests for the same key are
+// coalesced, only the newest image is written.  A slow device therefore skips
+// intermediate images instead of falling behind and it does not delay other devices.
+//
+// Critical keys (registered images and keys showing state, like the tally of scenes)
+// are written before the others.  Once a request had to wait too long the images of
+// the other keys are sent with reduced quality.  When the queue is empty again those
+// keys are written once more with full quality.
+struct key_writer {
+  key_writer(key_device& dev_, const std::string& name);
+  ~key_writer();
+
+  int register_image(Magick::Image&& image);
+  void set_key_image(unsigned key, int handle);
+  void set_key_image(unsigned key, const Magick::Image& image, bool critical);
+  void set_brightness(unsigned percent);
+
+  key_device& dev;
+
+private:
+  void enqueue(unsigned key, int handle, const Magick::Image* image, bool critical);
+  void run();
+
+  struct entry {
+    bool pending = false;
+    bool critical = false;
+    int handle = -1;
+    std::optional<Magick::Image> image;
+    metrics::clock_type::time_point queued;
+  };
+  std::vector<entry> keys;
+  std::deque<unsigned> order;
+  std::deque<unsigned> order_low;
+
+  // Waiting longer than this means the device cannot keep up.
+  static constexpr auto pressure_latency = std::chrono::milliseconds(100);
+  bool pressure = false;
+  // The images last written with reduced quality.
+  std::vector<std::optional<Magick::Image>> reduced;
+  // Bytes and time of the writes since the rate was last updated.
+  uint64_t rate_bytes = 0;
+  metrics::clock_type::duration rate_time{};
+
+  // Serializes all accesses to the device.
+  std::mutex devlock;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  bool terminate = false;
+  std::thread thread;
+
+  metrics::counter& writes;
+  metrics::counter& coalesced;
+  metrics::histogram& queue_latency;
+  metrics::histogram& write_time;
+  metrics::counter& bytes;
+  metrics::counter& bytes_per_second;
+  metrics::counter& pressure_count;
+  metrics::counter& reduced_writes;
+  metrics::counter& restored_writes;
+};
+
+
+// The images are shown on a primary device and any number of mirrors.  Images are
+// rendered once and handed to the writers of all the devices.  The handles returned
+// by register_image are only valid for this object, they are translated to the handles
+// of the individual devices.
+//
+// The keys can have background images, cut from a wallpaper.  Images with transparent
+// parts are then composited onto the background of the key.  For registered images
+// the result is registered as well so that it is composited and encoded only once.
+struct deck_output {
+  void add(key_device& dev, const std::string& name);
+
+  int register_image(Magick::Image&& image) { return add_image(std::move(image), false); }
+  void set_key_image(unsigned key, int handle);
+  // Images of keys which are not critical may be sent with lower quality.
+  void set_key_image(unsigned key, Magick::Image&& image, bool critical = true);
+  void set_brightness(unsigned percent);
+
+  // Backgrounds are registered separately, they are needed for compositing.
+  int register_background(Magick::Image&& image) { return add_image(std::move(image), true); }
+  // Set the backgrounds of the keys, registered backgrounds or -1 for no background.
+  void set_background(const std::vector<int>& tiles);
+
+  size_t size() const { return writers.size(); }
+  bool valid_handle(int handle);
+
+private:
+  int add_image(Magick::Image&& image, bool keep);
+
+  std::mutex lock;
+  std::vector<std::unique_ptr<key_writer>> writers;
+  // For each handle the handles for the individual writers.
+  std::vector<std::vector<int>> handles;
+  // The image for each handle, needed for compositing.  Opaque images are not kept,
+  // they hide the background anyway, except for the backgrounds themselves.
+  std::vector<std::optional<Magick::Image>> images;
+  std::vector<bool> transparent;
+
+  std::vector<int> background;
+  // The registered composites for pairs of background and image handle.
+  std::map<std::pair<int,int>,int> composites;
+};
+
+#endif // keywriter.hh
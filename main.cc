@@ -1,8 +1,19 @@
+#include <algorithm>
 #include <cerrno>
+#include <condition_variable>
 #include <cstdlib>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 #include <error.h>
+#include <getopt.h>
 #include <pwd.h>
 #include <unistd.h>
 #include <sys/poll.h>
@@ -23,6 +34,15 @@ extern "C" {
 
 #include "obs.hh"
 #include "ftlibrary.hh"
+#include "imagescale.hh"
+#include "keylight.hh"
+#include "keylightpreset.hh"
+#include "keywriter.hh"
+#include "metrics.hh"
+#include "plugin.hh"
+#include "realtime.hh"
+#include "remote.hh"
+#include "rules.hh"
 extern "C" {
 #include "resources.h"
 }
@@ -89,9 +109,21 @@ namespace {
 
   struct deck_config;
 
+} // anonymous namespace
+
+
+// The key object handed to plugins.
+struct streamdeckd_key {
+  deck_config& deck;
+  const unsigned page;
+  const unsigned key;
+};
+
+
+namespace {
 
   struct action {
-    action(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, const char* default_icon = nullptr) : key(k), dev(dev_)
+    action(unsigned k, const libconfig::Setting& setting, deck_output& dev_, const char* default_icon = nullptr) : key(k), dev(dev_)
     {
       std::string iconname;
       if (! setting.lookupValue("icon", iconname)) {
@@ -104,88 +136,127 @@ namespace {
     virtual ~action() { }
 
     virtual void call() = 0;
+    virtual void release() { }
 
     virtual void show_icon()
     {
       dev.set_key_image(key, icon1);
     }
+    // Called when the page of the key is replaced.
+    virtual void hidden() { }
+
+    bool visible() const { return ! keyrules || keyrules->is_visible(); }
+    // True if the rules hide the key or select the icon.
+    bool overridden() const { return keyrules && (! keyrules->is_visible() || keyrules->icon() != -1); }
+    // Show the icon selected by the rules, if any, or the action's own.
+    void refresh()
+    {
+      if (keyrules && keyrules->icon() != -1)
+        dev.set_key_image(key, keyrules->icon());
+      else
+        show_icon();
+    }
+
+    std::unique_ptr<rules::key_rules> keyrules;
 
   protected:
     unsigned key;
-    streamdeck::device_type& dev;
+    deck_output& dev;
     int icon1;
   };
 
 
+  // The lights controlled by one key.  A command is handed to the threads of all lights
+  // at once and the function is called when the last one is done.  The calling thread
+  // does not wait for the lights.
+  struct keylight_group {
+    keylight_group(bool has_serial, const std::string& serial, std::list<keylight>& keylights)
+    : latency(metrics::get_histogram("keylight.command"))
+    {
+      for (auto& l : keylights)
+        if (! has_serial || serial.empty() || serial == l.serial)
+          lights.emplace_back(&l);
+    }
+
+    size_t size() const { return lights.size(); }
+    keylight& front() { return *lights.front(); }
+
+    void apply(keylight::op o, int delta = 0, std::function<void()> done = nullptr)
+    {
+      auto start = metrics::clock_type::now();
+      auto c = std::make_shared<keylight::completion>(lights.size(), [this, start, done = std::move(done)]{
+        latency.add(metrics::clock_type::now() - start);
+        if (done)
+          done();
+      });
+      for (auto l : lights)
+        l->submit(o, delta, c);
+    }
+
+  private:
+    std::vector<keylight*> lights;
+    metrics::histogram& latency;
+  };
+
+
   struct keylight_toggle final : public action {
     using base_type = action;
 
-    keylight_toggle(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, bool has_serial, std::string& serial_, keylightpp::device_list_type& keylights_)
-    : base_type(k, setting, dev_), serial(has_serial ? serial_ : ""), keylights(keylights_)
+    keylight_toggle(unsigned k, const libconfig::Setting& setting, deck_output& dev_, bool has_serial, std::string& serial_, std::list<keylight>& keylights_, deck_config& deck_, unsigned page_)
+    : base_type(k, setting, dev_), lights(has_serial, serial_, keylights_), deck(deck_), page(page_)
     {
-      nkeylights = 0;
-      for (auto& d : keylights)
-        if (serial == "" || serial == d.serial)
-          ++nkeylights;
-
       std::string icon1name;
       if (! setting.lookupValue("icon_on", icon1name))
         icon1name = "bulb_on.png";
       icon1 = dev.register_image(find_image(icon1name));
 
-      if (nkeylights == 1) {
+      if (lights.size() == 1) {
         std::string icon2name;
         if (! setting.lookupValue("icon_off", icon2name))
           icon2name = "bulb_off.png";
         icon2 = dev.register_image(find_image(icon2name));
+        // The icon shows the state as soon as it is known.
+        lights.apply(keylight::op::query, 0, [this]{ changed(); });
       } else
         icon2 = icon1;
     }
 
     void call() override
     {
-      bool any = false;
-      for (auto& d : keylights)
-        if (serial == "" || serial == d.serial) {
-          d.toggle();
-          any = true;
-        }
-      if (any && nkeylights == 1)
-        show_icon();
+      if (lights.size() == 1)
+        lights.apply(keylight::op::toggle, 0, [this]{ changed(); });
+      else
+        lights.apply(keylight::op::toggle);
     }
 
     void show_icon() override
     {
-      dev.set_key_image(key, nkeylights > 1 || ! keylights.front().state() ? icon1 : icon2);
+      dev.set_key_image(key, lights.size() != 1 || lights.front().is_on() != 1 ? icon1 : icon2);
     }
   private:
-    const std::string serial;
-    keylightpp::device_list_type& keylights;
-    unsigned nkeylights;
+    // Called from the thread of the light.
+    void changed();
+
+    keylight_group lights;
     int icon2;
+    deck_config& deck;
+    unsigned page;
   };
 
 
   struct keylight_color final : public action {
     using base_type = action;
 
-    keylight_color(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, bool has_serial, std::string& serial_, keylightpp::device_list_type& keylights_, int inc_)
-    : base_type(k, setting, dev_, inc_ >= 0 ? "color+.png" : "color-.png"), serial(has_serial ? serial_ : ""), keylights(keylights_), inc(inc_)
+    keylight_color(unsigned k, const libconfig::Setting& setting, deck_output& dev_, bool has_serial, std::string& serial_, std::list<keylight>& keylights_, int inc_)
+    : base_type(k, setting, dev_, inc_ >= 0 ? "color+.png" : "color-.png"), lights(has_serial, serial_, keylights_), inc(inc_)
     {
     }
 
     void call() override {
-      for (auto& d : keylights)
-        if (serial == "" || serial == d.serial) {
-          if (inc < 0)
-            d.color_dec(unsigned(-inc));
-          else
-            d.color_inc(unsigned(inc));
-        }
+      lights.apply(keylight::op::temperature, inc);
     }
   private:
-    const std::string serial;
-    keylightpp::device_list_type& keylights;
+    keylight_group lights;
     const int inc;
   };
 
@@ -193,23 +264,16 @@ namespace {
   struct keylight_brightness final : public action {
     using base_type = action;
 
-    keylight_brightness(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, bool has_serial, std::string& serial_, keylightpp::device_list_type& keylights_, int inc_)
-    : base_type(k, setting, dev_, inc_ >= 0 ? "brightness+.png" : "brightness-.png"), serial(has_serial ? serial_ : ""), keylights(keylights_), inc(inc_)
+    keylight_brightness(unsigned k, const libconfig::Setting& setting, deck_output& dev_, bool has_serial, std::string& serial_, std::list<keylight>& keylights_, int inc_)
+    : base_type(k, setting, dev_, inc_ >= 0 ? "brightness+.png" : "brightness-.png"), lights(has_serial, serial_, keylights_), inc(inc_)
     {
     }
 
     void call() override {
-      for (auto& d : keylights)
-        if (serial == "" || serial == d.serial) {
-          if (inc < 0)
-            d.brightness_dec(unsigned(-inc));
-          else
-            d.brightness_inc(unsigned(inc));
-        }
+      lights.apply(keylight::op::brightness, inc);
     }
   private:
-    const std::string serial;
-    keylightpp::device_list_type& keylights;
+    keylight_group lights;
     const int inc;
   };
 
@@ -217,7 +281,7 @@ namespace {
   struct execute final : public action {
     using base_type = action;
 
-    execute(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, std::string&& command_) : base_type(k, setting, dev_), command(std::move(command_)) { }
+    execute(unsigned k, const libconfig::Setting& setting, deck_output& dev_, std::string&& command_) : base_type(k, setting, dev_), command(std::move(command_)) { }
 
     void call() override {
       auto _ = system(command.c_str());
@@ -232,8 +296,8 @@ namespace {
   struct keypress final : public action {
     using base_type = action;
 
-    keypress(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, std::string&& sequence, xdo_t* xdo_) : base_type(k, setting, dev_), sequence_list(1, std::move(sequence)), xdo(xdo_) { }
-    keypress(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, std::list<std::string>&& sequence_list_, xdo_t* xdo_) : base_type(k, setting, dev_), sequence_list(std::move(sequence_list_)), xdo(xdo_) { }
+    keypress(unsigned k, const libconfig::Setting& setting, deck_output& dev_, std::string&& sequence, xdo_t* xdo_) : base_type(k, setting, dev_), sequence_list(1, std::move(sequence)), xdo(xdo_) { }
+    keypress(unsigned k, const libconfig::Setting& setting, deck_output& dev_, std::list<std::string>&& sequence_list_, xdo_t* xdo_) : base_type(k, setting, dev_), sequence_list(std::move(sequence_list_)), xdo(xdo_) { }
 
     void call() override {
       for (const auto& sequence : sequence_list)
@@ -248,7 +312,7 @@ namespace {
   struct obsaction final : public action {
     using base_type = action;
 
-    obsaction(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, obs::button* b_) : base_type(k, setting, dev_), b(b_) { }
+    obsaction(unsigned k, const libconfig::Setting& setting, deck_output& dev_, obs::button* b_) : base_type(k, setting, dev_), b(b_) { }
 
     void call() override {
       b->call();
@@ -271,7 +335,7 @@ namespace {
       right,
     };
 
-    pageaction(unsigned k, const libconfig::Setting& setting, streamdeck::device_type& dev_, unsigned to_page_, direction dir, deck_config& deck_)
+    pageaction(unsigned k, const libconfig::Setting& setting, deck_output& dev_, unsigned to_page_, direction dir, deck_config& deck_)
     : base_type(k, setting, dev_, dir == direction::left ? "left-arrow.png" : "right-arrow.png"), to_page(to_page_), deck(deck_) {}
 
     void call() override;
@@ -282,24 +346,68 @@ namespace {
   };
 
 
+  struct plugin_action final : public action {
+    using base_type = action;
+
+    plugin_action(unsigned k, const libconfig::Setting& setting, deck_output& dev_, plugin& p_, deck_config& deck_, unsigned page_)
+    : base_type(k, setting, dev_), p(p_), keyobj{ deck_, page_, k }
+    {
+      instance = p.create(&host, &keyobj, reinterpret_cast<const streamdeckd_setting*>(&setting));
+    }
+    ~plugin_action()
+    {
+      if (instance != nullptr)
+        p.destroy(instance);
+    }
+
+    bool valid() const { return instance != nullptr; }
+
+    void call() override { p.press(instance); }
+    void release() override { p.release(instance); }
+    void show_icon() override { p.visibility(instance, true); }
+    void hidden() override { p.visibility(instance, false); }
+
+    static const streamdeckd_host host;
+  private:
+    plugin& p;
+    streamdeckd_key keyobj;
+    void* instance;
+  };
+
+
   struct deck_config {
     deck_config(const std::filesystem::path& conffile);
 
     void show_icons();
+    void show_key(unsigned k);
     void run();
 
     void nextpage(unsigned to_page);
+
+    int register_image(Magick::Image&& image);
+    int register_image_file(const std::string& fname);
+
+    void setkey(unsigned page, unsigned k, Magick::Image&& image, bool critical = true);
+    void setkey(unsigned page, unsigned k, int handle);
+
+    bool valid_image(int handle) { return output.valid_handle(handle); }
+    bool is_running() const { return running; }
+    unsigned key_width() const { return dev->key_pixel_width; }
+    unsigned key_height() const { return dev->key_pixel_height; }
   private:
     static unsigned keyidx(unsigned page, unsigned k) { return page * 256 + k; }
 
-    void setkey(unsigned page, unsigned row, unsigned column, Magick::Image&& image);
+    void setkey(unsigned page, unsigned row, unsigned column, Magick::Image&& image, bool critical = true);
     void setkey(unsigned page, unsigned row, unsigned column, int handle);
+    bool key_overridden(unsigned page, unsigned k) const;
+    bool discover_keylights();
 
-    int register_image(Magick::Image&& image);
+    void parse_rules(unsigned page, unsigned k, const libconfig::Setting& key);
 
+    void read_input(unsigned devidx);
     void handle_idle();
     bool prohibit_sleep() const {
-      return obs && obs->prohibit_sleep();
+      return std::ranges::any_of(obs, [](const auto& e){ return e.second->prohibit_sleep(); });
     }
 
     enum struct idle {
@@ -316,15 +424,47 @@ namespace {
     std::thread idle_thread;
 
     streamdeck::context ctx;
-    streamdeck::device_type* dev = nullptr;
+    // The primary device, its layout is used for all devices.
+    key_device* dev = nullptr;
+    // All devices, the first is the primary, the others mirror it.
+    std::vector<std::unique_ptr<key_device>> devices;
+    deck_output output;
+
+    struct input_event {
+      unsigned devidx;
+      std::vector<unsigned char> state;
+      metrics::clock_type::time_point received;
+    };
+    std::mutex input_lock;
+    std::condition_variable input_cv;
+    std::deque<input_event> input_queue;
+    // Keys whose rules changed, as page and key number.  The actions are only called
+    // from the dispatch thread.
+    std::vector<std::pair<unsigned,unsigned>> rule_changes;
+    void rule_changed(unsigned page, unsigned k);
+    std::vector<std::thread> input_threads;
+
+    plugin_registry plugins;
+    std::mutex image_cache_lock;
+    std::unordered_map<std::string,int> image_cache;
 
     bool has_keylights = false;
-    keylightpp::device_list_type keylights;
+    // Used by the OBS workers, therefore destroyed after them.
+    std::unique_ptr<keylight_presets> light_presets;
     xdo_t* xdo = nullptr;
     unsigned nrpages = 1;
-    unsigned current_page = 0;
+    // Only changed by the dispatch thread, read by the threads setting key images.
+    std::atomic<unsigned> current_page = 0;
+    // Rule changes are only shown once the initial icons are drawn.
+    std::atomic<bool> running = false;
     std::map<unsigned,std::unique_ptr<action>> actions;
-    std::unique_ptr<obs::info> obs;
+    // The threads of the lights call back into the actions and are stopped before them.
+    // The OBS workers use them for the presets.
+    std::list<keylight> keylights;
+    // For each page the backgrounds of the keys, empty if the page has no wallpaper.
+    std::vector<std::vector<int>> page_backgrounds;
+    std::map<std::string,std::unique_ptr<obs::info>> obs;
+    obs::info* default_obs = nullptr;
     ftlibrary ftobj;
     int blankimg;
   };
@@ -335,30 +475,154 @@ namespace {
     libconfig::Config config;
     config.readFile(conffile.c_str());
 
+    // Before any of the threads are started.
+    if (config.exists("low_latency"))
+      if (auto& l = config.lookup("low_latency"); l.isGroup()) {
+        realtime::settings rt;
+        std::string policy;
+        if (l.lookupValue("policy", policy)) {
+          if (policy == "rr")
+            rt.policy = SCHED_RR;
+          else if (policy != "fifo")
+            throw std::runtime_error("invalid low_latency policy "s + policy);
+        }
+        l.lookupValue("priority", rt.priority);
+        l.lookupValue("nice", rt.nice);
+        l.lookupValue("lock_memory", rt.lock_memory);
+        if (l.exists("cpus"))
+          for (const auto& c : l.lookup("cpus"))
+            rt.cpus.emplace_back(unsigned(c));
+        realtime::enable(rt);
+      }
+
     std::string serial;
     if (! config.lookupValue("serial", serial))
       serial = "";
 
-    for (auto& d : ctx) {
-      if (! d->connected())
-        continue;
+    std::vector<std::string> mirrors;
+    if (config.exists("mirrors")) {
+      auto& m = config.lookup("mirrors");
+      if (m.isScalar())
+        mirrors.emplace_back(std::string(m));
+      else
+        for (const auto& e : m)
+          mirrors.emplace_back(std::string(e));
+    }
+
+    jpeg_settings jpeg;
+    if (config.exists("jpeg"))
+      if (auto& j = config.lookup("jpeg"); j.isGroup()) {
+        j.lookupValue("quality", jpeg.quality);
+        j.lookupValue("reduced_quality", jpeg.reduced_quality);
+        j.lookupValue("subsampling", jpeg.subsampling);
+      }
 
-      if (serial == "" || d->get_serial_number() == serial) {
-        dev = d.get();
-        d->reset();
+    std::string agent;
+    if (config.lookupValue("agent", agent)) {
+      // The device is attached to a remote machine.
+      std::string secret_file;
+      if (! config.lookupValue("agent_secret", secret_file))
+        secret_file = get_homedir() / ".config/streamdeckd.secret";
+      devices.emplace_back(remote::connect(agent, remote::read_secret(secret_file), jpeg));
+      dev = devices.back().get();
+      output.add(*dev, "agent");
+    } else {
+      streamdeck::device_type* ldev = nullptr;
+      for (auto& d : ctx) {
+        if (! d->connected())
+          continue;
+
+        auto devserial = d->get_serial_number();
+        if ((serial == "" && std::ranges::find(mirrors, devserial) == mirrors.end()) || devserial == serial) {
+          ldev = d.get();
+          d->reset();
+        }
       }
+
+      if (ldev == nullptr)
+        throw std::runtime_error("no device available");
+      devices.emplace_back(std::make_unique<local_device>(*ldev, jpeg));
+      dev = devices.back().get();
+      output.add(*dev, ldev->get_serial_number());
+      mirrors.erase(std::remove(mirrors.begin(), mirrors.end(), ldev->get_serial_number()), mirrors.end());
     }
 
-    if (dev == nullptr)
-      throw std::runtime_error("no device available");
+    std::vector<std::string> used;
+    for (const auto& m : mirrors) {
+      streamdeck::device_type* mdev = nullptr;
+      for (auto& d : ctx)
+        if (d->connected() && d->get_serial_number() == m)
+          mdev = d.get();
+
+      if (mdev == nullptr)
+        std::cout << "mirror device " << m << " not available\n";
+      else if (mdev->key_count != dev->key_count || mdev->key_cols != dev->key_cols)
+        std::cout << "mirror device " << m << " has a different key layout\n";
+      else if (std::ranges::find(used, m) == used.end()) {
+        mdev->reset();
+        used.emplace_back(m);
+        devices.emplace_back(std::make_unique<local_device>(*mdev, jpeg));
+        output.add(*devices.back(), m);
+      }
+    }
 
     if (! config.lookupValue("pages", nrpages))
       nrpages = 1;
 
+    if (config.exists("metrics"))
+      if (auto& m = config.lookup("metrics"); m.isGroup()) {
+        std::string fname;
+        unsigned interval;
+        if (! m.lookupValue("interval", interval))
+          interval = 10;
+        if (m.lookupValue("file", fname))
+          metrics::start_writer(fname, std::chrono::seconds(std::max(1u, interval)));
+      }
+
+    std::string plugindir;
+    if (! config.lookupValue("plugins", plugindir))
+      plugindir = get_homedir() / ".local/lib/streamdeckd/plugins";
+    plugins.load_directory(plugindir);
+
+    config.lookupValue("text_shaping", ftobj.shaping);
+    config.lookupValue("text_sdf", ftobj.sdf);
+
+    // Lights which mDNS does not find reliably can be given with their address.
+    if (config.exists("keylights")) {
+      for (const auto& e : config.lookup("keylights")) {
+        std::string serial;
+        std::string url;
+        if (! e.lookupValue("serial", serial) || ! e.lookupValue("url", url))
+          throw std::runtime_error("keylights entries need serial and url");
+        keylights.emplace_back(serial, url);
+      }
+      has_keylights = ! keylights.empty();
+    }
+
+    if (config.exists("keylight_presets") && discover_keylights())
+      light_presets = std::make_unique<keylight_presets>(config.lookup("keylight_presets"), keylights);
+
     if (config.exists("obs")) {
-      auto& group = config.lookup("obs");
-      if (group.isGroup())
-        obs = std::make_unique<obs::info>(group, ftobj, [this](Magick::Image&& image) { return register_image(std::move(image)); });
+      // Either a single group or a list of groups, one for each OBS instance.
+      auto add_obs = [this](const libconfig::Setting& group) {
+        std::string name;
+        if (! group.lookupValue("name", name))
+          name = "default";
+        if (obs.contains(name))
+          throw std::runtime_error("duplicate OBS connection name "s + name);
+        auto& ref = obs[name] = std::make_unique<obs::info>(name, group, ftobj, [this](Magick::Image&& image) { return register_image(std::move(image)); },
+                                                     light_presets ? obs::info::scene_change_cb([this](const std::string& scene) { light_presets->apply(scene); }) : obs::info::scene_change_cb());
+        if (default_obs == nullptr)
+          default_obs = ref.get();
+      };
+
+      auto& setting = config.lookup("obs");
+      if (setting.isGroup())
+        add_obs(setting);
+      else if (setting.isList())
+        for (const auto& group : setting)
+          if (group.isGroup())
+            add_obs(group);
     }
 
     if (! config.lookupValue("brightness", brightness))
@@ -384,6 +648,13 @@ namespace {
         }
       }
 
+    std::string wallpaper;
+    config.lookupValue("wallpaper", wallpaper);
+    unsigned wallpaper_gap;
+    if (! config.lookupValue("wallpaper_gap", wallpaper_gap))
+      wallpaper_gap = dev->key_pixel_width * 3 / 10;
+    std::map<std::string,std::vector<int>> wallpapers;
+
     try {
       auto& keys = config.lookup("keys");
 
@@ -391,6 +662,19 @@ namespace {
       for (const auto& page : keys) {
         unsigned pagenr = page.getIndex();
 
+        // The wallpaper is cut into the key images once, pages with the same wallpaper
+        // share them.
+        std::string pagewallpaper = wallpaper;
+        page.lookupValue("wallpaper", pagewallpaper);
+        auto& backgrounds = page_backgrounds.emplace_back();
+        if (! pagewallpaper.empty()) {
+          auto [it, inserted] = wallpapers.try_emplace(pagewallpaper);
+          if (inserted)
+            for (auto& tile : slice_image(find_image(pagewallpaper), dev->key_cols, dev->key_count / dev->key_cols, dev->key_pixel_width, dev->key_pixel_height, wallpaper_gap))
+              it->second.emplace_back(output.register_background(std::move(tile)));
+          backgrounds = it->second;
+        }
+
         for (unsigned k = 0; k < dev->key_count; ++k) {
           auto row = 1u + k / dev->key_cols;
           auto column = 1u + k % dev->key_cols;
@@ -407,39 +691,28 @@ namespace {
               std::string serial;
               bool has_serial = key.lookupValue("serial", serial);
 
-              if (! has_keylights) {
-                has_keylights = true;
-                for (unsigned t = 0; t < 3; ++t) {
-                  keylights = keylightpp::discover();
-                  if (keylights.begin() != keylights.end())
-                    break;
-                  sleep(1);
-                }
-                if (keylights.begin() == keylights.end()) {
-                  has_keylights = false;
-                  continue;
-                }
-              }
+              if (! discover_keylights())
+                continue;
 
               if (std::string(key["function"]) == "on/off")
-                actions[kidx] = std::make_unique<keylight_toggle>(k, key, *dev, has_serial, serial, keylights);
+                actions[kidx] = std::make_unique<keylight_toggle>(k, key, output, has_serial, serial, keylights, *this, pagenr);
               else if (std::string(key["function"]) == "brightness+")
-                actions[kidx] = std::make_unique<keylight_brightness>(k, key, *dev, has_serial, serial, keylights, 5);
+                actions[kidx] = std::make_unique<keylight_brightness>(k, key, output, has_serial, serial, keylights, 5);
               else if (std::string(key["function"]) == "brightness-")
-                actions[kidx] = std::make_unique<keylight_brightness>(k, key, *dev, has_serial, serial, keylights, -5);
+                actions[kidx] = std::make_unique<keylight_brightness>(k, key, output, has_serial, serial, keylights, -5);
               else if (std::string(key["function"]) == "color+")
-                actions[kidx] = std::make_unique<keylight_color>(k, key, *dev, has_serial, serial, keylights, 250);
+                actions[kidx] = std::make_unique<keylight_color>(k, key, output, has_serial, serial, keylights, 250);
               else if (std::string(key["function"]) == "color-")
-                actions[kidx] = std::make_unique<keylight_color>(k, key, *dev, has_serial, serial, keylights, -250);
+                actions[kidx] = std::make_unique<keylight_color>(k, key, output, has_serial, serial, keylights, -250);
             } else if (std::string(key["type"]) == "execute" && key.exists("command"))
-              actions[kidx] = std::make_unique<execute>(k, key, *dev, std::string(key["command"]));
+              actions[kidx] = std::make_unique<execute>(k, key, output, std::string(key["command"]));
             else if (std::string(key["type"]) == "key" && key.exists("sequence")) {
               if (xdo == nullptr)
                 xdo = xdo_new(nullptr);
               if (xdo != nullptr) {
                 auto& seq = key.lookup("sequence");
                 if (seq.isScalar())
-                  actions[kidx] = std::make_unique<keypress>(k, key, *dev, std::string(seq), xdo);
+                  actions[kidx] = std::make_unique<keypress>(k, key, output, std::string(seq), xdo);
                 else if (seq.isList() && seq.getLength() > 0) {
                   std::list<std::string> l;
                   for (auto& sseq : seq) {
@@ -450,16 +723,30 @@ namespace {
                     l.emplace_back(std::string(sseq));
                   }
                   if (l.size() > 0)
-                    actions[kidx] = std::make_unique<keypress>(k, key, *dev, std::move(l), xdo);
+                    actions[kidx] = std::make_unique<keypress>(k, key, output, std::move(l), xdo);
                 }
               }
-            } else if (obs && std::string(key["type"]) == "obs") {
-              if (auto b = obs->parse_key([this](unsigned page, unsigned row, unsigned column, Magick::Image&& image){ setkey(page, row, column, std::move(image)); }, [this](unsigned page, unsigned row, unsigned column, int handle){ setkey(page, row, column, handle); }, pagenr, row, column, key); b != nullptr)
-                actions[kidx] = std::make_unique<obsaction>(k, key, *dev, b);
+            } else if (default_obs != nullptr && std::string(key["type"]) == "obs") {
+              obs::info* conn = default_obs;
+              if (std::string name; key.lookupValue("obs", name)) {
+                auto it = obs.find(name);
+                conn = it == obs.end() ? nullptr : it->second.get();
+              }
+              if (conn != nullptr)
+                if (auto b = conn->parse_key([this](unsigned page, unsigned row, unsigned column, Magick::Image&& image, bool critical){ setkey(page, row, column, std::move(image), critical); }, [this](unsigned page, unsigned row, unsigned column, int handle){ setkey(page, row, column, handle); }, pagenr, row, column, key); b != nullptr)
+                  actions[kidx] = std::make_unique<obsaction>(k, key, output, b);
             } else if (std::string(key["type"]) == "nextpage")
-              actions[kidx] = std::make_unique<pageaction>(k, key, *dev, (pagenr + 1) % nrpages, pageaction::direction::right, *this);
+              actions[kidx] = std::make_unique<pageaction>(k, key, output, (pagenr + 1) % nrpages, pageaction::direction::right, *this);
             else if (std::string(key["type"]) == "prevpage")
-              actions[kidx] = std::make_unique<pageaction>(k, key, *dev, (pagenr - 1 + nrpages) % nrpages, pageaction::direction::left, *this);
+              actions[kidx] = std::make_unique<pageaction>(k, key, output, (pagenr - 1 + nrpages) % nrpages, pageaction::direction::left, *this);
+            else if (auto p = plugins.find(key["type"]); p != nullptr) {
+              auto a = std::make_unique<plugin_action>(k, key, output, *p, *this, pagenr);
+              if (a->valid())
+                actions[kidx] = std::move(a);
+            }
+
+            if (actions.contains(kidx) && (key.exists("visible") || key.exists("icons")))
+              parse_rules(pagenr, k, key);
           }
         }
       }
@@ -468,64 +755,253 @@ namespace {
       // No key settings.
     }
 
-    dev->set_brightness(brightness);
-    blankimg = dev->register_image(find_image("blank.png"));
+    output.set_brightness(brightness);
+    blankimg = output.register_image(find_image("blank.png"));
+  }
+
+
+  // The rules for a key are evaluated with the state of the OBS connection selected by
+  // the key's "obs" setting, the default connection otherwise.
+  void deck_config::parse_rules(unsigned page, unsigned k, const libconfig::Setting& key)
+  {
+    obs::info* conn = default_obs;
+    if (std::string name; key.lookupValue("obs", name)) {
+      auto it = obs.find(name);
+      conn = it == obs.end() ? nullptr : it->second.get();
+    }
+    if (conn == nullptr) {
+      std::cout << "rules for key " << k << " on page " << page << " need an OBS connection\n";
+      return;
+    }
+
+    auto r = std::make_unique<rules::key_rules>();
+    try {
+      if (key.exists("visible")) {
+        auto& v = key["visible"];
+        if (v.isScalar())
+          r->visible.emplace_back(std::string(v));
+        else
+          for (const auto& e : v)
+            r->visible.emplace_back(std::string(e));
+      }
+      if (key.exists("icons"))
+        for (const auto& e : key["icons"]) {
+          std::string when;
+          std::string icon;
+          if (e.lookupValue("when", when) && e.lookupValue("icon", icon))
+            r->icons.emplace_back(rules::expression(when), register_image_file(icon));
+        }
+    }
+    catch (std::runtime_error& ex) {
+      std::cout << ex.what() << std::endl;
+      return;
+    }
+
+    r->changed = [this, page, k]{
+      if (running && page == current_page) {
+        {
+          std::lock_guard<std::mutex> guard(input_lock);
+          rule_changes.emplace_back(page, k);
+        }
+        input_cv.notify_one();
+      }
+    };
+    conn->rule_state.subscribe(*r);
+    actions[keyidx(page, k)]->keyrules = std::move(r);
+  }
+
+
+  bool deck_config::discover_keylights()
+  {
+    if (! has_keylights) {
+      keylightpp::device_list_type found;
+      for (unsigned t = 0; t < 3; ++t) {
+        found = keylightpp::discover();
+        if (found.begin() != found.end())
+          break;
+        sleep(1);
+      }
+      for (auto& d : found)
+        keylights.emplace_back(d.serial, d.url);
+      has_keylights = ! keylights.empty();
+    }
+    return has_keylights;
   }
 
 
   int deck_config::register_image(Magick::Image&& image)
   {
-    return dev->register_image(std::move(image));
+    return output.register_image(std::move(image));
   }
 
 
-  void deck_config::setkey(unsigned page, unsigned row, unsigned column, Magick::Image&& image)
+  int deck_config::register_image_file(const std::string& fname)
   {
-    if (page == current_page)
-      dev->set_key_image(row - 1u, column - 1u, std::move(image));
+    std::lock_guard<std::mutex> guard(image_cache_lock);
+    if (auto it = image_cache.find(fname); it != image_cache.end())
+      return it->second;
+
+    auto handle = register_image(find_image(fname));
+    image_cache.emplace(fname, handle);
+    return handle;
+  }
+
+
+  void deck_config::setkey(unsigned page, unsigned row, unsigned column, Magick::Image&& image, bool critical)
+  {
+    auto k = (row - 1u) * dev->key_cols + column - 1u;
+    if (page == current_page && ! key_overridden(page, k))
+      output.set_key_image(k, std::move(image), critical);
   }
 
 
   void deck_config::setkey(unsigned page, unsigned row, unsigned column, int handle)
   {
-    if (page == current_page)
-      dev->set_key_image(row - 1u, column - 1u, handle);
+    auto k = (row - 1u) * dev->key_cols + column - 1u;
+    if (page == current_page && ! key_overridden(page, k))
+      output.set_key_image(k, handle);
   }
 
 
-  void deck_config::show_icons()
+  void deck_config::setkey(unsigned page, unsigned k, Magick::Image&& image, bool critical)
+  {
+    setkey(page, 1u + k / dev->key_cols, 1u + k % dev->key_cols, std::move(image), critical);
+  }
+
+
+  void deck_config::setkey(unsigned page, unsigned k, int handle)
   {
-    for (unsigned k = 0; k < dev->key_count; ++k) {
-      unsigned kidx = keyidx(current_page, k);
+    if (page == current_page && ! key_overridden(page, k))
+      output.set_key_image(k, handle);
+  }
 
-      if (actions.contains(kidx))
-        actions[kidx]->show_icon();
-      else
-        dev->set_key_image(k, blankimg);
-    }
+
+  bool deck_config::key_overridden(unsigned page, unsigned k) const
+  {
+    auto it = actions.find(keyidx(page, k));
+    return it != actions.end() && it->second->overridden();
+  }
+
+
+  void deck_config::show_key(unsigned k)
+  {
+    if (auto it = actions.find(keyidx(current_page, k)); it != actions.end() && it->second->visible())
+      it->second->refresh();
+    else if (current_page < page_backgrounds.size() && ! page_backgrounds[current_page].empty())
+      output.set_key_image(k, page_backgrounds[current_page][k]);
+    else
+      output.set_key_image(k, blankimg);
+  }
+
+
+  void deck_config::show_icons()
+  {
+    output.set_background(current_page < page_backgrounds.size() ? page_backgrounds[current_page] : std::vector<int>());
+    for (unsigned k = 0; k < dev->key_count; ++k)
+      show_key(k);
   }
 
 
   void deck_config::run()
   {
+    static auto& input_wait = metrics::get_histogram("deck.input_wait");
+    static auto& input_time = metrics::get_histogram("deck.input");
+
+    running = true;
     show_icons();
 
+    for (unsigned i = 0; i < devices.size(); ++i)
+      input_threads.emplace_back([this, i]{ read_input(i); });
+
+    realtime::enter("dispatch");
+    realtime::lock_memory();
+
+    // The action which received the press, it gets the release even if the page changed.
+    std::vector<std::vector<action*>> pressed(devices.size(), std::vector<action*>(dev->key_count, nullptr));
+
+    // Swapped with the queue, the memory is reused.
+    std::vector<std::pair<unsigned,unsigned>> changes;
+
     while (true) {
-      auto ss = dev->read();
-      if (idle_state == idle::full)
+      input_event ev;
+      bool have_event = false;
+      {
+        std::unique_lock<std::mutex> guard(input_lock);
+        input_cv.wait(guard, [this]{ return ! input_queue.empty() || ! rule_changes.empty(); });
+        changes.swap(rule_changes);
+        if (! input_queue.empty()) {
+          ev = std::move(input_queue.front());
+          input_queue.pop_front();
+          have_event = true;
+        }
+      }
+      for (auto [page, k] : changes)
+        rule_changed(page, k);
+      changes.clear();
+      if (! have_event)
         continue;
+      input_wait.add(metrics::clock_type::now() - ev.received);
+
+      if (idle_state == idle::full) {
+        devices[ev.devidx]->input_handled();
+        continue;
+      }
+      auto& devpressed = pressed[ev.devidx];
       unsigned k = 0;
-      for (auto s : ss) {
-        if (s != 0)
-          if (auto found = actions.find(keyidx(current_page, k)); found != actions.end())
-            found->second->call();
+      for (auto s : ev.state) {
+        if (s != 0) {
+          // A held key is reported again whenever another key changes.
+          if (devpressed[k] == nullptr)
+            if (auto found = actions.find(keyidx(current_page, k)); found != actions.end() && found->second->visible()) {
+              found->second->call();
+              devpressed[k] = found->second.get();
+            }
+        } else if (devpressed[k] != nullptr) {
+          devpressed[k]->release();
+          devpressed[k] = nullptr;
+        }
         ++k;
       }
+      devices[ev.devidx]->input_handled();
+      input_time.add(metrics::clock_type::now() - ev.received);
+    }
+  }
+
+
+  // Each device is read by a separate thread, the key events are handled by run.
+  void deck_config::read_input(unsigned devidx)
+  {
+    realtime::enter("input");
+
+    auto d = devices[devidx].get();
+    while (true) {
+      auto ss = d->read();
+      {
+        std::lock_guard<std::mutex> guard(input_lock);
+        input_queue.emplace_back(devidx, std::move(ss), metrics::clock_type::now());
+      }
+      input_cv.notify_one();
     }
   }
 
 
+  void deck_config::rule_changed(unsigned page, unsigned k)
+  {
+    // The page might have changed since the rule did.
+    if (page != current_page)
+      return;
+    auto& a = actions[keyidx(page, k)];
+    if (! a->visible())
+      a->hidden();
+    show_key(k);
+  }
+
+
   void deck_config::nextpage(unsigned to_page) {
+    for (unsigned k = 0; k < dev->key_count; ++k)
+      if (auto found = actions.find(keyidx(current_page, k)); found != actions.end())
+        found->second->hidden();
+
     current_page = to_page;
     show_icons();
   }
@@ -664,13 +1140,13 @@ namespace {
     if (i != idle_state)
       switch (idle_state = i) {
       case idle::running:
-        dev->set_brightness(brightness);
+        output.set_brightness(brightness);
         break;
       case idle::temp:
-        dev->set_brightness(brightness_idle);
+        output.set_brightness(brightness_idle);
         break;
       case idle::full:
-        dev->set_brightness(0);
+        output.set_brightness(0);
         break;
       }
   }
@@ -680,15 +1156,159 @@ namespace {
     deck.nextpage(to_page);
   }
 
+
+  void keylight_toggle::changed()
+  {
+    // Before the deck runs all icons are drawn anyway.
+    if (deck.is_running())
+      deck.setkey(page, key, lights.front().is_on() == 1 ? icon2 : icon1);
+  }
+
+
+  int plugin_lookup_string(const streamdeckd_setting* setting, const char* name, const char** res)
+  {
+    return reinterpret_cast<const libconfig::Setting*>(setting)->lookupValue(name, *res);
+  }
+
+
+  int plugin_lookup_int(const streamdeckd_setting* setting, const char* name, long long* res)
+  {
+    return reinterpret_cast<const libconfig::Setting*>(setting)->lookupValue(name, *res);
+  }
+
+
+  int plugin_lookup_double(const streamdeckd_setting* setting, const char* name, double* res)
+  {
+    return reinterpret_cast<const libconfig::Setting*>(setting)->lookupValue(name, *res);
+  }
+
+
+  int plugin_register_image_file(streamdeckd_key* key, const char* fname)
+  {
+    try {
+      return key->deck.register_image_file(fname);
+    }
+    catch (Magick::Exception&) {
+      return -1;
+    }
+  }
+
+
+  // No exception must reach the plugin's code.
+  int plugin_register_image_rgba(streamdeckd_key* key, unsigned width, unsigned height, const unsigned char* rgba)
+  {
+    try {
+      return key->deck.register_image(Magick::Image(width, height, "RGBA", Magick::CharPixel, rgba));
+    }
+    catch (const std::exception&) {
+      return -1;
+    }
+  }
+
+
+  void plugin_set_key_image(streamdeckd_key* key, int handle)
+  {
+    // Also catches the -1 returned by the register functions.
+    if (! key->deck.valid_image(handle))
+      return;
+    key->deck.setkey(key->page, key->key, handle);
+  }
+
+
+  void plugin_set_key_rgba(streamdeckd_key* key, unsigned width, unsigned height, const unsigned char* rgba)
+  {
+    try {
+      // Images drawn by plugins are mostly animations, they can wait for the state keys.
+      key->deck.setkey(key->page, key->key, Magick::Image(width, height, "RGBA", Magick::CharPixel, rgba), false);
+    }
+    catch (const std::exception&) {
+      // The image is dropped.
+    }
+  }
+
+
+  unsigned plugin_key_width(const streamdeckd_key* key)
+  {
+    return key->deck.key_width();
+  }
+
+
+  unsigned plugin_key_height(const streamdeckd_key* key)
+  {
+    return key->deck.key_height();
+  }
+
+
+  void plugin_log(const streamdeckd_key* key, const char* msg)
+  {
+    std::cout << "plugin (page " << key->page + 1 << ", key " << key->key << "): " << msg << std::endl;
+  }
+
+
+  const streamdeckd_host plugin_action::host {
+    .abi_version = STREAMDECKD_PLUGIN_ABI_VERSION,
+    .lookup_string = plugin_lookup_string,
+    .lookup_int = plugin_lookup_int,
+    .lookup_double = plugin_lookup_double,
+    .register_image_file = plugin_register_image_file,
+    .register_image_rgba = plugin_register_image_rgba,
+    .set_key_image = plugin_set_key_image,
+    .set_key_rgba = plugin_set_key_rgba,
+    .key_width = plugin_key_width,
+    .key_height = plugin_key_height,
+    .log = plugin_log,
+  };
+
 } // anonymous namespace
 
 
 int main(int argc, char* argv[])
 {
+  static const option options[] = {
+    { "agent", required_argument, nullptr, 'a' },
+    { "serial", required_argument, nullptr, 's' },
+    { "metrics", required_argument, nullptr, 'm' },
+    { "secret", required_argument, nullptr, 'k' },
+    { nullptr, 0, nullptr, 0 }
+  };
+  std::string agent_address;
+  std::string agent_serial;
+  std::filesystem::path secret_file = get_homedir() / ".config/streamdeckd.secret";
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1)
+    switch (opt) {
+    case 'a':
+      agent_address = optarg;
+      break;
+    case 'k':
+      secret_file = optarg;
+      break;
+    case 's':
+      agent_serial = optarg;
+      break;
+    case 'm':
+      metrics::start_writer(optarg, std::chrono::seconds(10));
+      break;
+    default:
+      error(EXIT_FAILURE, 0, "usage: %s [--agent [HOST:]PORT [--secret FILE] [--serial SERIAL] [--metrics FILE]] [CONFFILE]", argv[0]);
+    }
+
+  if (! agent_address.empty()) {
+    // Only handle the device, the daemon runs elsewhere.
+    std::string secret;
+    try {
+      secret = remote::read_secret(secret_file);
+    }
+    catch (const std::runtime_error& e) {
+      error(EXIT_FAILURE, 0, "%s", e.what());
+    }
+    remote::run_agent(agent_address, agent_serial, secret);
+  }
+
   auto resource_bundle = Glib::wrap(resources_get_resource());
   resource_bundle->register_global();
 
-  auto conffile = argc == 2 ? std::filesystem::path(argv[1]) : (get_homedir() / ".config/streamdeckd.conf");
+  auto conffile = optind + 1 == argc ? std::filesystem::path(argv[optind]) : (get_homedir() / ".config/streamdeckd.conf");
   deck_config deck(conffile);
 
   deck.run();
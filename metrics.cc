@@ -0,0 +1,113 @@
+#include "metrics.hh"
+
+#include <bit>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+namespace metrics {
+
+  namespace {
+
+    std::mutex registry_lock;
+    std::map<std::string,std::unique_ptr<counter>> counters;
+    std::map<std::string,std::unique_ptr<histogram>> histograms;
+
+  } // anonymous namespace
+
+
+  void histogram::add(clock_type::duration d)
+  {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+
+    n.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(us, std::memory_order_relaxed);
+    for (auto m = max.load(std::memory_order_relaxed); us > m && ! max.compare_exchange_weak(m, us, std::memory_order_relaxed); )
+      ;
+    buckets[std::min<unsigned>(std::bit_width(us), nbuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+
+  uint64_t histogram::percentile_us(double p) const
+  {
+    auto total = count();
+    if (total == 0)
+      return 0;
+
+    uint64_t limit = total * p;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < nbuckets; ++i) {
+      seen += buckets[i].load(std::memory_order_relaxed);
+      if (seen > limit)
+        // Upper bound of the bucket.
+        return i == 0 ? 0 : (uint64_t(1) << i) - 1;
+    }
+    return max_us();
+  }
+
+
+  counter& get_counter(const std::string& name)
+  {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    auto& p = counters[name];
+    if (! p)
+      p = std::make_unique<counter>();
+    return *p;
+  }
+
+
+  histogram& get_histogram(const std::string& name)
+  {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    auto& p = histograms[name];
+    if (! p)
+      p = std::make_unique<histogram>();
+    return *p;
+  }
+
+
+  void dump(std::ostream& os)
+  {
+    std::lock_guard<std::mutex> guard(registry_lock);
+
+    for (const auto& [name, c] : counters)
+      os << name << ' ' << c->get() << '\n';
+
+    for (const auto& [name, h] : histograms) {
+      auto n = h->count();
+      os << name << ".count " << n << '\n';
+      if (n != 0) {
+        os << name << ".mean_us " << h->sum_us() / n << '\n';
+        os << name << ".p50_us " << h->percentile_us(0.5) << '\n';
+        os << name << ".p99_us " << h->percentile_us(0.99) << '\n';
+        os << name << ".max_us " << h->max_us() << '\n';
+      }
+    }
+  }
+
+
+  void start_writer(const std::filesystem::path& fname, std::chrono::seconds interval)
+  {
+    std::thread([fname, interval]{
+      auto tmpname = fname;
+      tmpname += ".tmp";
+      while (true) {
+        std::this_thread::sleep_for(interval);
+
+        // Write the new content atomically so that readers never see a partial file.
+        {
+          std::ofstream ofs(tmpname, std::ios::trunc);
+          if (! ofs)
+            continue;
+          dump(ofs);
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmpname, fname, ec);
+      }
+    }).detach();
+  }
+
+} // namespace metrics
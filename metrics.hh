@@ -0,0 +1,76 @@
+#ifndef _METRICS_HH
+#define _METRICS_HH 1
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <ostream>
+#include <string>
+
+
+namespace metrics {
+
+  using clock_type = std::chrono::steady_clock;
+
+
+  // Simple monotonic counter.  Also used for values which are only ever set (gauges).
+  struct counter {
+    void operator++() { value.fetch_add(1, std::memory_order_relaxed); }
+    void operator+=(uint64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<uint64_t> value = 0;
+  };
+
+
+  // Histogram of durations.  The buckets are powers of two in microseconds which is
+  // precise enough to see which part of the code is slow and cheap enough to be
+  // updated from every thread without locking.
+  struct histogram {
+    static constexpr unsigned nbuckets = 32;
+
+    void add(clock_type::duration d);
+
+    uint64_t count() const { return n.load(std::memory_order_relaxed); }
+    uint64_t sum_us() const { return sum.load(std::memory_order_relaxed); }
+    uint64_t max_us() const { return max.load(std::memory_order_relaxed); }
+    uint64_t percentile_us(double p) const;
+
+  private:
+    std::atomic<uint64_t> n = 0;
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> max = 0;
+    std::array<std::atomic<uint64_t>,nbuckets> buckets{};
+  };
+
+
+  // Measure the time of a scope.
+  struct timer {
+    explicit timer(histogram& h_) : h(h_), start(clock_type::now()) { }
+    ~timer() { h.add(clock_type::now() - start); }
+
+    timer(const timer&) = delete;
+    timer& operator=(const timer&) = delete;
+
+  private:
+    histogram& h;
+    const clock_type::time_point start;
+  };
+
+
+  // The objects are never deallocated, references can be cached.
+  counter& get_counter(const std::string& name);
+  histogram& get_histogram(const std::string& name);
+
+  void dump(std::ostream& os);
+
+  // Periodically write all values to the given file.
+  void start_writer(const std::filesystem::path& fname, std::chrono::seconds interval);
+
+} // namespace metrics
+
+#endif // metrics.hh
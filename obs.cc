@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <iterator>
+#include <utility>
 #include <filesystem>
 
 #include <openssl/evp.h>
@@ -9,6 +10,7 @@
 
 #include "obsws.hh"
 #include "buttontext.hh"
+#include "jsonview.hh"
 
 using namespace std::string_literals;
 using namespace std::literals::chrono_literals;
@@ -27,12 +29,46 @@ namespace obs {
 
   namespace {
 
-    std::string server("localhost");
-    int port = 4444;
-    std::string password("");
-    std::string log("");
+    // Mark an image with the indicator for a slow connection.
+    Magick::Image mark_degraded(const Magick::Image& image)
+    {
+      Magick::Image res(image);
+      double r = res.columns() / 10.0;
+      double cx = res.columns() - 1.5 * r;
+      double cy = 1.5 * r;
+      res.fillColor("orange");
+      res.strokeColor("black");
+      res.draw(Magick::DrawableCircle(cx, cy, cx + r, cy));
+      return res;
+    }
+
 
-  } // anonymous namespace;
+    // The requests sent when keys are pressed.
+    const obsws::request_template set_current_scene(R"({"request-type":"SetCurrentScene","scene-name":%s})");
+    const obsws::request_template set_preview_scene(R"({"request-type":"SetPreviewScene","scene-name":%s})");
+    const obsws::request_template transition_cut(R"({"request-type":"TransitionToProgram","with-transition":{"name":"Cut","duration":0}})");
+    const obsws::request_template transition_to_program(R"({"request-type":"TransitionToProgram","with-transition":{"name":%s,"duration":%d}})");
+    const obsws::request_template set_current_transition(R"({"request-type":"SetCurrentTransition","transition-name":%s})");
+    const obsws::request_template start_stop_recording(R"({"request-type":"StartStopRecording"})");
+    const obsws::request_template start_stop_streaming(R"({"request-type":"StartStopStreaming"})");
+    const obsws::request_template set_item_visible(R"({"request-type":"SetSceneItemProperties","item":%s,"visible":%b})");
+    const obsws::request_template set_scene_item_visible(R"({"request-type":"SetSceneItemProperties","scene-name":%s,"item":%s,"visible":%b})");
+    const obsws::request_template ftb_start_studio(R"({"request-type":"ExecuteBatch","requests":[)"
+                                                   R"({"request-type":"SetPreviewScene","scene-name":"Black"},)"
+                                                   R"({"request-type":"TransitionToProgram","with-transition":{"name":"Fade","duration":1000}}]})");
+    const obsws::request_template ftb_stop(R"({"request-type":"ExecuteBatch","requests":[)"
+                                           R"({"request-type":"SetCurrentTransition","transition-name":"Fade"},)"
+                                           R"({"request-type":"SetTransitionDuration","duration":1000},)"
+                                           R"({"request-type":"SetCurrentScene","scene-name":%s}]})");
+    const obsws::request_template restore_transition(R"({"request-type":"ExecuteBatch","requests":[)"
+                                                     R"({"request-type":"SetCurrentTransition","transition-name":%s},)"
+                                                     R"({"request-type":"SetTransitionDuration","duration":%d}]})");
+    const obsws::request_template restore_transition_preview(R"({"request-type":"ExecuteBatch","requests":[)"
+                                                             R"({"request-type":"SetCurrentTransition","transition-name":%s},)"
+                                                             R"({"request-type":"SetTransitionDuration","duration":%d},)"
+                                                             R"({"request-type":"SetPreviewScene","scene-name":%s}]})");
+
+  } // anonymous namespace
 
 
   button::button(unsigned nr_, set_key_image_cb setkey_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, int icon1_, int icon2_, keyop_type keyop_)
@@ -65,6 +101,9 @@ namespace obs {
         icon = i->ftb.active() ? i->ftb.get() : icon1;
       else if (! i->ftb.active() && i->studio_mode)
         icon = icon1;
+
+      if (i->degraded)
+        icon = i->degraded_icon(icon);
     }
 
     setkey_handle(page, row, column, icon);
@@ -79,10 +118,6 @@ namespace obs {
     if (! i->studio_mode && keyop != keyop_type::live_scene && keyop != keyop_type::record && keyop != keyop_type::stream && keyop != keyop_type::source && keyop != keyop_type::transition && keyop != keyop_type::ftb)
       return;
 
-    Json::Value batch;
-    Json::Value d;
-    std::string old;
-
     switch(keyop) {
     case keyop_type::live_scene:
       if (nr <= i->scene_count()) {
@@ -96,34 +131,24 @@ namespace obs {
             show_icon();
           }
         } else {
-          d["request-type"] = "SetCurrentScene";
-          d["scene-name"] = i->get_scene_name(nr);
-          obsws::emit(d);
+          i->ws->emit(set_current_scene, { i->get_scene_name(nr) });
         }
       }
       break;
     case keyop_type::preview_scene:
       if (nr <= i->scene_count()) {
-        d["request-type"] = "SetPreviewScene";
-        d["scene-name"] = i->get_scene_name(nr);
-        obsws::emit(d);
+        i->ws->emit(set_preview_scene, { i->get_scene_name(nr) });
       }
       break;
     case keyop_type::cut:
       if (! i->ftb.active()) {
         i->ignore_next_transition_change = true;
-        d["request-type"] = "TransitionToProgram";
-        d["with-transition"]["name"] = "Cut";
-        d["with-transition"]["duration"] = 0u;
-        obsws::emit(d);
+        i->ws->emit(transition_cut);
       }
       break;
     case keyop_type::auto_rate:
       if (! i->ftb.active()) {
-        d["request-type"] = "TransitionToProgram";
-        d["with-transition"]["name"] = i->get_current_transition().name;
-        d["with-transition"]["duration"] = i->get_current_duration();
-        obsws::emit(d);
+        i->ws->emit(transition_to_program, { i->get_current_transition().name, i->get_current_duration() });
       }
       break;
     case keyop_type::ftb:
@@ -131,75 +156,40 @@ namespace obs {
       if (! i->ftb.active()) {
         i->saved_preview = i->current_preview;
         i->saved_scene = i->current_scene;
-        if (i->studio_mode) {
-          batch["request-type"] = "ExecuteBatch";
-          d.clear();
-          d["request-type"] = "SetPreviewScene";
-          d["scene-name"] = "Black";
-          batch["requests"].append(d);
-          d.clear();
-          d["request-type"] = "TransitionToProgram";
-          d["with-transition"]["name"] = "Fade";
-          d["with-transition"]["duration"] = 1000;
-          batch["requests"].append(d);
-          obsws::emit(batch);
-        } else {
-          d.clear();
-          d["request-type"] = "SetCurrentScene";
-          d["scene-name"] = "Black";
-          obsws::emit(d);
-        }
+        if (i->studio_mode)
+          i->ws->emit(ftb_start_studio);
+        else
+          i->ws->emit(set_current_scene, { "Black" });
         i->ftb.start();
       } else {
         i->ftb.stop();
-        if (i->studio_mode) {
-          d.clear();
-          d["request-type"] = "TransitionToProgram";
-          d["with-transition"]["name"] = "Fade";
-          d["with-transition"]["duration"] = 1000;
-          obsws::emit(d);
-        } else {
-          batch["request-type"] = "ExecuteBatch";
-          d.clear();
-          d["request-type"] = "SetCurrentTransition";
-          d["transition-name"] = "Fade";
-          batch["requests"].append(d);
-          d.clear();
-          d["request-type"] = "SetTransitionDuration";
-          d["duration"] = 1000;
-          batch["requests"].append(d);
-          d.clear();
-          d["request-type"] = "SetCurrentScene";
-          d["scene-name"] = i->saved_scene;
+        if (i->studio_mode)
+          i->ws->emit(transition_to_program, { "Fade", 1000 });
+        else {
+          i->ws->emit(ftb_stop, { i->saved_scene });
           i->saved_scene.clear();
-          batch["requests"].append(d);
-          obsws::emit(batch);
         }
       }
       break;
     case keyop_type::transition:
       if (! i->ftb.active()) {
-        d["request-type"] = "SetCurrentTransition";
-        d["transition-name"] = i->get_transition_name(nr);
-        obsws::emit(d);
+        i->ws->emit(set_current_transition, { i->get_transition_name(nr) });
       }
       break;
     case keyop_type::record:
-      d["request-type"] = "StartStopRecording";
-      obsws::emit(d);
+      i->ws->emit(start_stop_recording);
       break;
     case keyop_type::stream:
-      d["request-type"] = "StartStopStreaming";
-      obsws::emit(d);
+      i->ws->emit(start_stop_streaming);
       break;
     case keyop_type::source:
       if (2 * (nr - 1) < i->current_sources.size() && (! i->ftb.active() || i->studio_mode)) {
-        d["request-type"] = "SetSceneItemProperties";
+        const auto& item = i->current_sources[2 * (nr - 1)];
+        bool visible = i->current_sources[2 * (nr - 1) + 1] == "false";
         if (i->studio_mode)
-          d["scene-name"] = i->current_preview;
-        d["item"] = i->current_sources[2 * (nr - 1)];
-        d["visible"] = i->current_sources[2 * (nr - 1) + 1] == "false";
-        obsws::emit(d);
+          i->ws->emit(set_scene_item_visible, { i->current_preview, item, visible });
+        else
+          i->ws->emit(set_item_visible, { item, visible });
       }
       break;
     default:
@@ -211,39 +201,50 @@ namespace obs {
   void auto_button::show_icon()
   {
     if (i->connected && i->studio_mode && ! i->ftb.active()) {
-      font_render<render_to_image> renderobj(fontobj, background, 0.8, 0.3);
       auto s = std::to_string(duration_ms / 1000.0);
       if (s.size() == 1)
         s += ".0";
       else if (s.size() > 3)
         s.erase(3);
-      setkey_image(page, row, column, renderobj.draw(s, color, std::get<0>(center), std::get<1>(center)));
+      layers.set(key_layers::layer::background, "", background);
+      layers.draw(key_layers::layer::text, s, [this, s](const Magick::Image& below) {
+        font_render<render_to_image> renderobj(fontobj, below, 0.8, 0.3);
+        return renderobj.draw(s, color, std::get<0>(center), std::get<1>(center), blend);
+      });
+      if (i->degraded)
+        layers.draw(key_layers::layer::overlay, "degraded", mark_degraded);
+      else
+        layers.clear(key_layers::layer::overlay);
+      setkey_image(page, row, column, Magick::Image(layers.image()), true);
     } else
       setkey_handle(page, row, column, i->obsicon);
   }
 
 
+  void text_button::show_text(bool active, const std::string& name, const Magick::Color& color)
+  {
+    layers.set(key_layers::layer::background, active ? "on" : "off", active ? background : background_off);
+    layers.draw(key_layers::layer::text, (active ? "on:" : "off:") + name, [this, name, color](const Magick::Image& below) {
+      font_render<render_to_image> renderobj(fontobj, below, 0.8, 0.8);
+      return renderobj.draw_wrapped(name, color, 0.5, 0.5, blend);
+    });
+    if (i->degraded)
+      layers.draw(key_layers::layer::overlay, "degraded", mark_degraded);
+    else
+      layers.clear(key_layers::layer::overlay);
+    setkey_image(page, row, column, Magick::Image(layers.image()), true);
+  }
+
+
   void scene_button::show_icon()
   {
     if (i->connected && (keyop != keyop_type::preview_scene || i->studio_mode)) {
       auto it = std::find_if(i->scenes.begin(), i->scenes.end(), [nr = base_type::nr](const auto& e){ return nr == e.second.nr; });
       if (it != i->scenes.end()) {
-        auto name = it->second.name;
-        std::vector<std::string> vs;
-        if (name.size() <= 5)
-          vs.emplace_back(name);
-        else {
-          std::istringstream iss(name);
-          vs = std::vector(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
-        }
+        const auto& name = it->second.name;
 
-        if ((keyop == keyop_type::live_scene && i->get_current_scene().nr == nr) || (keyop == keyop_type::preview_scene && i->get_current_preview().nr == nr)) {
-          font_render<render_to_image> renderobj(fontobj, background, 0.8, 0.8);
-          setkey_image(page, row, column, renderobj.draw(vs, keyop == keyop_type::live_scene ? i->im_white : i->im_black, 0.5, 0.5));
-        } else {
-          font_render<render_to_image> renderobj(fontobj, background_off, 0.8, 0.8);
-          setkey_image(page, row, column, renderobj.draw(vs, i->im_darkgray, 0.5, 0.5));
-        }
+        bool active = (keyop == keyop_type::live_scene && i->get_current_scene().nr == nr) || (keyop == keyop_type::preview_scene && i->get_current_preview().nr == nr);
+        show_text(active, name, active ? (keyop == keyop_type::live_scene ? i->im_white : i->im_black) : i->im_darkgray);
         return;
       }
     }
@@ -256,22 +257,10 @@ namespace obs {
     if (i->connected && ! i->ftb.active()) {
       auto it = std::find_if(i->transitions.begin(), i->transitions.end(), [nr = base_type::nr](const auto& e){ return nr == e.second.nr; });
       if (it != i->transitions.end()) {
-        auto name = it->second.name;
-        std::vector<std::string> vs;
-        if (name.size() <= 5)
-          vs.emplace_back(name);
-        else {
-          std::istringstream iss(name);
-          vs = std::vector(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
-        }
+        const auto& name = it->second.name;
 
-        if (i->get_current_transition().nr == nr) {
-          font_render<render_to_image> renderobj(fontobj, background, 0.8, 0.8);
-          setkey_image(page, row, column, renderobj.draw(vs, i->im_black, 0.5, 0.5));
-        } else {
-          font_render<render_to_image> renderobj(fontobj, background_off, 0.8, 0.8);
-          setkey_image(page, row, column, renderobj.draw(vs, i->im_darkgray, 0.5, 0.5));
-        }
+        bool active = i->get_current_transition().nr == nr;
+        show_text(active, name, active ? i->im_black : i->im_darkgray);
         return;
       }
     }
@@ -284,22 +273,10 @@ namespace obs {
     if (i->connected && (! i->ftb.active() || i->studio_mode)) {
       unsigned idx = 2 * (base_type::nr - 1u);
       if (idx < i->current_sources.size()) {
-        auto str = i->current_sources[idx];
-        std::vector<std::string> vs;
-        if (str.size() <= 5)
-          vs.emplace_back(str);
-        else {
-          std::istringstream iss(str);
-          vs = std::vector(std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>());
-        }
+        const auto& name = i->current_sources[idx];
 
-        if (i->current_sources[idx + 1] == "true") {
-          font_render<render_to_image> renderobj(fontobj, background, 0.8, 0.8);
-          setkey_image(page, row, column, renderobj.draw(vs, i->im_black, 0.5, 0.5));
-        } else {
-          font_render<render_to_image> renderobj(fontobj, background_off, 0.8, 0.8);
-          setkey_image(page, row, column, renderobj.draw(vs, i->im_darkgray, 0.5, 0.5));
-        }
+        bool active = i->current_sources[idx + 1] == "true";
+        show_text(active, name, active ? i->im_black : i->im_darkgray);
         return;
       }
     }
@@ -307,19 +284,35 @@ namespace obs {
   }
 
 
-  info::info(const libconfig::Setting& config, ftlibrary& ftobj_, register_image_cb register_image_)
-  : register_image(register_image_), ftobj(ftobj_), im_black("black"), im_white("white"), im_darkgray("darkgray"),
-    obsicon(register_image(find_image("obs.png"))),
-    live_unused_icon(register_image(find_image("scene_live_unused.png"))),
-    preview_unused_icon(register_image(find_image("scene_preview_unused.png"))),
-    source_unused_icon(register_image(find_image("source_unused.png"))),
-    transition_unused_icon(register_image(find_image("transition_unused.png"))),
-    ftb { .icons = { register_image(find_image("ftb-0.png")), register_image(find_image("ftb-12.png")),
-                     register_image(find_image("ftb-25.png")), register_image(find_image("ftb-37.png")),
-                     register_image(find_image("ftb-50.png")), register_image(find_image("ftb-62.png")),
-                     register_image(find_image("ftb-75.png")), register_image(find_image("ftb-87.png")),
-                     register_image(find_image("ftb-100.png")) } },
-    obsfont(config.exists("font") ? std::string(config["font"]) : "Arial"s)
+  void record_button::show_icon()
+  {
+    if (display && i->connected) {
+      const auto& start = keyop == keyop_type::record ? i->record_start : i->stream_start;
+      if (start) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(info::timeout_clock::now() - *start);
+        auto image = display->draw(elapsed);
+        setkey_image(page, row, column, i->degraded ? mark_degraded(image) : std::move(image), false);
+        return;
+      }
+    }
+    base_type::show_icon();
+  }
+
+
+  info::info(const std::string& name_, const libconfig::Setting& config, ftlibrary& ftobj_, register_image_cb register_image_, scene_change_cb scene_change_)
+  : name(name_), register_image(register_image_), scene_change(scene_change_), ftobj(ftobj_), resync_time(metrics::get_histogram("obs." + name_ + ".resync")), event_time(metrics::get_histogram("obs." + name_ + ".event")), im_black("black"), im_white("white"), im_darkgray("darkgray"),
+    obsicon(register_icon(find_image("obs.png"))),
+    live_unused_icon(register_icon(find_image("scene_live_unused.png"))),
+    preview_unused_icon(register_icon(find_image("scene_preview_unused.png"))),
+    source_unused_icon(register_icon(find_image("source_unused.png"))),
+    transition_unused_icon(register_icon(find_image("transition_unused.png"))),
+    ftb { .icons = { register_icon(find_image("ftb-0.png")), register_icon(find_image("ftb-12.png")),
+                     register_icon(find_image("ftb-25.png")), register_icon(find_image("ftb-37.png")),
+                     register_icon(find_image("ftb-50.png")), register_icon(find_image("ftb-62.png")),
+                     register_icon(find_image("ftb-75.png")), register_icon(find_image("ftb-87.png")),
+                     register_icon(find_image("ftb-100.png")) } },
+    obsfont(config.exists("font") ? std::string(config["font"]) : "Arial"s),
+    obsblend(config.exists("blend") ? render_to_image::blend_from_name(config["blend"]) : render_to_image::blend_mode::srgb)
   {
     if (config.exists("server"))
       server = std::string(config["server"]);
@@ -346,7 +339,7 @@ namespace obs {
     else
       open = "";
 
-    obsws::config([this](const Json::Value& val){ callback(val); }, [this](bool connected){ connection_update(connected); }, server.c_str(), port, log.c_str());
+    ws = std::make_unique<obsws::connection>(name, [this](std::string_view text){ callback(text); }, [this](bool connected){ connection_update(connected); }, server.c_str(), port, log.c_str(), [this](bool degraded){ connection_health(degraded); });
 
     worker = std::thread([this]{ worker_thread(); });
   }
@@ -421,9 +414,49 @@ namespace obs {
   }
 
 
+  int info::register_icon(Magick::Image&& image)
+  {
+    Magick::Image copy(image);
+    auto res = register_image(std::move(image));
+    icon_images.emplace(res, std::move(copy));
+    return res;
+  }
+
+
+  int info::degraded_icon(int icon)
+  {
+    if (auto it = degraded_icons.find(icon); it != degraded_icons.end())
+      return it->second;
+    auto it = icon_images.find(icon);
+    if (it == icon_images.end())
+      return icon;
+    auto res = register_image(mark_degraded(it->second));
+    degraded_icons.emplace(icon, res);
+    return res;
+  }
+
+
+  std::optional<info::timeout_clock::time_point> info::next_elapsed_tick(timeout_clock::time_point now) const
+  {
+    std::optional<timeout_clock::time_point> res;
+    if (! connected)
+      return res;
+    for (const auto& b : record_buttons) {
+      const auto& start = b.keyop == keyop_type::record ? record_start : stream_start;
+      if (! b.display || ! start)
+        continue;
+      auto tick = *start + std::chrono::floor<std::chrono::seconds>(now - *start) + 1s;
+      if (! res || tick < *res)
+        res = tick;
+    }
+    return res;
+  }
+
+
   void info::worker_thread()
   {
     static constexpr auto cycle_time = 75ms;
+    static constexpr auto offline_delay = 2s;
 
     get_session_data();
 
@@ -433,19 +466,39 @@ namespace obs {
     Json::Value batch;
     while (! terminate) {
       work_request req;
-      if (ftb.active()) {
-        auto oreq = get_request(to);
+      auto tick = next_elapsed_tick(timeout_clock::now());
+      auto deadline = offline_at;
+      if (ftb.active() && (! deadline || to < *deadline))
+        deadline = to;
+      if (tick && (! deadline || *tick < *deadline))
+        deadline = tick;
+      if (deadline) {
+        auto oreq = get_request(*deadline);
 
         now = timeout_clock::now();
-        if (now >= to) {
-          ++ftb;
-          button_update(button_class::ftb);
-          to += cycle_time;
-          if (to < now)
-            to = now + cycle_time;
-        } else
-          // We are likely in a middle of a cycle, redraw the inactive icon
-          button_update(button_class::ftb);
+        if (ftb.active()) {
+          if (now >= to) {
+            ++ftb;
+            button_update(button_class::ftb);
+            to += cycle_time;
+            if (to < now)
+              to = now + cycle_time;
+          } else
+            // We are likely in a middle of a cycle, redraw the inactive icon
+            button_update(button_class::ftb);
+        }
+
+        // Only the buttons showing the elapsed time need to be redrawn.
+        if (tick && now >= *tick)
+          for (auto& b : record_buttons)
+            if (b.display)
+              b.show_icon();
+
+        if (offline_at && now >= *offline_at) {
+          offline_at.reset();
+          keys_show_session = false;
+          button_update(button_class::all);
+        }
 
         if (! oreq)
           continue;
@@ -459,8 +512,21 @@ namespace obs {
       case work_request::work_type::none:
         break;
       case work_request::work_type::new_session:
-        get_session_data();
-        [[ fallthrough ]];
+        offline_at.reset();
+        button_update(get_session_data());
+        keys_show_session = connected;
+        resync_time.add(metrics::clock_type::now() - connect_time);
+        break;
+      case work_request::work_type::disconnected:
+        if (keys_show_session)
+          offline_at = timeout_clock::now() + offline_delay;
+        else
+          button_update(button_class::all);
+        break;
+      case work_request::work_type::health:
+        degraded = req.nr != 0;
+        button_update(button_class::all);
+        break;
       case work_request::work_type::buttons:
         button_update(button_class::all);
         break;
@@ -478,6 +544,8 @@ namespace obs {
           auto& new_preview = get_current_preview();
 
           if (old_live.nr != new_live.nr) {
+            if (scene_change)
+              scene_change(current_scene);
             for (auto& p : scene_live_buttons)
               if (p.second.nr == old_live.nr || p.second.nr == new_live.nr)
                 p.second.show_icon();
@@ -581,6 +649,10 @@ namespace obs {
         break;
       case work_request::work_type::recording:
         is_recording = req.nr != 0;
+        if (is_recording)
+          record_start = timeout_clock::now();
+        else
+          record_start.reset();
         button_update(button_class::record);
         if (! is_recording && ! open.empty()) {
           std::filesystem::path fname(req.names[0]);
@@ -594,6 +666,10 @@ namespace obs {
         break;
       case work_request::work_type::streaming:
         is_streaming = req.nr != 0;
+        if (is_streaming)
+          stream_start = timeout_clock::now();
+        else
+          stream_start.reset();
         button_update(button_class::record);
         break;
       case work_request::work_type::sceneschanged:
@@ -608,7 +684,7 @@ namespace obs {
         d["request-type"] = "GetPreviewScene";
         batch["requests"].append(d);
         std::cout << "batch = " << batch << std::endl;
-        if (auto res = obsws::call(batch); res["status"] == "ok") {
+        if (auto res = ws->call(batch); res["status"] == "ok") {
           if (res["results"][0]["status"] == "ok")
             current_scene = res["results"][0]["name"].asString();
           if (res["results"][1]["status"] == "ok")
@@ -619,7 +695,7 @@ namespace obs {
       case work_request::work_type::studiomode:
         studio_mode = req.nr;
         d["request-type"] = studio_mode ? "GetPreviewScene" : "GetCurrentScene";
-        if (auto res = obsws::call(d); res["status"] == "ok") {
+        if (auto res = ws->call(d); res["status"] == "ok") {
           if (studio_mode)
             current_preview = res["name"].asString();
           current_sources.clear();
@@ -643,35 +719,14 @@ namespace obs {
       case work_request::work_type::transitionend:
         if (ignore_next_transition_change && req.names[1] == "Cut") {
           ignore_next_transition_change = false;
-          batch.clear();
-          batch["request-type"] = "ExecuteBatch";
-          d["request-type"] = "SetCurrentTransition";
-          d["transition-name"] = current_transition;
-          batch["requests"].append(d);
-          d.clear();
-          d["request-type"] = "SetTransitionDuration";
-          d["duration"] = current_duration_ms;
-          batch["requests"].append(d);
-          obsws::emit(batch);
+          ws->emit(restore_transition, { current_transition, current_duration_ms });
         } else if (ignore_next_transition_change && req.names[1] == "Fade") {
           ignore_next_transition_change = false;
-          batch.clear();
-          batch["request-type"] = "ExecuteBatch";
-          d["request-type"] = "SetCurrentTransition";
-          d["transition-name"] = current_transition;
-          batch["requests"].append(d);
-          d.clear();
-          d["request-type"] = "SetTransitionDuration";
-          d["duration"] = current_duration_ms;
-          batch["requests"].append(d);
           if (req.names[2] != "Black" && studio_mode) {
-            d.clear();
-            d["request-type"] = "SetPreviewScene";
-            d["scene-name"] = saved_preview;
+            ws->emit(restore_transition_preview, { current_transition, current_duration_ms, saved_preview });
             saved_preview.clear();
-            batch["requests"].append(d);
-          }
-          obsws::emit(batch);
+          } else
+            ws->emit(restore_transition, { current_transition, current_duration_ms });
           button_update(button_class::ftb | button_class::live | button_class::preview | button_class::cut | button_class::auto_ | button_class::transition);
         }
         break;
@@ -697,22 +752,44 @@ namespace obs {
         }
         break;
       }
+
+      update_rules();
     }
   }
 
 
-  void info::get_session_data()
+  void info::update_rules()
   {
-    Json::Value d;
-    d["request-type"] = "GetVersion";
-    auto resp = obsws::call(d);
+    rule_state.set(rules::field::connected, connected);
+    rule_state.set(rules::field::studio_mode, studio_mode);
+    rule_state.set(rules::field::recording, is_recording);
+    rule_state.set(rules::field::streaming, is_streaming);
+    rule_state.set(rules::field::ftb, ftb.active());
+    rule_state.set(rules::field::scene, current_scene);
+    rule_state.set(rules::field::preview, current_preview);
+    rule_state.set(rules::field::transition, current_transition);
+    rule_state.commit();
+  }
+
+
+  info::button_class info::get_session_data()
+  {
+    // Neither request needs authentication, they are sent together.
+    std::vector<Json::Value> handshake(2);
+    handshake[0]["request-type"] = "GetVersion";
+    handshake[1]["request-type"] = "GetAuthRequired";
+    auto hresp = ws->call(handshake);
+    if (hresp.size() != 2)
+      return button_class::all;
+
+    auto resp = std::move(hresp[0]);
     if (! resp.isMember("status") || resp["status"] != "ok" || strverscmp("4.9", resp["obs-websocket-version"].asCString()) > 0)
-      return;
+      return button_class::all;
 
-    d["request-type"] = "GetAuthRequired";
-    resp = obsws::call(d);
+    Json::Value d;
+    resp = std::move(hresp[1]);
     if (! resp.isMember("status") || resp["status"] != "ok")
-      return;
+      return button_class::all;
     if (resp["authRequired"].asBool()) {
       auto salt = resp["salt"].asCString();
       SHA256_CTX shactx;
@@ -733,12 +810,28 @@ namespace obs {
 
       EVP_EncodeBlock(enchashbuf, hashbuf, SHA256_DIGEST_LENGTH);
 
+      // The requests are handled in order, the batch need not wait for the response.
       d.clear();
       d["request-type"] = "Authenticate";
       d["auth"] = (char*) enchashbuf;
-      obsws::emit(d);
+      ws->emit(d);
     }
 
+    // The state of the previous session.  Only the keys which depend on a changed part
+    // have to be drawn again.
+    const auto old_studio_mode = studio_mode;
+    const auto old_scenes = std::exchange(scenes, {});
+    const auto old_scene = current_scene;
+    const auto old_preview = current_preview;
+    const auto old_sources = current_sources;
+    const auto old_transitions = std::exchange(transitions, {});
+    const auto old_transition = current_transition;
+    const auto old_duration_ms = current_duration_ms;
+    const auto old_recording = is_recording;
+    const auto old_streaming = is_streaming;
+    const auto old_record_start = record_start;
+    const auto old_stream_start = stream_start;
+
     Json::Value batch;
     batch["request-type"] = "ExecuteBatch";
 
@@ -750,12 +843,10 @@ namespace obs {
     d["request-type"] = "GetPreviewScene";
     batch["requests"].append(d);
 
-    scenes.clear();
     d.clear();
     d["request-type"] = "GetSceneList";
     batch["requests"].append(d);
 
-    transitions.clear();
     d.clear();
     d["request-type"] = "GetTransitionList";
     batch["requests"].append(d);
@@ -776,9 +867,9 @@ namespace obs {
     d["request-type"] = "GetStreamingStatus";
     batch["requests"].append(d);
 
-    resp = obsws::call(batch);
+    resp = ws->call(batch);
     if (! resp.isMember("status") || resp["status"] != "ok")
-      return;
+      return button_class::all;
 
     studio_mode = resp["results"][0]["status"] == "ok" && resp["results"][0]["studio-mode"].asBool();
 
@@ -811,7 +902,7 @@ namespace obs {
         d.clear();
         d["request-type"] = "CreateScene";
         d["sceneName"] = "Black";
-        obsws::emit(d);
+        ws->emit(d);
       }
 
       d.clear();
@@ -819,7 +910,7 @@ namespace obs {
       d["sceneName"] = "Black";
       d["transitionName"] = "Fade";
       d["transitionDuration"] = 1000;
-      obsws::emit(d);
+      ws->emit(d);
     }
 
     auto& transitionlist = resp["results"][3];
@@ -844,9 +935,49 @@ namespace obs {
     if (streamingstatus.isMember("status") && streamingstatus["status"] == "ok") {
       is_streaming = streamingstatus["streaming"].asBool();
       is_recording = streamingstatus["recording"].asBool() && ! streamingstatus["recording-paused"].asBool();
+
+      // The time codes are only present while active, in the format HH:MM:SS.mmm.
+      auto timecode = [now = timeout_clock::now()](bool active, const Json::Value& val) -> std::optional<timeout_clock::time_point> {
+        if (! active)
+          return std::nullopt;
+        unsigned h, m, s;
+        if (! val.isString() || sscanf(val.asCString(), "%u:%u:%u", &h, &m, &s) != 3)
+          return now;
+        return now - std::chrono::hours(h) - std::chrono::minutes(m) - std::chrono::seconds(s);
+      };
+      record_start = timecode(is_recording, streamingstatus["rec-timecode"]);
+      stream_start = timecode(is_streaming, streamingstatus["stream-timecode"]);
     }
 
     connected = true;
+
+    // The time codes have only a resolution of seconds.  Keep the old start time if it
+    // is most likely the same recording or stream.
+    auto same_start = [](const auto& start, const auto& old) {
+      return start && old && (*start > *old ? *start - *old : *old - *start) < 2s;
+    };
+    if (same_start(record_start, old_record_start))
+      record_start = old_record_start;
+    if (same_start(stream_start, old_stream_start))
+      stream_start = old_stream_start;
+
+    if (! keys_show_session || studio_mode != old_studio_mode)
+      return button_class::all;
+
+    auto res = button_class::none;
+    if (scenes != old_scenes || current_scene != old_scene)
+      res = res | button_class::live | button_class::sources;
+    if (scenes != old_scenes || current_preview != old_preview)
+      res = res | button_class::preview | button_class::sources;
+    if (current_sources != old_sources)
+      res = res | button_class::sources;
+    if (transitions != old_transitions || current_transition != old_transition)
+      res = res | button_class::transition;
+    if (current_duration_ms != old_duration_ms)
+      res = res | button_class::auto_;
+    if (is_recording != old_recording || is_streaming != old_streaming || record_start != old_record_start || stream_start != old_stream_start)
+      res = res | button_class::record;
+    return res;
   }
 
 
@@ -858,6 +989,21 @@ namespace obs {
   }
 
 
+  void info::add_elapsed(record_button& b, const std::string& iconname, const libconfig::Setting& config)
+  {
+    bool elapsed = false;
+    if (! config.lookupValue("elapsed", elapsed) || ! elapsed)
+      return;
+
+    std::string font = obsfont;
+    config.lookupValue("font", font);
+    std::string color("white");
+    config.lookupValue("color", color);
+    ftface fontobj(ftobj, font);
+    b.display.emplace(fontobj, find_image(iconname), Magick::Color(color));
+  }
+
+
   button* info::parse_key(set_key_image_cb setkey_image, set_key_handle_cb setkey_handle, unsigned page, unsigned row, unsigned column, const libconfig::Setting& config)
   {
     if (! config.exists("function"))
@@ -873,6 +1019,9 @@ namespace obs {
       config.lookupValue("icon2", icon2name);
     else
       icon2name = icon1name;
+    auto blend = obsblend;
+    if (config.exists("blend"))
+      blend = render_to_image::blend_from_name(config["blend"]);
     if (function == "scene-live"){
       if (icon1name.empty()) {
         icon1name = "scene_live.png";
@@ -885,7 +1034,7 @@ namespace obs {
       else
       	font = obsfont;
       unsigned nr = 1u + scene_live_buttons.size();
-      return &scene_live_buttons.emplace(nr, scene_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::live_scene, ftobj, font))->second;
+      return &scene_live_buttons.emplace(nr, scene_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::live_scene, ftobj, font, blend))->second;
     } else if (function == "scene-preview") {
       if (icon1name.empty()) {
         icon1name = "scene_preview.png";
@@ -898,11 +1047,11 @@ namespace obs {
       else
       	font = obsfont;
       unsigned nr = 1u + scene_preview_buttons.size();
-      return &scene_preview_buttons.emplace(nr, scene_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::preview_scene, ftobj, font))->second;
+      return &scene_preview_buttons.emplace(nr, scene_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::preview_scene, ftobj, font, blend))->second;
     } else if (function == "scene-cut") {
       if (icon1name.empty())
         icon1name = "cut.png";
-      icon1 = register_image(find_image(icon1name));
+      icon1 = register_icon(find_image(icon1name));
       return &cut_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, icon1, icon1, keyop_type::cut);
     } else if (function == "scene-auto") {
       if (icon1name.empty())
@@ -930,11 +1079,11 @@ namespace obs {
           }
         }
       }
-      return &auto_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), keyop_type::auto_rate, ftobj, font, color, std::move(center), current_duration_ms);
+      return &auto_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), keyop_type::auto_rate, ftobj, font, blend, color, std::move(center), current_duration_ms);
     } else if (function == "scene-ftb") {
       if (icon1name.empty())
         icon1name = "ftb.png";
-      icon1 = register_image(find_image(icon1name));
+      icon1 = register_icon(find_image(icon1name));
       return &ftb_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, icon1, icon1, keyop_type::ftb);
     } else if (function == "transition") {
       if (icon1name.empty()) {
@@ -948,7 +1097,7 @@ namespace obs {
       else
       	font = obsfont;
       unsigned nr = 1u + transition_buttons.size();
-      return &transition_buttons.emplace(nr, transition_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::transition, ftobj, font))->second;
+      return &transition_buttons.emplace(nr, transition_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::transition, ftobj, font, blend))->second;
     } else if (function == "source") {
       if (icon1name.empty()) {
         icon1name = "source.png";
@@ -961,32 +1110,36 @@ namespace obs {
       else
         font = obsfont;
       unsigned nr = 1u + source_buttons.size();
-      icon1 = register_image(find_image(icon1name));
-      return &source_buttons.emplace(nr, source_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::source, ftobj, font))->second;
+      icon1 = register_icon(find_image(icon1name));
+      return &source_buttons.emplace(nr, source_button(nr, setkey_image, setkey_handle, this, page, row, column, find_image(icon1name), find_image(icon2name), keyop_type::source, ftobj, font, blend))->second;
     } else if (function == "toggle-record") {
       if (icon1name.empty()) {
         icon1name = "record.png";
         if (icon2name.empty())
           icon2name = "record_off.png";
       }
-      icon1 = register_image(find_image(icon1name));
+      icon1 = register_icon(find_image(icon1name));
       if (icon1name == icon2name)
         icon2 = icon1;
       else
-        icon2 = register_image(find_image(icon2name));
-      return &record_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, icon1, icon2, keyop_type::record);
+        icon2 = register_icon(find_image(icon2name));
+      auto& b = record_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, icon1, icon2, keyop_type::record);
+      add_elapsed(b, icon1name, config);
+      return &b;
     } else if (function == "toggle-stream") {
       if (icon1name.empty()) {
         icon1name = "stream.png";
         if (icon2name.empty())
           icon2name = "stream_off.png";
       }
-      icon1 = register_image(find_image(icon1name));
+      icon1 = register_icon(find_image(icon1name));
       if (icon1name == icon2name)
         icon2 = icon1;
       else
-        icon2 = register_image(find_image(icon2name));
-      return &record_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, icon1, icon2, keyop_type::stream);
+        icon2 = register_icon(find_image(icon2name));
+      auto& b = record_buttons.emplace_back(0, setkey_image, setkey_handle, this, page, row, column, icon1, icon2, keyop_type::stream);
+      add_elapsed(b, icon1name, config);
+      return &b;
     }
 
     return nullptr;
@@ -1013,91 +1166,95 @@ namespace obs {
 
   // This function is executed by the obsws thread.  It should only use the worker_queue to
   // affect the state of the object.
-  void info::callback(const Json::Value& val)
+  void info::callback(std::string_view text)
   {
+    metrics::timer t(event_time);
+    json_view val(text);
     std::vector<std::string> vs;
     decltype(work_request::nr) nr = 0;
     work_request::work_type type(work_request::work_type::none);
 
 
-    auto update_type = val["update-type"]; 
+    auto update_type = val["update-type"].as_string();
     if (update_type == "TransitionVideoEnd") {
-      vs.emplace_back(val["to-scene"].asString());
-      vs.emplace_back(val["from-scene"].asString());
+      vs.emplace_back(val["to-scene"].as_string());
+      vs.emplace_back(val["from-scene"].as_string());
       type = work_request::work_type::scene;
     } else if (update_type == "PreviewSceneChanged") {
-      vs.emplace_back(val["scene-name"].asString());
-      for (const auto& s : val["sources"]) {
-        vs.emplace_back(s["name"].asString());
-        vs.emplace_back(s["render"].asBool() ? "true" : "false");
-      }
+      vs.emplace_back(val["scene-name"].as_string());
+      val["sources"].for_each([&vs](json_view s) {
+        vs.emplace_back(s["name"].as_string());
+        vs.emplace_back(s["render"].as_bool() ? "true" : "false");
+      });
       type = work_request::work_type::preview;
     } else if (update_type == "SwitchTransition") {
       if (! handle_next_transition_change.test_and_set())
         return;
 
-      vs.emplace_back(val["transition-name"].asString());
+      vs.emplace_back(val["transition-name"].as_string());
       type = work_request::work_type::transition;
     } else if (update_type == "Exiting")
       connection_update(false);
     else if (update_type == "TransitionDurationChanged") {
-      nr = val["new-duration"].asUInt();
+      nr = val["new-duration"].as_uint();
       type = work_request::work_type::duration;
     } else if (update_type == "SourceCreated" || update_type == "SourceDestroyed") {
       if (val["sourceType"] == "scene") {
-        vs.emplace_back(val["sourceName"].asString());
+        vs.emplace_back(val["sourceName"].as_string());
         type = update_type == "SourceCreated" ? work_request::work_type::new_scene : work_request::work_type::delete_scene;
       } else
         return;
     } else if (update_type == "RecordingStarted" || update_type == "RecordingStopped") {
-      vs.emplace_back(val["recordingFilename"].asString());
+      vs.emplace_back(val["recordingFilename"].as_string());
       nr = update_type == "RecordingStarted";
       type = work_request::work_type::recording;
     } else if (update_type == "StreamStarted" || update_type == "StreamStopped") {
       nr = update_type == "StreamStarted";
       type = work_request::work_type::streaming;
     } else if (update_type == "ScenesChanged") {
-      for (auto& s : val["scenes"])
+      val["scenes"].for_each([&vs](json_view s) {
         if (s["name"] != "Black")
-          vs.emplace_back(s["name"].asString());
+          vs.emplace_back(s["name"].as_string());
+      });
       type = work_request::work_type::sceneschanged;
     } else if (update_type == "StudioModeSwitched") {
-      nr = val["new-state"].asBool();
+      nr = val["new-state"].as_bool();
       type = work_request::work_type::studiomode;
     } else if (update_type == "SwitchScenes") {
-      vs.emplace_back(val["scene-name"].asString());
-      for (const auto& s : val["sources"]) {
-        vs.emplace_back(s["name"].asString());
-        vs.emplace_back(s["render"].asBool() ? "true" : "false");
-      }
+      vs.emplace_back(val["scene-name"].as_string());
+      val["sources"].for_each([&vs](json_view s) {
+        vs.emplace_back(s["name"].as_string());
+        vs.emplace_back(s["render"].as_bool() ? "true" : "false");
+      });
       type = work_request::work_type::scenecontent;
     } else if (update_type == "SceneItemVisibilityChanged") {
-      vs.emplace_back(val["scene-name"].asString());
-      vs.emplace_back(val["item-name"].asString());
-      vs.emplace_back(val["item-visible"].asString());
+      vs.emplace_back(val["scene-name"].as_string());
+      vs.emplace_back(val["item-name"].as_string());
+      vs.emplace_back(val["item-visible"].as_string());
       type = work_request::work_type::visible;
     } else if (update_type == "SceneItemTransformChanged") {
-      vs.emplace_back(val["scene-name"].asString());
-      vs.emplace_back(val["item-name"].asString());
-      vs.emplace_back(val["transform"]["visible"].asString());
+      vs.emplace_back(val["scene-name"].as_string());
+      vs.emplace_back(val["item-name"].as_string());
+      vs.emplace_back(val["transform"]["visible"].as_string());
       type = work_request::work_type::visible;
     } else if (update_type == "SourceRenamed") {
-      vs.emplace_back(val["previousName"].asString());
-      vs.emplace_back(val["newName"].asString());
+      vs.emplace_back(val["previousName"].as_string());
+      vs.emplace_back(val["newName"].as_string());
       type = work_request::work_type::sourcename;
     } else if (update_type == "TransitionEnd") {
-      vs.emplace_back(val["to-scene"].asString());
-      vs.emplace_back(val["name"].asString());
-      vs.emplace_back(val["to-scene"].asString());
+      vs.emplace_back(val["to-scene"].as_string());
+      vs.emplace_back(val["name"].as_string());
+      vs.emplace_back(val["to-scene"].as_string());
       type = work_request::work_type::transitionend;
     } else if (update_type == "SourceOrderChanged") {
-      vs.emplace_back(val["scene-name"].asString());
-      for (const auto& s : val["scene-items"])
-        vs.emplace(vs.begin() + 1, s["source-name"].asString());
+      vs.emplace_back(val["scene-name"].as_string());
+      val["scene-items"].for_each([&vs](json_view s) {
+        vs.emplace(vs.begin() + 1, s["source-name"].as_string());
+      });
       type = work_request::work_type::sourceorder;
     } else {
       if (log_unknown_events)
-        std::cout << "info::callback unhandled event = " << val << std::endl;
+        std::cout << "info::callback unhandled event = " << text << std::endl;
       return;
     }
 
@@ -1115,13 +1272,23 @@ namespace obs {
       return;
 
     std::lock_guard<std::mutex> guard(worker_m);
-    if (connected_)
+    if (connected_) {
+      connect_time = metrics::clock_type::now();
       worker_queue.emplace(work_request::work_type::new_session);
-    else {
+    } else {
       connected = false;
-      worker_queue.emplace(work_request::work_type::buttons);
+      worker_queue.emplace(work_request::work_type::disconnected);
     }
     worker_cv.notify_all();
   }
 
+
+  // Also executed by the obsws thread.
+  void info::connection_health(bool degraded_)
+  {
+    std::lock_guard<std::mutex> guard(worker_m);
+    worker_queue.emplace(work_request::work_type::health, unsigned(degraded_));
+    worker_cv.notify_all();
+  }
+
 } // namespace obs
@@ -5,10 +5,12 @@
 #include <condition_variable>
 #include <functional>
 #include <list>
+#include <map>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
@@ -19,7 +21,13 @@
 #include <json/json.h>
 #include <Magick++.h>
 
+#include "buttontext.hh"
 #include "ftlibrary.hh"
+#include "keylayers.hh"
+#include "elapsed.hh"
+#include "metrics.hh"
+#include "obsws.hh"
+#include "rules.hh"
 
 
 namespace obs {
@@ -46,6 +54,8 @@ namespace obs {
     scene(unsigned nr_, const std::string& name_) : nr(nr_), name(name_) { }
     unsigned nr = 0;
     std::string name;
+
+    bool operator==(const scene&) const = default;
   };
 
 
@@ -54,10 +64,13 @@ namespace obs {
     transition(unsigned nr_, const std::string& name_) : nr(nr_), name(name_) { }
     unsigned nr = 0;
     std::string name;
+
+    bool operator==(const transition&) const = default;
   };
 
 
-  using set_key_image_cb = std::function<void(unsigned,unsigned,unsigned,Magick::Image&&)>;
+  // The last parameter says whether the image shows state and must not be delayed.
+  using set_key_image_cb = std::function<void(unsigned,unsigned,unsigned,Magick::Image&&,bool)>;
   using set_key_handle_cb = std::function<void(unsigned,unsigned,unsigned,int)>;
 
 
@@ -85,8 +98,8 @@ namespace obs {
   struct auto_button : button {
     using base_type = button;
 
-    auto_button(unsigned nr_, set_key_image_cb setkey_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, Magick::Image&& icon1_, keyop_type keyop_, ftlibrary& ftobj, const std::string& font_, const std::string& color_, std::pair<double,double>&& center_, unsigned& duration_ms_)
-    : base_type(nr_, setkey_image_, setkey_handle_, i_, page_, row_, column_, -1, -1, keyop_), background(std::move(icon1_)), fontobj(ftobj, std::move(font_)), duration_ms(duration_ms_), color(color_), center(std::move(center_))
+    auto_button(unsigned nr_, set_key_image_cb setkey_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, Magick::Image&& icon1_, keyop_type keyop_, ftlibrary& ftobj, const std::string& font_, render_to_image::blend_mode blend_, const std::string& color_, std::pair<double,double>&& center_, unsigned& duration_ms_)
+    : base_type(nr_, setkey_image_, setkey_handle_, i_, page_, row_, column_, -1, -1, keyop_), background(std::move(icon1_)), fontobj(ftobj, std::move(font_)), blend(blend_), duration_ms(duration_ms_), color(color_), center(std::move(center_))
     {
     }
 
@@ -94,57 +107,66 @@ namespace obs {
 
     Magick::Image background;
     ftface fontobj;
+    render_to_image::blend_mode blend;
+    key_layers layers;
     unsigned& duration_ms;
     Magick::Color color;
     std::pair<double,double> center;
   };
 
 
-  struct scene_button : button {
+  // The buttons showing a name on a background which depends on the state.  The
+  // image is kept and the text only drawn again if the name or the state change.
+  struct text_button : button {
     using base_type = button;
 
-    scene_button(unsigned nr_, set_key_image_cb setkey_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, Magick::Image&& icon1_, Magick::Image&& icon2_, keyop_type keyop_, ftlibrary& ftobj, const std::string& font_)
-    : base_type(nr_, setkey_image_, setkey_handle_, i_, page_, row_, column_, -1, -1, keyop_), background(std::move(icon1_)), background_off(std::move(icon2_)), fontobj(ftobj, std::move(font_))
+    text_button(unsigned nr_, set_key_image_cb setkey_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, Magick::Image&& icon1_, Magick::Image&& icon2_, keyop_type keyop_, ftlibrary& ftobj, const std::string& font_, render_to_image::blend_mode blend_)
+    : base_type(nr_, setkey_image_, setkey_handle_, i_, page_, row_, column_, -1, -1, keyop_), background(std::move(icon1_)), background_off(std::move(icon2_)), fontobj(ftobj, std::move(font_)), blend(blend_)
     {
     }
 
-    void show_icon() override;
+    void show_text(bool active, const std::string& name, const Magick::Color& color);
 
     Magick::Image background;
     Magick::Image background_off;
     ftface fontobj;
+    render_to_image::blend_mode blend;
+    key_layers layers;
   };
 
 
-  struct transition_button : button {
-    using base_type = button;
+  struct scene_button : text_button {
+    using base_type = text_button;
+    using base_type::base_type;
 
-    transition_button(unsigned nr_, set_key_image_cb setkey_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, Magick::Image&& icon1_, Magick::Image&& icon2_, keyop_type keyop_, ftlibrary& ftobj, const std::string& font_)
-    : base_type(nr_, setkey_image_, setkey_handle_, i_, page_, row_, column_, -1, -1, keyop_), background(std::move(icon1_)), background_off(std::move(icon2_)), fontobj(ftobj, std::move(font_))
-    {
-    }
+    void show_icon() override;
+  };
+
+
+  struct transition_button : text_button {
+    using base_type = text_button;
+    using base_type::base_type;
 
     void show_icon() override;
+  };
 
-    Magick::Image background;
-    Magick::Image background_off;
-    ftface fontobj;
+
+  struct source_button : text_button {
+    using base_type = text_button;
+    using base_type::base_type;
+
+    void show_icon() override;
   };
 
 
-  struct source_button : button {
+  // Record and stream buttons.  With a display the elapsed time is shown while active.
+  struct record_button : button {
     using base_type = button;
-
-    source_button(unsigned nr_, set_key_image_cb setkey_image_image_, set_key_handle_cb setkey_handle_, info* i_, unsigned page_, unsigned row_, unsigned column_, Magick::Image&& icon1_, Magick::Image&& icon2_, keyop_type keyop_, ftlibrary& ftobj, const std::string& font_)
-    : base_type(nr_, setkey_image_image_, setkey_handle_, i_, page_, row_, column_, -1, -1, keyop_), background(std::move(icon1_)), background_off(std::move(icon2_)), fontobj(ftobj, std::move(font_))
-    {
-    }
+    using base_type::base_type;
 
     void show_icon() override;
 
-    Magick::Image background;
-    Magick::Image background_off;
-    ftface fontobj;
+    std::optional<elapsed_display> display;
   };
 
 
@@ -152,6 +174,8 @@ namespace obs {
     enum struct work_type {
         none,
         new_session,
+        disconnected,
+        health,
         buttons,
         scene,
         scenecontent,
@@ -176,12 +200,14 @@ namespace obs {
 
   struct info {
     using register_image_cb = std::function<int(Magick::Image&&)>;
+    // Called on the worker thread when the program scene changes.
+    using scene_change_cb = std::function<void(const std::string&)>;
 
-    info(const libconfig::Setting& config, ftlibrary& ftobj_, register_image_cb register_image_);
+    info(const std::string& name_, const libconfig::Setting& config, ftlibrary& ftobj_, register_image_cb register_image_, scene_change_cb scene_change_ = {});
     ~info();
 
-    void get_session_data();
     button* parse_key(set_key_image_cb setkey_image, set_key_handle_cb setkey_handle,  unsigned page, unsigned row, unsigned column, const libconfig::Setting& config);
+    void add_elapsed(record_button& b, const std::string& iconname, const libconfig::Setting& config);
 
     void add_scene(unsigned idx, const char* name);
     unsigned scene_count() const { return scenes.size(); }
@@ -195,11 +221,16 @@ namespace obs {
     std::string& get_transition_name(unsigned nr) { for (auto& p : transitions) if (p.second.nr == nr) return p.second.name; throw std::runtime_error("invalid transition number"); }
 
     void worker_thread();
-    void callback(const Json::Value& val);
+    // Decode an event, only the fields needed are extracted from the text.
+    void callback(std::string_view text);
     void connection_update(bool connected_);
+    void connection_health(bool degraded_);
 
     bool prohibit_sleep() const { return is_recording || is_streaming; }
 
+    // Time at which the elapsed time shown on the record and stream buttons changes next.
+    std::optional<std::chrono::system_clock::time_point> next_elapsed_tick(std::chrono::system_clock::time_point now) const;
+
     enum struct button_class : unsigned {
       none = 0u,
       live = 1u << 0,
@@ -215,12 +246,42 @@ namespace obs {
     };
     void button_update(button_class bc);
 
+    // Returns the buttons which differ from the state of the previous session.
+    button_class get_session_data();
+
+    // Copy the state to the rule engine, this re-evaluates the rules depending on changes.
+    void update_rules();
+    rules::engine rule_state;
+
+    // Name of the connection, used in the key configuration and for metrics.
+    const std::string name;
+
     const register_image_cb register_image;
+    const scene_change_cb scene_change;
+    // Register an icon which might have to be shown with the degraded indicator.
+    int register_icon(Magick::Image&& image);
+    int degraded_icon(int icon);
 
     ftlibrary& ftobj;
 
+    std::string server;
+    int port;
+    std::string password;
+    std::string log;
+    std::unique_ptr<obsws::connection> ws;
+
     bool created_ws = false;
     bool connected = false;
+    // The keys show the state of the current or last session, not the disconnected state.
+    bool keys_show_session = false;
+    // After a disconnect the keys keep showing the last state for a moment.  If the
+    // connection is re-established in time only the keys with a changed state are drawn.
+    std::optional<std::chrono::system_clock::time_point> offline_at;
+    metrics::clock_type::time_point connect_time;
+    metrics::histogram& resync_time;
+    metrics::histogram& event_time;
+    // The responses of OBS are slow, the keys show an indicator.
+    bool degraded = false;
     std::queue<work_request> worker_queue;
     work_request get_request();
     using timeout_clock = std::chrono::system_clock;
@@ -236,6 +297,8 @@ namespace obs {
     bool studio_mode = false;
     bool is_recording = false;
     bool is_streaming = false;
+    std::optional<timeout_clock::time_point> record_start;
+    std::optional<timeout_clock::time_point> stream_start;
 
     bool ignore_next_transition_change = false;
 
@@ -247,7 +310,7 @@ namespace obs {
     std::string saved_preview;
     std::unordered_map<std::string,obs::transition> transitions;
     std::string current_transition;
-    unsigned current_duration_ms;
+    unsigned current_duration_ms = 0;
     std::atomic_flag handle_next_transition_change = true;
 
     std::unordered_multimap<unsigned,scene_button> scene_live_buttons;
@@ -257,9 +320,12 @@ namespace obs {
     std::list<auto_button> auto_buttons;
     std::list<button> ftb_buttons;
     std::unordered_multimap<unsigned,transition_button> transition_buttons;
-    std::list<button> record_buttons;
+    std::list<record_button> record_buttons;
     std::string open;
 
+    std::map<int,Magick::Image> icon_images;
+    std::map<int,int> degraded_icons;
+
     const Magick::Color im_black;
     const Magick::Color im_white;
     const Magick::Color im_darkgray;
@@ -285,6 +351,7 @@ namespace obs {
     } ftb;
 
     const std::string obsfont;
+    const render_to_image::blend_mode obsblend;
   };
 
 
@@ -6,16 +6,25 @@
 #else
 # include <condition_variable>
 #endif
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <thread>
+#include <unistd.h>
+#include <sys/inotify.h>
 
 #include <json/json.h>
 #include <libwebsockets.h>
 #include <uuid.h>
 
+#include "jsonview.hh"
+#include "metrics.hh"
+
 #if __cpp_lib_atomic_wait == 0
 # include <cerrno>
 # include <sys/syscall.h>
@@ -118,14 +127,70 @@ namespace {
   };
 
 
-  struct client {
-    client(obsws::event_cb_type event_cb_, obsws::update_cb_type update_cb_, const char* server_, unsigned port_, const char* log, int ssl_connection_, const char* ssl_ca_path, const uint32_t* backoff_ms, uint16_t nbackoff_ms, uint16_t secs_since_valid_ping, uint16_t secs_since_valid_hangup, uint8_t jitter_percent);
-    ~client() { status = ws_status::terminated; atomic_notify_all(status); thread.join(); }
+  // All connections share one libwebsockets context and therefore one thread which
+  // runs the event loop.  The libwebsockets functions which change the schedule are
+  // not thread-safe, clients are therefore added and removed by the service thread.
+  struct service {
+    service();
+    ~service();
+
+    static service& instance() { static service s; return s; }
+
+    lws_context* get() { return context.get(); }
 
-    static auto allocate(obsws::event_cb_type event_cb, obsws::update_cb_type update_cb_, const char* server, unsigned port, const char* log, int ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_INSECURE | LCCSCF_ALLOW_EXPIRED | LCCSCF_ALLOW_SELFSIGNED, const char* ssl_ca_path = nullptr, const uint32_t* backoff_ms = init_backoff_ms, uint16_t nbackoff_ms = LWS_ARRAY_SIZE(init_backoff_ms), uint16_t secs_since_valid_ping = 3, uint16_t secs_since_valid_hangup = 10, uint8_t jitter_percent = 20)
-    { return std::make_unique<client>(event_cb, update_cb_, server, port, log, ssl_connection, ssl_ca_path, backoff_ms, nbackoff_ms, secs_since_valid_ping, secs_since_valid_hangup, jitter_percent); }
+    void attach(obsws::client* c);
+    void detach(obsws::client* c);
 
+  private:
     void run();
+
+    static constexpr unsigned max_connections = 16;
+    static const lws_protocols protocols[2];
+
+    std::unique_ptr<lws_context, void(*)(lws_context*)> context{ nullptr, nullptr };
+    std::atomic<bool> terminated = false;
+    std::thread thread;
+
+    // Only used by the service thread.
+    std::list<obsws::client*> clients;
+
+    std::mutex lock;
+    std::list<obsws::client*> attaching;
+    std::list<std::pair<obsws::client*,std::latch*>> detaching;
+  };
+
+} // anonymous namespace
+
+
+namespace obsws {
+
+  struct client {
+    client(const std::string& name, obsws::event_cb_type event_cb_, obsws::update_cb_type update_cb_, obsws::health_cb_type health_cb_, const char* server_, unsigned port_, const char* log, int ssl_connection_, const uint32_t* backoff_ms, uint16_t nbackoff_ms, uint16_t secs_since_valid_ping, uint16_t secs_since_valid_hangup, uint8_t jitter_percent);
+    ~client() { status = ws_status::terminated; atomic_notify_all(status); service::instance().detach(this); if (presence_fd != -1) close(presence_fd); }
+
+    static auto allocate(const std::string& name, obsws::event_cb_type event_cb, obsws::update_cb_type update_cb_, obsws::health_cb_type health_cb_, const char* server, unsigned port, const char* log, int ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_INSECURE | LCCSCF_ALLOW_EXPIRED | LCCSCF_ALLOW_SELFSIGNED, const uint32_t* backoff_ms = init_backoff_ms, uint16_t nbackoff_ms = LWS_ARRAY_SIZE(init_backoff_ms), uint16_t secs_since_valid_ping = 3, uint16_t secs_since_valid_hangup = 10, uint8_t jitter_percent = 20)
+    { return std::make_unique<client>(name, event_cb, update_cb_, health_cb_, server, port, log, ssl_connection, backoff_ms, nbackoff_ms, secs_since_valid_ping, secs_since_valid_hangup, jitter_percent); }
+
+    // These functions are called by the service thread.
+    void start();
+    void stop();
+    void serviced() {
+      auto s = status.load();
+      if (s == ws_status::connected) {
+        if (status.compare_exchange_strong(s, ws_status::running))
+          atomic_notify_all(status);
+      }
+    }
+
+    // A local OBS creates a new log file when it starts.  While it is not running the
+    // directory is watched instead of trying to connect periodically.
+    void check_presence();
+
+    // A cheap request is sent periodically and the time until the response arrives is
+    // recorded.  If the response takes too long the connection is marked as degraded,
+    // if there is no response at all the connection is closed and re-established.
+    void check_health();
+
     bool ensure_running() {
       bool started = false;
       for (auto s = status.load(); s != ws_status::running && s != ws_status::writable; s = status.load()) {
@@ -158,49 +223,63 @@ namespace {
     }
 
     int send(const std::string& s);
+    bool send(const request_template& t, std::initializer_list<template_arg> args);
     request& send(Json::Value&& root, bool emit);
 
     void terminate() { status = ws_status::terminated; atomic_notify_all(status); }
 
     static int callback(struct lws* wsi, enum lws_callback_reasons reason, void* user, void* in, size_t len)
     {
+      if (user == nullptr)
+        return lws_callback_http_dummy(wsi, reason, user, in, len);
       return ((client*) user)->callback(wsi, reason, in, len);
     }
 
     template<bool emit>
     auto call_emit(const Json::Value& din)
     {
-      Json::Value d(din);
-      uuid_t uuid;
-      char uuid_str[37];
-      uuid_generate(uuid);
-      uuid_unparse(uuid, uuid_str);
-      d["message-id"] = uuid_str;
-      auto& req(send(std::move(d), emit));
-
-      if (log_transmits)
-        std::cout << "transmitted " << din << std::endl;
+      auto start = metrics::clock_type::now();
+      auto [uuid_str, req] = send_request(din, emit);
 
       if constexpr (emit) 
         return true;
       else {
         req.l.wait();
+        call_time.add(metrics::clock_type::now() - start);
         Json::Value res = std::move(req.result);
+        std::lock_guard guard(lock);
         outstanding.remove_if([uuid_str](auto& e) { return e.d["message-id"].asString() == uuid_str; });
         return res;    
       }
     }
 
+    // All requests are sent before waiting for the first response.
+    std::vector<Json::Value> call_all(const std::vector<Json::Value>& din)
+    {
+      auto start = metrics::clock_type::now();
+      std::vector<std::pair<std::string,request*>> reqs;
+      for (const auto& d : din) {
+        auto [uuid_str, req] = send_request(d, false);
+        reqs.emplace_back(uuid_str, &req);
+      }
+
+      std::vector<Json::Value> res;
+      for (auto& [uuid_str, req] : reqs) {
+        req->l.wait();
+        res.emplace_back(std::move(req->result));
+        std::lock_guard guard(lock);
+        outstanding.remove_if([&uuid_str](auto& e) { return e.d["message-id"].asString() == uuid_str; });
+      }
+      call_time.add(metrics::clock_type::now() - start);
+      return res;
+    }
+
   protected:
-    static const char protocol_name[];
     static const uint32_t init_backoff_ms[3];
-    static const uint32_t subsequent_backoff_ms[4];
-    const lws_protocols protocols[2] = {
-      { "obsws", callback, 0, 0 },
-      { nullptr, nullptr, 0, 0}
-    };
+    static const uint32_t subsequent_backoff_ms[7];
+    static const uint32_t starting_backoff_ms[6];
+    static const uint32_t watched_backoff_ms[1];
 
-    std::unique_ptr<lws_context, void(*)(lws_context*)> context{ nullptr, nullptr };
     lws_retry_bo_t retry;
     const char* remote_protocol;
     const int ssl_connection;
@@ -218,13 +297,47 @@ namespace {
     std::atomic<ws_status> status = ws_status::idle;
     uint16_t retry_count = 0;      // count of consequetive retries
 
-    std::thread thread;
     obsws::event_cb_type event_cb;
     obsws::update_cb_type update_cb;
+    obsws::health_cb_type health_cb;
 
     // Memory used to partial results.
     std::string chunks;
 
+    metrics::counter& connects;
+    metrics::counter& disconnects;
+    metrics::counter& events;
+    metrics::counter& requests;
+    metrics::counter& bytes_received;
+    metrics::histogram& call_time;
+    metrics::counter& presence;
+    // Sequence number for the message IDs of template requests, sent from several threads.
+    std::atomic<unsigned long> template_seq = 0;
+    metrics::histogram& rtt;
+    metrics::counter& degradations;
+    metrics::counter& stalls;
+
+    static constexpr auto probe_interval = std::chrono::seconds(2);
+    static constexpr auto degraded_rtt = std::chrono::milliseconds(500);
+    static constexpr auto stall_timeout = std::chrono::seconds(5);
+    static constexpr const char probe_id[] = "health-probe";
+    std::optional<metrics::clock_type::time_point> probe_sent;
+    metrics::clock_type::time_point next_probe;
+    bool degraded = false;
+    void set_degraded(bool d);
+
+    // Inotify descriptor for the log directories of a local OBS, or -1.
+    int presence_fd = -1;
+    void watch_presence();
+
+    template<size_t N>
+    void set_retry(const uint32_t (&table)[N]) {
+      retry_count = 0;
+      retry.retry_ms_table = table;
+      retry.retry_ms_table_count = N;
+      retry.conceal_count = N;
+    }
+
     static void connect(lws_sorted_usec_list_t* sul) {
       // Unfortunately the C interface of libwebsockets so far does not have any callbacks
       // with additional parameters passed in.  Resort to ugly pointer arithmetic.
@@ -235,51 +348,79 @@ namespace {
 
     int callback(struct lws* wsi, enum lws_callback_reasons reason, void* in, size_t len);
 
+    std::pair<std::string,request&> send_request(const Json::Value& din, bool emit);
+
   private:
     void connect();
     void exhausted();
+    void fail_outstanding();
 
+    // The requests are added and removed by the calling threads, the responses and
+    // failures are filled in by the service thread.
     std::list<request> outstanding;
     std::mutex lock;
+    // libwebsockets does not serialize writes to the same connection.
+    std::mutex send_lock;
   };
 
 
-  const char client::protocol_name[] = "obsws";
-
   const uint32_t client::init_backoff_ms[3] = { 250, 500, 750 }; // XYZ Last number should be 2 minutes or so...
   static constexpr uint32_t connect_timeout = 10000;  // XYZ Number should be 2 minutes or so...
-  const uint32_t client::subsequent_backoff_ms[4] = { connect_timeout, 250, 500, 750 };
+  const uint32_t client::subsequent_backoff_ms[7] = { 250, 500, 1000, 2000, 4000, 8000, connect_timeout };
+  // After a local OBS has been seen starting its websocket server needs a moment.
+  const uint32_t client::starting_backoff_ms[6] = { 100, 200, 400, 800, 1600, 3200 };
+  // Only a fallback, the start of a local OBS is noticed through the log directory.
+  const uint32_t client::watched_backoff_ms[1] = { 120000 };
 
 
-  client::client(obsws::event_cb_type event_cb_, obsws::update_cb_type update_cb_, const char* server_, unsigned port_, const char* log, int ssl_connection_, const char* ssl_ca_path, const uint32_t* backoff_ms, uint16_t nbackoff_ms, uint16_t secs_since_valid_ping, uint16_t secs_since_valid_hangup, uint8_t jitter_percent)
+  client::client(const std::string& name, obsws::event_cb_type event_cb_, obsws::update_cb_type update_cb_, obsws::health_cb_type health_cb_, const char* server_, unsigned port_, const char* log, int ssl_connection_, const uint32_t* backoff_ms, uint16_t nbackoff_ms, uint16_t secs_since_valid_ping, uint16_t secs_since_valid_hangup, uint8_t jitter_percent)
   : retry{ .retry_ms_table = backoff_ms, .retry_ms_table_count = nbackoff_ms, .conceal_count = nbackoff_ms, .secs_since_valid_ping = secs_since_valid_ping, .secs_since_valid_hangup = secs_since_valid_hangup, .jitter_percent = jitter_percent },
-    ssl_connection(ssl_connection_), server(server_), port(port_), log_events(strstr(log, "events") != nullptr), log_transmits(strstr(log, "transmits") != nullptr), wrap{ this }, status(ws_status::connecting), event_cb(event_cb_), update_cb(update_cb_)
+    ssl_connection(ssl_connection_), server(server_), port(port_), log_events(strstr(log, "events") != nullptr), log_transmits(strstr(log, "transmits") != nullptr), wrap{ this }, status(ws_status::connecting), event_cb(event_cb_), update_cb(update_cb_), health_cb(health_cb_),
+    connects(metrics::get_counter("obs." + name + ".connects")),
+    disconnects(metrics::get_counter("obs." + name + ".disconnects")),
+    events(metrics::get_counter("obs." + name + ".events")),
+    requests(metrics::get_counter("obs." + name + ".requests")),
+    bytes_received(metrics::get_counter("obs." + name + ".bytes_received")),
+    call_time(metrics::get_histogram("obs." + name + ".call")),
+    presence(metrics::get_counter("obs." + name + ".presence")),
+    rtt(metrics::get_histogram("obs." + name + ".rtt")),
+    degradations(metrics::get_counter("obs." + name + ".degraded")),
+    stalls(metrics::get_counter("obs." + name + ".stalls"))
   {
-    // std::cout << "client::client\n";
-    lws_context_creation_info info;
-    memset(&info, '\0', sizeof info);
-    info.options = ssl_connection ? LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT : 0;
-    info.port = CONTEXT_PORT_NO_LISTEN; /* we do not run any server */
-    info.protocols = protocols;
-    info.fd_limit_per_thread = 1 + 1 + 1;
-    info.gid = -1;
-    info.uid = -1;
-    info.client_ssl_ca_filepath = ssl_ca_path;
+    watch_presence();
 
-    context = std::unique_ptr<lws_context, void(*)(lws_context*)>{ lws_create_context(&info), &lws_context_destroy };
-    if (context == nullptr)
-      throw std::runtime_error("cannot create lws context");
+    // The first connection attempt is scheduled by the service thread.
+    service::instance().attach(this);
+  }
 
-    // No log messages to stderr.
-    lws_set_log_level(0, nullptr);
 
-    // std::cout << "created context\n";
+  void client::start()
+  {
     /* schedule the first client connection attempt to happen immediately */
-    lws_sul_schedule(context.get(), 0, &wrap.sul, client::connect, 1);
+    lws_sul_schedule(service::instance().get(), 0, &wrap.sul, client::connect, 1);
+  }
+
 
-    // std::cout << "client::client scheduled\n";
-    thread = std::thread(&client::run, this);
-    // std::cout << "client::client started thread\n";
+  void client::stop()
+  {
+    lws_sul_cancel(&wrap.sul);
+    if (wsi != nullptr)
+      lws_set_timeout(wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_SYNC);
+    wsi = nullptr;
+    fail_outstanding();
+  }
+
+
+  void client::fail_outstanding()
+  {
+    // The waiting threads remove their requests themselves.
+    std::lock_guard guard(lock);
+    for (auto& r : outstanding)
+      if (! r.emit && ! r.fail && r.result.isNull()) {
+        r.fail = true;
+        r.l.count_down();
+      }
+    outstanding.remove_if([](const auto& r){ return r.emit; });
   }
 
 
@@ -289,36 +430,122 @@ namespace {
     status = ws_status::idle;
     atomic_notify_all(status);
     update_cb(false);
-    while (! outstanding.empty()) {
-      outstanding.front().fail = true;
-      outstanding.front().l.count_down();
-      outstanding.pop_front();
-    }
-
-    // Change to the table with a large initial timeout.
-    retry_count = 0;
-    retry.retry_ms_table = subsequent_backoff_ms;
-    retry.retry_ms_table_count = LWS_ARRAY_SIZE(subsequent_backoff_ms);
-    retry.conceal_count = LWS_ARRAY_SIZE(subsequent_backoff_ms);
-    if (lws_retry_sul_schedule(context.get(), 0, &wrap.sul, &retry, client::connect, &retry_count)) {
+    fail_outstanding();
+
+    // Change to the table with larger timeouts.  For a local OBS the start is noticed
+    // and the timeout is only a fallback.
+    if (presence_fd != -1)
+      set_retry(watched_backoff_ms);
+    else
+      set_retry(subsequent_backoff_ms);
+    if (lws_retry_sul_schedule(service::instance().get(), 0, &wrap.sul, &retry, client::connect, &retry_count)) {
       lwsl_err("%s: rescheduling after connection timeout failed", __func__);
     }
     // else std::cout << "reschedule in exhausted worked\n";
   }
 
 
+  void client::watch_presence()
+  {
+    if (strcmp(server, "localhost") != 0 && strcmp(server, "127.0.0.1") != 0 && strcmp(server, "::1") != 0)
+      return;
+
+    std::filesystem::path config;
+    if (auto xdg = getenv("XDG_CONFIG_HOME"); xdg != nullptr && *xdg != '\0')
+      config = xdg;
+    else if (auto home = getenv("HOME"); home != nullptr)
+      config = std::filesystem::path(home) / ".config";
+    else
+      return;
+    auto flatpak = config.parent_path() / ".var/app/com.obsproject.Studio/config";
+
+    presence_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (presence_fd == -1)
+      return;
+    bool any = false;
+    for (const auto& dir : { config, flatpak })
+      if (inotify_add_watch(presence_fd, (dir / "obs-studio/logs").c_str(), IN_CREATE) != -1)
+        any = true;
+    if (! any) {
+      close(presence_fd);
+      presence_fd = -1;
+    }
+  }
+
+
+  void client::check_presence()
+  {
+    if (presence_fd == -1)
+      return;
+
+    alignas(inotify_event) char buf[4096];
+    bool started = false;
+    while (read(presence_fd, buf, sizeof(buf)) > 0)
+      started = true;
+
+    if (started && status == ws_status::idle) {
+      ++presence;
+      set_retry(starting_backoff_ms);
+      lws_sul_schedule(service::instance().get(), 0, &wrap.sul, client::connect, 1);
+    }
+  }
+
+
+  void client::set_degraded(bool d)
+  {
+    if (degraded == d)
+      return;
+    degraded = d;
+    if (d)
+      ++degradations;
+    if (health_cb)
+      health_cb(d);
+  }
+
+
+  void client::check_health()
+  {
+    // Only send from this thread if it cannot block.
+    if (status != ws_status::writable)
+      return;
+
+    auto now = metrics::clock_type::now();
+    if (probe_sent) {
+      auto waiting = now - *probe_sent;
+      if (waiting >= stall_timeout) {
+        ++stalls;
+        probe_sent.reset();
+        lwsl_user("%s: no response, reconnecting\n", __func__);
+        lws_set_timeout(wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+      } else if (waiting >= degraded_rtt)
+        set_degraded(true);
+    } else if (now >= next_probe) {
+      // Another thread is writing, the probe is sent in the next round.
+      std::unique_lock guard(send_lock, std::try_to_lock);
+      if (! guard.owns_lock())
+        return;
+      probe_sent = now;
+      next_probe = now + probe_interval;
+      std::string s = std::string(LWS_SEND_BUFFER_PRE_PADDING, '\0') + "{\"request-type\":\"GetVersion\",\"message-id\":\"" + probe_id + "\"}";
+      auto len = s.size() - LWS_SEND_BUFFER_PRE_PADDING;
+      s.append(LWS_SEND_BUFFER_POST_PADDING, '\0');
+      lws_write(wsi, reinterpret_cast<unsigned char*>(s.data()) + LWS_SEND_BUFFER_PRE_PADDING, len, LWS_WRITE_TEXT);
+    }
+  }
+
+
   void client::connect()
   {
     lws_client_connect_info info;
 
     memset(&info, 0, sizeof(info));
-    info.context = context.get();
+    info.context = service::instance().get();
     info.port = port;
     info.address = server;
     info.path = "/";
-    info.host = lws_canonical_hostname(context.get());
+    info.host = lws_canonical_hostname(info.context);
     info.ssl_connection = ssl_connection;
-    info.protocol = protocols[0].name;
+    info.protocol = "obsws";
     // info.local_protocol_name = "obsws";   // Does not matter.
     info.pwsi = &wsi;
     info.retry_and_idle_policy = &retry;
@@ -329,7 +556,7 @@ namespace {
 
     if (! lws_client_connect_via_info(&info)) {
       lwsl_user("%s: retry connecting\n", __func__);
-      if (lws_retry_sul_schedule(context.get(), 0, &wrap.sul, &retry, client::connect, &retry_count)) {
+      if (lws_retry_sul_schedule(info.context, 0, &wrap.sul, &retry, client::connect, &retry_count)) {
         exhausted();
       }
     }
@@ -337,28 +564,11 @@ namespace {
   }
 
 
-  void client::run()
-  {
-    // std::cout << "thread loop reached\n";
-    while (status != ws_status::terminated) {
-      // std::cout << "run service\n";
-      if (lws_service(context.get(), 50) < 0) {
-        status = ws_status::idle;
-        break;
-      }
-      // std::cout << "service done\n";
-      auto s = status.load();
-      if (s == ws_status::connected) {
-        if (status.compare_exchange_strong(s, ws_status::running))
-          atomic_notify_all(status);
-      }
-    }
-    // std::cout << "run terminated\n";
-  }
-
-
   int client::callback(struct lws* wsi, enum lws_callback_reasons reason, void* in, size_t len)
   {
+    if (status == ws_status::terminated)
+      return lws_callback_http_dummy(wsi, reason, this, in, len);
+
     switch (reason) {
     case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
       lwsl_err("CLIENT_CONNECTION_ERROR: %s\n", in ? (char *)in : "(null)");
@@ -367,6 +577,7 @@ namespace {
 
     case LWS_CALLBACK_CLIENT_ESTABLISHED:
       // std::cout << "connected!\n";
+      ++connects;
       update_cb(true);
       status = ws_status::connected;
       atomic_notify_all(status);
@@ -375,6 +586,10 @@ namespace {
 
     case LWS_CALLBACK_CLIENT_CLOSED:
       lwsl_user("%s: closed\n", __func__);
+      ++disconnects;
+      probe_sent.reset();
+      set_degraded(false);
+      fail_outstanding();
       update_cb(false);
       status = ws_status::connecting;
       goto do_retry;
@@ -387,35 +602,45 @@ namespace {
     case LWS_CALLBACK_CLIENT_RECEIVE:
       if (log_events)
         lwsl_hexdump_notice(in, len);
+      bytes_received += len;
       {
         chunks.append(static_cast<char*>(in), len);
-        
-        Json::CharReaderBuilder builder;
-        const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
-        Json::Value root;
-        Json::String err;
-        if (reader->parse(chunks.data(), chunks.data() + chunks.size(), &root, &err)) {
-          if (root.isMember("message-id")) {
-            auto queued = std::find_if(outstanding.begin(), outstanding.end(), [s=root["message-id"].asString()](const auto& e){ return s == e.d["message-id"]; });
-            if (queued->emit)
-              outstanding.erase(queued);
-            else {
-              queued->result = std::move(root);
-              queued->l.count_down();
+
+        // Only the responses are parsed completely.  The events are handed to the
+        // callback as text, it extracts only the fields it needs.
+        json_view msg(chunks);
+        if (json_view::value_length(msg.text) != 0) {
+          if (auto id = msg["message-id"]; id == probe_id) {
+            if (probe_sent) {
+              auto t = metrics::clock_type::now() - *probe_sent;
+              rtt.add(t);
+              set_degraded(t >= degraded_rtt);
+              probe_sent.reset();
             }
-          } else if (event_cb && root.isMember("update-type"))
-            event_cb(root);
+          } else if (id.valid()) {
+            std::lock_guard guard(lock);
+            auto queued = std::find_if(outstanding.begin(), outstanding.end(), [s=id.as_string()](const auto& e){ return s == e.d["message-id"]; });
+            if (queued != outstanding.end()) {
+              if (queued->emit)
+                outstanding.erase(queued);
+              else {
+                Json::CharReaderBuilder builder;
+                const std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+                Json::Value root;
+                Json::String err;
+                if (reader->parse(chunks.data(), chunks.data() + chunks.size(), &root, &err))
+                  queued->result = std::move(root);
+                else
+                  queued->fail = true;
+                queued->l.count_down();
+              }
+            }
+          } else if (event_cb && msg["update-type"].valid()) {
+            ++events;
+            event_cb(msg.text);
+          }
 
           chunks.clear();
-        // } else {
-          // There is no error code.  For incomlete messages we see an error string containing
-          //    Missing '}' or object member name
-          // or
-          //    Missing ',' or '}' in object declaration
-          // if (err.find("Missing '}'") == std::string::npos && err.find("Missing ',' or '}'") == std::string::npos && err.find("Syntax error: value, object or array") == std::string::npos) {
-          //   chunks.clear();
-          //   lwsl_err("%s: invalid JSON: %s\n", __func__, err.c_str());
-          // }
         }
       }
       break;
@@ -435,6 +660,28 @@ namespace {
   }
 
 
+  bool client::send(const request_template& t, std::initializer_list<template_arg> args)
+  {
+    // The response is ignored, a sequence number suffices as message ID.
+    std::string buf(LWS_SEND_BUFFER_PRE_PADDING, '\0');
+    buf += "{\"message-id\":\"t";
+    buf += std::to_string(++template_seq);
+    buf += "\",";
+    t.append(buf, args);
+    auto len = buf.size() - LWS_SEND_BUFFER_PRE_PADDING;
+    buf.append(LWS_SEND_BUFFER_POST_PADDING, '\0');
+    ++requests;
+
+    if (log_transmits)
+      std::cout << "transmitted " << std::string_view(buf).substr(LWS_SEND_BUFFER_PRE_PADDING, len) << std::endl;
+
+    if (! ensure_mark_writable())
+      return false;
+    std::lock_guard guard(send_lock);
+    return lws_write(wsi, reinterpret_cast<unsigned char*>(buf.data()) + LWS_SEND_BUFFER_PRE_PADDING, len, LWS_WRITE_TEXT) >= 0;
+  }
+
+
   int client::send(const std::string& in)
   {
     if (! ensure_mark_writable())
@@ -442,44 +689,138 @@ namespace {
 
     std::string s = std::string(LWS_SEND_BUFFER_PRE_PADDING, '\0') + in + std::string(LWS_SEND_BUFFER_POST_PADDING, '\0');
 
+    std::lock_guard guard(send_lock);
     return lws_write(wsi, reinterpret_cast<unsigned char*>(s.data()) + LWS_SEND_BUFFER_PRE_PADDING, in.size(), LWS_WRITE_TEXT);
   }
 
 
+  std::pair<std::string,request&> client::send_request(const Json::Value& din, bool emit)
+  {
+    Json::Value d(din);
+    uuid_t uuid;
+    char uuid_str[37];
+    uuid_generate(uuid);
+    uuid_unparse(uuid, uuid_str);
+    d["message-id"] = uuid_str;
+    auto& req(send(std::move(d), emit));
+    ++requests;
+
+    if (log_transmits)
+      std::cout << "transmitted " << din << std::endl;
+
+    return { uuid_str, req };
+  }
+
+
   request& client::send(Json::Value&& root, bool emit)
   {
     Json::StreamWriterBuilder builder;
     builder["indentation"] = "";
 
-    auto& ref = outstanding.emplace_back(std::move(root), emit, 1);
+    // An emitted request can be removed by the service thread as soon as the lock is
+    // released, the text is created before.
+    request* ref;
+    std::string text;
+    {
+      std::lock_guard guard(lock);
+      ref = &outstanding.emplace_back(std::move(root), emit, 1);
+      text = Json::writeString(builder, ref->d);
+    }
 
-    if (send(Json::writeString(builder, ref.d)) < 0)
+    if (send(text) < 0)
       throw std::runtime_error("cannot send");
 
-    return ref;
+    return *ref;
   }
 
+} // namespace obsws
+
 
-  // Configuration.
-  obsws::event_cb_type event_cb = nullptr;
-  obsws::update_cb_type update_cb = nullptr;
-  std::string server("localhost");
-  int port = 4444;
-  std::string log("");
+namespace {
 
-  // Session.
-  std::unique_ptr<client> wsobj;
+  const lws_protocols service::protocols[2] = {
+    { "obsws", obsws::client::callback, 0, 0 },
+    { nullptr, nullptr, 0, 0}
+  };
 
 
-  bool setup()
+  service::service()
   {
-    if (! wsobj) {
-      // std::cout << "starting obsws thread\n";
-      wsobj = client::allocate(event_cb, update_cb, server.c_str(), port, log.c_str(), 0);
+    lws_context_creation_info info;
+    memset(&info, '\0', sizeof info);
+    info.options = 0;
+    info.port = CONTEXT_PORT_NO_LISTEN; /* we do not run any server */
+    info.protocols = protocols;
+    info.fd_limit_per_thread = 1 + 1 + max_connections;
+    info.gid = -1;
+    info.uid = -1;
+
+    context = std::unique_ptr<lws_context, void(*)(lws_context*)>{ lws_create_context(&info), &lws_context_destroy };
+    if (context == nullptr)
+      throw std::runtime_error("cannot create lws context");
 
-      // std::cout << "started obsws thread\n";
+    // No log messages to stderr.
+    lws_set_log_level(0, nullptr);
+
+    thread = std::thread(&service::run, this);
+  }
+
+
+  service::~service()
+  {
+    terminated = true;
+    lws_cancel_service(context.get());
+    thread.join();
+  }
+
+
+  void service::attach(obsws::client* c)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    attaching.emplace_back(c);
+    lws_cancel_service(context.get());
+  }
+
+
+  void service::detach(obsws::client* c)
+  {
+    std::latch l(1);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      detaching.emplace_back(c, &l);
+      lws_cancel_service(context.get());
+    }
+    l.wait();
+  }
+
+
+  void service::run()
+  {
+    while (! terminated) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto c : attaching) {
+          clients.emplace_back(c);
+          c->start();
+        }
+        attaching.clear();
+        for (auto [c, l] : detaching) {
+          c->stop();
+          clients.remove(c);
+          l->count_down();
+        }
+        detaching.clear();
+      }
+
+      if (lws_service(context.get(), 50) < 0)
+        break;
+
+      for (auto c : clients) {
+        c->serviced();
+        c->check_presence();
+        c->check_health();
+      }
     }
-    return bool(wsobj);
   }
 
 } // anonymous namespace
@@ -487,17 +828,95 @@ namespace {
 
 namespace obsws {
 
-  void config(obsws::event_cb_type event_cb_, obsws::update_cb_type update_cb_, const char* server_, int port_, const char* log_)
+  connection::connection(const std::string& name_, obsws::event_cb_type event_cb_, obsws::update_cb_type update_cb_, const char* server_, int port_, const char* log_, obsws::health_cb_type health_cb_)
+  : name(name_), event_cb(event_cb_), update_cb(update_cb_), health_cb(health_cb_), server(server_), port(port_), log(log_)
+  {
+  }
+
+
+  connection::~connection()
+  {
+  }
+
+
+  bool connection::setup()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (! wsobj) {
+      // std::cout << "starting obsws client\n";
+      wsobj = client::allocate(name, event_cb, update_cb, health_cb, server.c_str(), port, log.c_str(), 0);
+    }
+    return bool(wsobj);
+  }
+
+
+  request_template::request_template(std::string_view text)
   {
-    event_cb = event_cb_;
-    update_cb = update_cb_;
-    server = server_;
-    port = port_;
-    log = log_;
+    if (text.empty() || text.front() != '{')
+      throw std::invalid_argument("request template must be an object");
+    text.remove_prefix(1);
+
+    parts.emplace_back();
+    for (size_t i = 0; i < text.size(); ++i)
+      if (text[i] == '%' && i + 1 < text.size() && (text[i + 1] == 's' || text[i + 1] == 'd' || text[i + 1] == 'b')) {
+        kinds += text[++i];
+        parts.emplace_back();
+      } else
+        parts.back() += text[i];
   }
 
 
-  bool emit(const Json::Value& req)
+  void request_template::append(std::string& buf, std::initializer_list<template_arg> args) const
+  {
+    if (args.size() != kinds.size())
+      throw std::invalid_argument("wrong number of request template arguments");
+
+    buf += parts[0];
+    auto arg = args.begin();
+    for (size_t i = 0; i < kinds.size(); ++i, ++arg) {
+      switch (kinds[i]) {
+      case 's':
+        buf += '"';
+        for (auto c : arg->s)
+          if (c == '"' || c == '\\') {
+            buf += '\\';
+            buf += c;
+          } else if ((unsigned char) c < 0x20) {
+            static const char hex[] = "0123456789abcdef";
+            buf += "\\u00";
+            buf += hex[c >> 4];
+            buf += hex[c & 0xf];
+          } else
+            buf += c;
+        buf += '"';
+        break;
+      case 'd':
+        buf += std::to_string(arg->n);
+        break;
+      case 'b':
+        buf += arg->n != 0 ? "true" : "false";
+        break;
+      }
+      buf += parts[i + 1];
+    }
+  }
+
+
+  bool connection::emit(const request_template& req, std::initializer_list<template_arg> args)
+  {
+    if (! setup())
+      throw std::runtime_error("no connection");
+
+    try {
+      return wsobj->send(req, args);
+    }
+    catch (std::runtime_error&) {
+      return false;
+    }
+  }
+
+
+  bool connection::emit(const Json::Value& req)
   {
     if (! setup())
       throw std::runtime_error("no connection");
@@ -511,7 +930,7 @@ namespace obsws {
   }
 
 
-  Json::Value call(const Json::Value& req)
+  Json::Value connection::call(const Json::Value& req)
   {
     if (! setup())
       throw std::runtime_error("no connection");
@@ -524,4 +943,18 @@ namespace obsws {
     }
   }
 
+
+  std::vector<Json::Value> connection::call(const std::vector<Json::Value>& reqs)
+  {
+    if (! setup())
+      throw std::runtime_error("no connection");
+
+    try {
+      return wsobj->call_all(reqs);
+    }
+    catch (std::runtime_error&) {
+      return {};
+    }
+  }
+
 } // namespace obsws
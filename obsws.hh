@@ -2,23 +2,88 @@
 #define _OBSWS_HH 1
 
 #include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <json/json.h>
 
 
 namespace obsws {
 
-  using event_cb_type = std::function<void(const Json::Value&)>;
+  // Events are passed as text, see jsonview.hh.
+  using event_cb_type = std::function<void(std::string_view)>;
   using update_cb_type = std::function<void(bool)>;
+  // Called with true when the responses are slow, with false when they are fast again.
+  using health_cb_type = std::function<void(bool)>;
 
 
-  void config(event_cb_type event_cb = nullptr, update_cb_type update_cb = nullptr, const char* server = "localhost", int port = 4444, const char* log = "");
+  // Forward declaration.
+  struct client;
 
 
-  bool emit(const Json::Value& req);
+  // Argument of a request template.  Integers are also used for %b, nonzero is true.
+  struct template_arg {
+    template_arg(std::string_view s_) : s(s_) { }
+    template_arg(const std::string& s_) : s(s_) { }
+    template_arg(const char* s_) : s(s_) { }
+    template_arg(long long n_) : is_number(true), n(n_) { }
 
+    bool is_number = false;
+    std::string_view s;
+    long long n = 0;
+  };
 
-  Json::Value call(const Json::Value& req);
+
+  // A request with a fixed shape.  The text is split once at the placeholders %s (a
+  // string, it is quoted and escaped), %d (an integer), and %b (a boolean).  Sending
+  // only copies the parts and the arguments into the send buffer, e.g.
+  //
+  //   {"request-type":"SetCurrentScene","scene-name":%s}
+  struct request_template {
+    explicit request_template(std::string_view text);
+
+    // Append the request with the arguments, without the opening brace.
+    void append(std::string& buf, std::initializer_list<template_arg> args) const;
+
+  private:
+    std::vector<std::string> parts;
+    std::string kinds;
+  };
+
+
+  // One connection to an OBS instance.  All connections share the same event loop and
+  // service thread.  The connection is established with the first request.
+  struct connection {
+    connection(const std::string& name_, event_cb_type event_cb_ = nullptr, update_cb_type update_cb_ = nullptr, const char* server_ = "localhost", int port_ = 4444, const char* log_ = "", health_cb_type health_cb_ = nullptr);
+    ~connection();
+
+    bool emit(const Json::Value& req);
+    // No response is expected, the request is not kept.
+    bool emit(const request_template& req, std::initializer_list<template_arg> args = {});
+
+    Json::Value call(const Json::Value& req);
+    // Independent requests are sent together, the responses are in the same order.
+    std::vector<Json::Value> call(const std::vector<Json::Value>& reqs);
+
+    const std::string name;
+
+  private:
+    bool setup();
+
+    event_cb_type event_cb;
+    update_cb_type update_cb;
+    health_cb_type health_cb;
+    std::string server;
+    int port;
+    std::string log;
+
+    std::mutex lock;
+    std::unique_ptr<client> wsobj;
+  };
 
 } // namespace obsws
 
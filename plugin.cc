@@ -0,0 +1,102 @@
+#include "plugin.hh"
+
+#include <iostream>
+
+#include <dlfcn.h>
+
+using namespace std::string_literals;
+
+
+plugin::plugin(void* handle_, const streamdeckd_plugin* desc_)
+: type_name(desc_->type_name), handle(handle_), desc(desc_),
+  create_time(metrics::get_histogram("plugin."s + type_name + ".create")),
+  press_time(metrics::get_histogram("plugin."s + type_name + ".press")),
+  release_time(metrics::get_histogram("plugin."s + type_name + ".release")),
+  visibility_time(metrics::get_histogram("plugin."s + type_name + ".visibility"))
+{
+}
+
+
+plugin::~plugin()
+{
+  dlclose(handle);
+}
+
+
+void* plugin::create(const streamdeckd_host* host, streamdeckd_key* key, const streamdeckd_setting* setting)
+{
+  metrics::timer t(create_time);
+  return desc->create(host, key, setting);
+}
+
+
+void plugin::destroy(void* instance)
+{
+  if (desc->destroy != nullptr)
+    desc->destroy(instance);
+}
+
+
+void plugin::press(void* instance)
+{
+  if (desc->press != nullptr) {
+    metrics::timer t(press_time);
+    desc->press(instance);
+  }
+}
+
+
+void plugin::release(void* instance)
+{
+  if (desc->release != nullptr) {
+    metrics::timer t(release_time);
+    desc->release(instance);
+  }
+}
+
+
+void plugin::visibility(void* instance, bool visible)
+{
+  if (desc->visibility != nullptr) {
+    metrics::timer t(visibility_time);
+    desc->visibility(instance, visible);
+  }
+}
+
+
+void plugin_registry::load_directory(const std::filesystem::path& dir)
+{
+  std::error_code ec;
+  for (const auto& e : std::filesystem::directory_iterator(dir, ec)) {
+    if (! e.is_regular_file() || e.path().extension() != ".so")
+      continue;
+
+    auto handle = dlopen(e.path().c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr) {
+      std::cout << "cannot load plugin " << e.path() << ": " << dlerror() << std::endl;
+      continue;
+    }
+
+    auto init = reinterpret_cast<streamdeckd_plugin_init_fn>(dlsym(handle, STREAMDECKD_PLUGIN_INIT_NAME));
+    const streamdeckd_plugin* desc = init != nullptr ? init(STREAMDECKD_PLUGIN_ABI_VERSION) : nullptr;
+    if (desc == nullptr || desc->abi_version != STREAMDECKD_PLUGIN_ABI_VERSION || desc->type_name == nullptr || desc->create == nullptr) {
+      std::cout << "plugin " << e.path() << " not usable\n";
+      dlclose(handle);
+      continue;
+    }
+    if (plugins.contains(desc->type_name)) {
+      std::cout << "plugin " << e.path() << " duplicates type " << desc->type_name << std::endl;
+      dlclose(handle);
+      continue;
+    }
+
+    plugins.emplace(std::piecewise_construct, std::forward_as_tuple(desc->type_name), std::forward_as_tuple(handle, desc));
+  }
+}
+
+
+plugin* plugin_registry::find(const std::string& type_name)
+{
+  auto it = plugins.find(type_name);
+  return it == plugins.end() ? nullptr : &it->second;
+}
@@ -0,0 +1,49 @@
+#ifndef _PLUGIN_HH
+#define _PLUGIN_HH 1
+
+#include <filesystem>
+#include <map>
+#include <string>
+
+#include "streamdeckd-plugin.h"
+#include "metrics.hh"
+
+
+struct plugin {
+  plugin(void* handle_, const streamdeckd_plugin* desc_);
+  ~plugin();
+
+  plugin(const plugin&) = delete;
+  plugin& operator=(const plugin&) = delete;
+
+  void* create(const streamdeckd_host* host, streamdeckd_key* key, const streamdeckd_setting* setting);
+  void destroy(void* instance);
+  void press(void* instance);
+  void release(void* instance);
+  void visibility(void* instance, bool visible);
+
+  const std::string type_name;
+
+private:
+  void* handle;
+  const streamdeckd_plugin* desc;
+
+  // Time spent in the plugin code, for each of the entry points.
+  metrics::histogram& create_time;
+  metrics::histogram& press_time;
+  metrics::histogram& release_time;
+  metrics::histogram& visibility_time;
+};
+
+
+struct plugin_registry {
+  // Load all shared objects in the directory.  Errors are reported but not fatal.
+  void load_directory(const std::filesystem::path& dir);
+
+  plugin* find(const std::string& type_name);
+
+private:
+  std::map<std::string,plugin> plugins;
+};
+
+#endif // plugin.hh
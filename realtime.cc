@@ -0,0 +1,80 @@
+#include "realtime.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <optional>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "metrics.hh"
+
+
+namespace realtime {
+
+  namespace {
+
+    std::optional<settings> current;
+
+  } // anonymous namespace
+
+
+  void enable(const settings& s)
+  {
+    current = s;
+  }
+
+
+  void enter(const char* what)
+  {
+    static auto& rt_threads = metrics::get_counter("realtime.threads");
+    static auto& nice_threads = metrics::get_counter("realtime.nice");
+
+    if (! current)
+      return;
+
+    if (! current->cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (auto c : current->cpus)
+        if (c < CPU_SETSIZE)
+          CPU_SET(c, &set);
+      if (int e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); e != 0)
+        std::cout << "cannot restrict " << what << " thread to the CPUs: " << strerror(e) << std::endl;
+    }
+
+    sched_param param;
+    param.sched_priority = std::clamp(current->priority, sched_get_priority_min(current->policy), sched_get_priority_max(current->policy));
+    if (pthread_setschedparam(pthread_self(), current->policy, &param) == 0) {
+      ++rt_threads;
+      return;
+    }
+
+    // Not allowed, most likely no CAP_SYS_NICE and no RLIMIT_RTPRIO.  On Linux the nice
+    // value is a property of the thread.
+    if (setpriority(PRIO_PROCESS, gettid(), current->nice) == 0)
+      ++nice_threads;
+    else
+      std::cout << "cannot raise the priority of the " << what << " thread: " << strerror(errno) << std::endl;
+  }
+
+
+  void lock_memory()
+  {
+    if (! current || ! current->lock_memory)
+      return;
+
+    // Libraries and plugins can still start threads later.  With MCL_ONFAULT their
+    // stacks and other new mappings are only locked as they are used instead of being
+    // populated in full.  Older kernels do not know the flag, then only the current
+    // mappings are locked.
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0
+        && (errno != EINVAL || mlockall(MCL_CURRENT) != 0))
+      std::cout << "cannot lock memory: " << strerror(errno) << std::endl;
+  }
+
+} // namespace realtime
@@ -0,0 +1,37 @@
+#ifndef _REALTIME_HH
+#define _REALTIME_HH 1
+
+#include <vector>
+
+#include <sched.h>
+
+
+// Optional low-latency mode for the threads reading the keys, dispatching the key
+// presses, and writing the key images.  They are run with a real-time scheduling
+// policy so that a machine busy encoding video does not delay them.  Without the
+// necessary privileges they get a lower nice value instead.
+namespace realtime {
+
+  struct settings {
+    int policy = SCHED_FIFO;
+    int priority = 10;
+    // Used if the real-time policy is not allowed.
+    int nice = -10;
+    bool lock_memory = true;
+    // The CPUs the threads are restricted to, all if empty.
+    std::vector<unsigned> cpus;
+  };
+
+  // Must be called before the threads are started.
+  void enable(const settings& s);
+
+  // Called at the start of each of the latency-critical threads.  Does nothing unless
+  // the mode is enabled.
+  void enter(const char* what);
+
+  // Lock all memory once the startup is done so that no page faults happen later.
+  void lock_memory();
+
+} // namespace realtime
+
+#endif // realtime.hh
@@ -0,0 +1,766 @@
+#include "remote.hh"
+
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include <endian.h>
+#include <error.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "imagescale.hh"
+#include "metrics.hh"
+
+using namespace std::string_literals;
+
+
+namespace remote {
+
+  namespace {
+
+    constexpr uint32_t protocol_version = 2;
+
+    // Number of images in the cache, on both sides.
+    constexpr size_t cache_size = 512;
+
+    // Upper limit for the size of a message, everything else is treated as an error.
+    constexpr uint32_t max_message = 16 * 1024 * 1024;
+    // Before the peer is authenticated.
+    constexpr uint32_t max_handshake_message = 256;
+
+    // Time the peer has to complete the handshake.
+    constexpr timeval handshake_timeout{ 5, 0 };
+
+    // The secret must have at least this many bytes.
+    constexpr size_t min_secret = 16;
+
+
+    // Each message consists of a 32-bit length (little endian) of the rest of the
+    // message, the type byte, and the type-specific data.  Nothing but hello and the
+    // two authentication messages is sent before both sides proved to know the secret.
+    enum struct msg_type : uint8_t {
+      hello = 1,        // agent → daemon: version, key count, columns, key width, key height,
+                        //                 image format, rotation, horizontal flip, vertical flip, nonce
+      keys,             // agent → daemon: timestamp, one byte per key
+      ack,              // daemon → agent: timestamp of the handled key states
+      register_image,   // daemon → agent: handle, image payload
+      set_handle,       // daemon → agent: key, handle
+      image,            // daemon → agent: key, hash, image payload
+      image_ref,        // daemon → agent: key, hash
+      brightness,       // daemon → agent: percent
+      auth,             // daemon → agent: nonce, MAC
+      auth_ok,          // agent → daemon: MAC
+    };
+
+
+    // The image payloads are in the form the device takes them, the agent does not
+    // decode anything: the JPEG data for devices using JPEG, otherwise the RGB pixels
+    // at the key size.
+    enum struct image_format : uint32_t {
+      rgb = 0,
+      jpeg = 1,
+    };
+
+
+    using hash_type = std::array<unsigned char,32>;
+
+    struct hash_hash {
+      size_t operator()(const hash_type& h) const { size_t r; memcpy(&r, h.data(), sizeof(r)); return r; }
+    };
+
+    hash_type compute_hash(const std::string& payload)
+    {
+      hash_type res;
+      EVP_Digest(payload.data(), payload.size(), res.data(), nullptr, EVP_sha256(), nullptr);
+      return res;
+    }
+
+
+    hash_type make_nonce()
+    {
+      hash_type res;
+      if (RAND_bytes(res.data(), res.size()) != 1)
+        throw std::runtime_error("cannot generate nonce");
+      return res;
+    }
+
+
+    // The label keeps a MAC of one side from being usable as that of the other.
+    hash_type compute_mac(const std::string& secret, std::string_view label, const hash_type& agent_nonce, const hash_type& daemon_nonce)
+    {
+      std::string data(label);
+      data.append(reinterpret_cast<const char*>(agent_nonce.data()), agent_nonce.size());
+      data.append(reinterpret_cast<const char*>(daemon_nonce.data()), daemon_nonce.size());
+      hash_type res;
+      unsigned len = res.size();
+      HMAC(EVP_sha256(), secret.data(), secret.size(), reinterpret_cast<const unsigned char*>(data.data()), data.size(), res.data(), &len);
+      return res;
+    }
+
+
+    bool same_mac(const hash_type& a, const hash_type& b)
+    {
+      return CRYPTO_memcmp(a.data(), b.data(), a.size()) == 0;
+    }
+
+
+    // Least-recently-used cache.  The daemon and the agent perform the same sequence of
+    // lookups and insertions which guarantees that the content is the same.
+    template<typename T>
+    struct lru_cache {
+      T* find(const hash_type& h) {
+        auto it = index.find(h);
+        if (it == index.end())
+          return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+      }
+
+      void insert(const hash_type& h, T&& v) {
+        if (entries.size() == cache_size) {
+          index.erase(entries.back().first);
+          entries.pop_back();
+        }
+        entries.emplace_front(h, std::move(v));
+        index[h] = entries.begin();
+      }
+
+    private:
+      using list_type = std::list<std::pair<hash_type,T>>;
+      list_type entries;
+      std::unordered_map<hash_type,typename list_type::iterator,hash_hash> index;
+    };
+
+
+    struct message {
+      explicit message(msg_type t) : buf(4, '\0') { buf.push_back(char(t)); }
+
+      message& u32(uint32_t v) { v = htole32(v); buf.append(reinterpret_cast<const char*>(&v), sizeof(v)); return *this; }
+      message& u64(uint64_t v) { v = htole64(v); buf.append(reinterpret_cast<const char*>(&v), sizeof(v)); return *this; }
+      message& hash(const hash_type& h) { buf.append(reinterpret_cast<const char*>(h.data()), h.size()); return *this; }
+      message& bytes(std::string_view s) { buf.append(s); return *this; }
+      message& byte(uint8_t b) { buf.push_back(char(b)); return *this; }
+
+      const std::string& finish() {
+        uint32_t len = htole32(buf.size() - 4);
+        memcpy(buf.data(), &len, sizeof(len));
+        return buf;
+      }
+
+    private:
+      std::string buf;
+    };
+
+
+    struct reader {
+      explicit reader(std::string_view s_) : s(s_) { }
+
+      uint32_t u32() { uint32_t v = 0; get(&v, sizeof(v)); return le32toh(v); }
+      uint64_t u64() { uint64_t v = 0; get(&v, sizeof(v)); return le64toh(v); }
+      hash_type hash() { hash_type h{}; get(h.data(), h.size()); return h; }
+      std::string_view rest() { auto r = s; s = {}; return r; }
+
+    private:
+      void get(void* p, size_t n) {
+        if (s.size() < n)
+          throw std::runtime_error("truncated message");
+        memcpy(p, s.data(), n);
+        s.remove_prefix(n);
+      }
+
+      std::string_view s;
+    };
+
+
+    bool write_all(int fd, const std::string& s)
+    {
+      const char* p = s.data();
+      size_t n = s.size();
+      while (n > 0) {
+        auto r = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0) {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+        p += r;
+        n -= r;
+      }
+      return true;
+    }
+
+
+    bool read_all(int fd, char* p, size_t n)
+    {
+      while (n > 0) {
+        auto r = ::recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r <= 0)
+          return false;
+        p += r;
+        n -= r;
+      }
+      return true;
+    }
+
+
+    bool receive(int fd, msg_type& type, std::string& body, uint32_t limit = max_message)
+    {
+      uint32_t len;
+      if (! read_all(fd, reinterpret_cast<char*>(&len), sizeof(len)))
+        return false;
+      len = le32toh(len);
+      if (len == 0 || len > limit)
+        return false;
+      body.resize(len);
+      if (! read_all(fd, body.data(), len))
+        return false;
+      type = msg_type(body[0]);
+      body.erase(0, 1);
+      return true;
+    }
+
+
+    void set_nodelay(int fd)
+    {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+
+    uint64_t now_ns()
+    {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+
+    void set_timeout(int fd, const timeval& tv)
+    {
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+
+    // The daemon side of a connection to an agent.
+    struct agent_device final : key_device {
+      agent_device(int fd_, unsigned key_count_, unsigned key_cols_, unsigned key_pixel_width_, unsigned key_pixel_height_, std::optional<jpeg_encoder>&& encoder_)
+      : key_device(key_count_, key_cols_, key_pixel_width_, key_pixel_height_), fd(fd_), encoder(std::move(encoder_)),
+        bytes_sent(metrics::get_counter("remote.bytes_sent")),
+        bytes_saved(metrics::get_counter("remote.bytes_saved")),
+        images(metrics::get_counter("remote.images")),
+        image_refs(metrics::get_counter("remote.image_refs")),
+        encode_time(metrics::get_histogram("remote.encode"))
+      {
+      }
+      ~agent_device() { close(fd); }
+
+      std::vector<unsigned char> read() override;
+      void input_handled() override;
+
+      int register_image(Magick::Image&& image) override;
+      void set_key_image(unsigned key, int handle) override;
+      size_t set_key_image(unsigned key, Magick::Image&& image, bool reduced) override;
+      void set_brightness(unsigned percent) override;
+
+    private:
+      size_t send(message& m);
+      std::string encode(const Magick::Image& image, bool reduced);
+
+      const int fd;
+      // Only for devices using JPEG images.
+      std::optional<jpeg_encoder> encoder;
+
+      // Protects the writes and the caches.
+      std::mutex lock;
+      lru_cache<bool> cache;
+      std::unordered_map<hash_type,int,hash_hash> registered;
+
+      // Timestamps of the key events which have been read but not yet handled.
+      std::mutex stamps_lock;
+      std::deque<uint64_t> stamps;
+
+      metrics::counter& bytes_sent;
+      metrics::counter& bytes_saved;
+      metrics::counter& images;
+      metrics::counter& image_refs;
+      metrics::histogram& encode_time;
+    };
+
+
+    size_t agent_device::send(message& m)
+    {
+      auto& s = m.finish();
+      if (! write_all(fd, s))
+        error(EXIT_FAILURE, errno, "connection to agent lost");
+      bytes_sent += s.size();
+      return s.size();
+    }
+
+
+    std::vector<unsigned char> agent_device::read()
+    {
+      msg_type type;
+      std::string body;
+      while (receive(fd, type, body))
+        if (type == msg_type::keys) {
+          reader r(body);
+          auto stamp = r.u64();
+          {
+            std::lock_guard<std::mutex> guard(stamps_lock);
+            stamps.push_back(stamp);
+          }
+          auto states = r.rest();
+          return std::vector<unsigned char>(states.begin(), states.end());
+        }
+
+      error(EXIT_FAILURE, 0, "connection to agent lost");
+      __builtin_unreachable();
+    }
+
+
+    void agent_device::input_handled()
+    {
+      uint64_t stamp;
+      {
+        std::lock_guard<std::mutex> guard(stamps_lock);
+        if (stamps.empty())
+          return;
+        stamp = stamps.front();
+        stamps.pop_front();
+      }
+
+      message m(msg_type::ack);
+      m.u64(stamp);
+      std::lock_guard<std::mutex> guard(lock);
+      send(m);
+    }
+
+
+    std::string agent_device::encode(const Magick::Image& image, bool reduced)
+    {
+      metrics::timer t(encode_time);
+
+      if (encoder) {
+        auto data = encoder->encode(image, reduced);
+        return std::string(data.begin(), data.end());
+      }
+
+      auto scaled = scale_image(image, key_pixel_width, key_pixel_height);
+      std::string res(3 * key_pixel_width * key_pixel_height, '\0');
+      scaled.write(0, 0, key_pixel_width, key_pixel_height, "RGB", Magick::CharPixel, res.data());
+      return res;
+    }
+
+
+    int agent_device::register_image(Magick::Image&& image)
+    {
+      auto payload = encode(image, false);
+      auto h = compute_hash(payload);
+
+      std::lock_guard<std::mutex> guard(lock);
+      if (auto it = registered.find(h); it != registered.end()) {
+        bytes_saved += payload.size();
+        return it->second;
+      }
+
+      int handle = registered.size();
+      registered.emplace(h, handle);
+      message m(msg_type::register_image);
+      m.u32(handle).bytes(payload);
+      send(m);
+      return handle;
+    }
+
+
+    void agent_device::set_key_image(unsigned key, int handle)
+    {
+      message m(msg_type::set_handle);
+      m.u32(key).u32(handle);
+      std::lock_guard<std::mutex> guard(lock);
+      send(m);
+    }
+
+
+    size_t agent_device::set_key_image(unsigned key, Magick::Image&& image, bool reduced)
+    {
+      auto payload = encode(image, reduced);
+      auto h = compute_hash(payload);
+
+      std::lock_guard<std::mutex> guard(lock);
+      if (cache.find(h) != nullptr) {
+        message m(msg_type::image_ref);
+        m.u32(key).hash(h);
+        ++image_refs;
+        bytes_saved += payload.size();
+        return send(m);
+      }
+
+      cache.insert(h, true);
+      message m(msg_type::image);
+      m.u32(key).hash(h).bytes(payload);
+      ++images;
+      return send(m);
+    }
+
+
+    void agent_device::set_brightness(unsigned percent)
+    {
+      message m(msg_type::brightness);
+      m.u32(percent);
+      std::lock_guard<std::mutex> guard(lock);
+      send(m);
+    }
+
+
+    // Handle the requests of one daemon connection.  Returns when the connection is closed.
+    void serve(int fd, streamdeck::device_type& dev)
+    {
+      auto& bytes_received = metrics::get_counter("agent.bytes_received");
+      auto& press_rtt = metrics::get_histogram("agent.press_rtt");
+      auto& write_time = metrics::get_histogram("agent.write");
+
+      lru_cache<std::string> cache;
+      std::unordered_map<uint32_t,std::string> handles;
+
+      bool jpeg = std::string_view(dev.key_image_format) == "JPEG";
+      auto show = [&dev, jpeg](unsigned key, const std::string& payload) {
+        if (key >= dev.key_count)
+          return;
+        if (jpeg)
+          dev.set_key_image(key, reinterpret_cast<const unsigned char*>(payload.data()), payload.size());
+        else if (payload.size() == 3 * dev.key_pixel_width * dev.key_pixel_height)
+          dev.set_key_image(key / dev.key_cols, key % dev.key_cols, Magick::Image(dev.key_pixel_width, dev.key_pixel_height, "RGB", Magick::CharPixel, payload.data()));
+      };
+
+      msg_type type;
+      std::string body;
+      while (receive(fd, type, body)) {
+        bytes_received += 5 + body.size();
+        metrics::timer t(write_time);
+
+        try {
+          reader r(body);
+          switch (type) {
+          case msg_type::ack:
+            press_rtt.add(std::chrono::nanoseconds(now_ns() - r.u64()));
+            break;
+          case msg_type::register_image:
+            {
+              auto handle = r.u32();
+              handles[handle] = std::string(r.rest());
+            }
+            break;
+          case msg_type::set_handle:
+            {
+              auto key = r.u32();
+              auto handle = r.u32();
+              if (auto it = handles.find(handle); it != handles.end())
+                show(key, it->second);
+            }
+            break;
+          case msg_type::image:
+            {
+              auto key = r.u32();
+              auto h = r.hash();
+              std::string payload(r.rest());
+              show(key, payload);
+              cache.insert(h, std::move(payload));
+            }
+            break;
+          case msg_type::image_ref:
+            {
+              auto key = r.u32();
+              if (auto p = cache.find(r.hash()); p != nullptr)
+                show(key, *p);
+            }
+            break;
+          case msg_type::brightness:
+            dev.set_brightness(r.u32());
+            break;
+          default:
+            break;
+          }
+        }
+        catch (std::runtime_error&) {
+          // Truncated message.  Ignore.
+        }
+      }
+    }
+
+
+    // The address is either just the port, then only connections from the same machine
+    // are accepted, or HOST:PORT.  The host * stands for all addresses.
+    int listen_on(const std::string& address)
+    {
+      std::string host = "localhost";
+      std::string port = address;
+      if (auto colon = address.rfind(':'); colon != std::string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+          host = host.substr(1, host.size() - 2);
+      }
+      bool all = host == "*";
+
+      addrinfo hints;
+      memset(&hints, '\0', sizeof(hints));
+      hints.ai_family = all ? AF_INET6 : AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      addrinfo* res;
+      if (getaddrinfo(all ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0)
+        error(EXIT_FAILURE, 0, "invalid address %s", address.c_str());
+
+      int fd = -1;
+      for (auto ai = res; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+          continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (all) {
+          // Accept IPv4 connections as well.
+          int zero = 0;
+          setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+        }
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 1) == 0)
+          break;
+        close(fd);
+        fd = -1;
+      }
+      freeaddrinfo(res);
+      if (fd == -1)
+        error(EXIT_FAILURE, errno, "cannot listen on %s", address.c_str());
+
+      return fd;
+    }
+
+
+    // Agent side of the handshake.  True if the daemon knows the secret.
+    bool authenticate_daemon(int fd, streamdeck::device_type& dev, const std::string& secret)
+    {
+      auto agent_nonce = make_nonce();
+      message hello(msg_type::hello);
+      hello.u32(protocol_version).u32(dev.key_count).u32(dev.key_cols).u32(dev.key_pixel_width).u32(dev.key_pixel_height);
+      hello.u32(uint32_t(std::string_view(dev.key_image_format) == "JPEG" ? image_format::jpeg : image_format::rgb));
+      hello.u32(dev.key_rotation).u32(dev.key_hor_flip).u32(dev.key_ver_flip).hash(agent_nonce);
+      if (! write_all(fd, hello.finish()))
+        return false;
+
+      set_timeout(fd, handshake_timeout);
+      msg_type type;
+      std::string body;
+      if (! receive(fd, type, body, max_handshake_message) || type != msg_type::auth)
+        return false;
+      set_timeout(fd, timeval{ 0, 0 });
+
+      try {
+        reader r(body);
+        auto daemon_nonce = r.hash();
+        if (! same_mac(r.hash(), compute_mac(secret, "daemon", agent_nonce, daemon_nonce)))
+          return false;
+
+        message ok(msg_type::auth_ok);
+        ok.hash(compute_mac(secret, "agent", agent_nonce, daemon_nonce));
+        return write_all(fd, ok.finish());
+      }
+      catch (std::runtime_error&) {
+        return false;
+      }
+    }
+
+  } // anonymous namespace
+
+
+  std::string read_secret(const std::filesystem::path& fname)
+  {
+    std::error_code ec;
+    auto st = std::filesystem::status(fname, ec);
+    if (ec || ! std::filesystem::is_regular_file(st))
+      throw std::runtime_error("cannot read secret file "s + fname.string());
+    using std::filesystem::perms;
+    if ((st.permissions() & (perms::group_all | perms::others_all)) != perms::none)
+      throw std::runtime_error("secret file "s + fname.string() + " must only be accessible by its owner");
+
+    std::ifstream in(fname);
+    std::string res(std::istreambuf_iterator<char>(in), {});
+    while (! res.empty() && isspace(res.back()))
+      res.pop_back();
+    if (res.size() < min_secret)
+      throw std::runtime_error("secret in "s + fname.string() + " is shorter than " + std::to_string(min_secret) + " bytes");
+    return res;
+  }
+
+
+  std::unique_ptr<key_device> connect(const std::string& address, const std::string& secret, const jpeg_settings& jpeg)
+  {
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos)
+      throw std::runtime_error("agent address must have the form host:port");
+    auto host = address.substr(0, colon);
+    auto port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+      host = host.substr(1, host.size() - 2);
+
+    addrinfo hints;
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* res;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+      throw std::runtime_error("cannot resolve agent address "s + address);
+
+    int fd = -1;
+    for (auto ai = res; ai != nullptr; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+      if (fd == -1)
+        continue;
+      if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+      throw std::runtime_error("cannot connect to agent "s + address);
+    set_nodelay(fd);
+
+    auto fail = [fd, &address](const char* what) {
+      close(fd);
+      throw std::runtime_error("agent "s + address + ": " + what);
+    };
+
+    set_timeout(fd, handshake_timeout);
+    msg_type type;
+    std::string body;
+    if (! receive(fd, type, body, max_handshake_message) || type != msg_type::hello)
+      fail("no handshake");
+
+    unsigned key_count = 0;
+    unsigned key_cols = 0;
+    unsigned key_pixel_width = 0;
+    unsigned key_pixel_height = 0;
+    std::optional<jpeg_encoder> encoder;
+    try {
+      reader r(body);
+      if (r.u32() != protocol_version)
+        fail("uses a different protocol version");
+      key_count = r.u32();
+      key_cols = r.u32();
+      key_pixel_width = r.u32();
+      key_pixel_height = r.u32();
+      auto format = image_format(r.u32());
+      auto rotation = r.u32();
+      bool hor_flip = r.u32() != 0;
+      bool ver_flip = r.u32() != 0;
+      auto agent_nonce = r.hash();
+      if (key_count == 0 || key_count > 256 || key_cols == 0 || key_pixel_width == 0 || key_pixel_width > 1024 || key_pixel_height == 0 || key_pixel_height > 1024)
+        fail("reports an invalid device");
+      if (format == image_format::jpeg)
+        encoder.emplace(key_pixel_width, key_pixel_height, rotation, hor_flip, ver_flip, jpeg);
+
+      auto daemon_nonce = make_nonce();
+      message m(msg_type::auth);
+      m.hash(daemon_nonce).hash(compute_mac(secret, "daemon", agent_nonce, daemon_nonce));
+      if (! write_all(fd, m.finish()))
+        fail("connection lost during handshake");
+
+      if (! receive(fd, type, body, max_handshake_message) || type != msg_type::auth_ok)
+        fail("rejected the secret");
+      reader ok(body);
+      if (! same_mac(ok.hash(), compute_mac(secret, "agent", agent_nonce, daemon_nonce)))
+        fail("does not know the secret");
+    }
+    catch (const std::runtime_error& e) {
+      if (std::string_view(e.what()).starts_with("agent "))
+        throw;
+      fail("invalid handshake");
+    }
+    set_timeout(fd, timeval{ 0, 0 });
+
+    return std::make_unique<agent_device>(fd, key_count, key_cols, key_pixel_width, key_pixel_height, std::move(encoder));
+  }
+
+
+  void run_agent(const std::string& address, const std::string& serial, const std::string& secret)
+  {
+    streamdeck::context ctx;
+    streamdeck::device_type* dev = nullptr;
+    for (auto& d : ctx)
+      if (d->connected() && (serial.empty() || d->get_serial_number() == serial)) {
+        dev = d.get();
+        break;
+      }
+    if (dev == nullptr)
+      error(EXIT_FAILURE, 0, "no device available");
+    dev->reset();
+
+    auto lfd = listen_on(address);
+
+    // The current connection to the daemon, if any.
+    std::mutex lock;
+    int cfd = -1;
+
+    // The key states are read all the time but only sent if a daemon is connected.
+    std::thread input([dev, &lock, &cfd]{
+      while (true) {
+        auto ss = dev->read();
+        message m(msg_type::keys);
+        m.u64(now_ns());
+        for (auto s : ss)
+          m.byte(s != 0);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (cfd != -1)
+          write_all(cfd, m.finish());
+      }
+    });
+
+    while (true) {
+      int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd == -1)
+        continue;
+      set_nodelay(fd);
+
+      // Only an authenticated daemon gets the key states.
+      if (authenticate_daemon(fd, *dev, secret)) {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          cfd = fd;
+        }
+        serve(fd, *dev);
+      } else
+        std::cout << "agent: rejected connection without the correct secret" << std::endl;
+
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        cfd = -1;
+      }
+      close(fd);
+    }
+  }
+
+} // namespace remote
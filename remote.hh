@@ -0,0 +1,33 @@
+#ifndef _REMOTE_HH
+#define _REMOTE_HH 1
+
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include "keywriter.hh"
+
+
+// Split mode.  The agent runs on the machine the device is attached to and does
+// nothing but the device I/O.  The daemon connects to the agent over TCP.  Both sides
+// prove with a MAC over two nonces that they know a shared secret before anything
+// else is sent.  Images are sent in the form the device takes them and identified by
+// their SHA-256 hash.  Both sides keep a cache of the most recently used images which
+// is updated in the same order on both sides.  An image which is in the cache is
+// therefore sent as a reference to the hash.
+namespace remote {
+
+  // Read the shared secret.  The file must not be accessible by other users.
+  std::string read_secret(const std::filesystem::path& fname);
+
+  // Connect to the agent at "host:port".  JPEG images are compressed with the settings.
+  std::unique_ptr<key_device> connect(const std::string& address, const std::string& secret, const jpeg_settings& jpeg);
+
+  // Run the agent for the device with the given serial number (or any if the string
+  // is empty), listening on the given port (only local connections) or HOST:PORT.
+  // Does not return.
+  [[noreturn]] void run_agent(const std::string& address, const std::string& serial, const std::string& secret);
+
+} // namespace remote
+
+#endif // remote.hh
@@ -0,0 +1,310 @@
+#include "rules.hh"
+
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+#include "metrics.hh"
+
+using namespace std::string_literals;
+
+
+namespace rules {
+
+  namespace {
+
+    enum struct field_type {
+      flag,
+      string
+    };
+
+    struct field_desc {
+      const char* name;
+      field f;
+      field_type type;
+    };
+
+    const field_desc fields[] = {
+      { "connected", field::connected, field_type::flag },
+      { "studio_mode", field::studio_mode, field_type::flag },
+      { "recording", field::recording, field_type::flag },
+      { "streaming", field::streaming, field_type::flag },
+      { "ftb", field::ftb, field_type::flag },
+      { "scene", field::scene, field_type::string },
+      { "preview", field::preview, field_type::string },
+      { "transition", field::transition, field_type::string },
+    };
+
+    field_mask bit(field f) { return field_mask(1) << unsigned(f); }
+
+  } // anonymous namespace
+
+
+  // Recursive descent parser which generates code for a stack machine.
+  //
+  //   expr    := and { "||" and }
+  //   and     := unary { "&&" unary }
+  //   unary   := "!" unary | primary
+  //   primary := "(" expr ")" | "true" | "false" | flag | string-field ( "==" | "!=" ) literal
+  struct expression::parser {
+    parser(expression& e_, const std::string& src_) : e(e_), src(src_) { }
+
+    void run() {
+      expr();
+      skip_space();
+      if (pos != src.size())
+        fail("unexpected text");
+    }
+
+  private:
+    void expr() {
+      conjunction();
+      while (accept("||")) {
+        conjunction();
+        emit(opcode::or_);
+      }
+    }
+
+    void conjunction() {
+      unary();
+      while (accept("&&")) {
+        unary();
+        emit(opcode::and_);
+      }
+    }
+
+    void unary() {
+      if (accept("!") ) {
+        unary();
+        emit(opcode::not_);
+      } else
+        primary();
+    }
+
+    void primary() {
+      if (accept("(")) {
+        expr();
+        if (! accept(")"))
+          fail("missing )");
+        return;
+      }
+
+      auto id = identifier();
+      if (id == "true" || id == "false") {
+        emit(opcode::push_const, 0, id == "true");
+        return;
+      }
+      const field_desc* fd = nullptr;
+      for (const auto& d : fields)
+        if (id == d.name)
+          fd = &d;
+      if (fd == nullptr)
+        fail("unknown field '"s + id + "'");
+      e.deps |= bit(fd->f);
+
+      if (fd->type == field_type::flag) {
+        emit(opcode::push_flag, uint8_t(fd->f));
+        return;
+      }
+
+      bool negate;
+      if (accept("=="))
+        negate = false;
+      else if (accept("!="))
+        negate = true;
+      else
+        fail("field '"s + id + "' must be compared");
+      e.strings.emplace_back(literal());
+      emit(opcode::eq_string, uint8_t(fd->f), e.strings.size() - 1);
+      if (negate)
+        emit(opcode::not_);
+    }
+
+    std::string identifier() {
+      skip_space();
+      auto start = pos;
+      while (pos < src.size() && (isalnum(src[pos]) || src[pos] == '_'))
+        ++pos;
+      if (start == pos)
+        fail("expected a name");
+      return src.substr(start, pos - start);
+    }
+
+    std::string literal() {
+      skip_space();
+      if (pos == src.size() || (src[pos] != '\'' && src[pos] != '"'))
+        fail("expected a string");
+      auto quote = src[pos++];
+      auto end = src.find(quote, pos);
+      if (end == std::string::npos)
+        fail("unterminated string");
+      auto res = src.substr(pos, end - pos);
+      pos = end + 1;
+      return res;
+    }
+
+    bool accept(const char* tok) {
+      skip_space();
+      if (src.compare(pos, strlen(tok), tok) != 0)
+        return false;
+      // Do not mistake "!=" for "!".
+      if (tok[0] == '!' && tok[1] == '\0' && pos + 1 < src.size() && src[pos + 1] == '=')
+        return false;
+      pos += strlen(tok);
+      return true;
+    }
+
+    void skip_space() {
+      while (pos < src.size() && isspace(src[pos]))
+        ++pos;
+    }
+
+    void emit(opcode op, uint8_t f = 0, uint16_t arg = 0) {
+      e.code.emplace_back(op, f, arg);
+      if (op == opcode::push_const || op == opcode::push_flag || op == opcode::eq_string) {
+        if (++depth > max_depth)
+          fail("expression too complex");
+      } else if (op == opcode::and_ || op == opcode::or_)
+        --depth;
+    }
+
+    [[noreturn]] void fail(const std::string& msg) {
+      throw std::runtime_error("rule '"s + src + "': " + msg);
+    }
+
+    expression& e;
+    const std::string& src;
+    size_t pos = 0;
+    unsigned depth = 0;
+  };
+
+
+  expression::expression(const std::string& src)
+  {
+    parser(*this, src).run();
+  }
+
+
+  bool expression::eval(const state& s) const
+  {
+    std::array<bool,max_depth> stack;
+    unsigned sp = 0;
+    for (const auto& i : code)
+      switch (i.op) {
+      case opcode::push_const:
+        stack[sp++] = i.arg != 0;
+        break;
+      case opcode::push_flag:
+        stack[sp++] = s.flags[i.field];
+        break;
+      case opcode::eq_string:
+        stack[sp++] = s.strings[i.field] == strings[i.arg];
+        break;
+      case opcode::not_:
+        stack[sp - 1] = ! stack[sp - 1];
+        break;
+      case opcode::and_:
+        --sp;
+        stack[sp - 1] = stack[sp - 1] && stack[sp];
+        break;
+      case opcode::or_:
+        --sp;
+        stack[sp - 1] = stack[sp - 1] || stack[sp];
+        break;
+      }
+    return stack[0];
+  }
+
+
+  field_mask key_rules::deps() const
+  {
+    field_mask res = 0;
+    for (const auto& e : visible)
+      res |= e.deps;
+    for (const auto& p : icons)
+      res |= p.first.deps;
+    return res;
+  }
+
+
+  bool key_rules::evaluate(const state& s)
+  {
+    bool new_visible = true;
+    for (const auto& e : visible)
+      new_visible = new_visible && e.eval(s);
+
+    int new_icon = -1;
+    for (const auto& [e, icon] : icons)
+      if (e.eval(s)) {
+        new_icon = icon;
+        break;
+      }
+
+    bool res = new_visible != visible_result || new_icon != icon_result;
+    visible_result = new_visible;
+    icon_result = new_icon;
+    return res;
+  }
+
+
+  void engine::subscribe(key_rules& r)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto deps = r.deps();
+    for (unsigned f = 0; f < nfields; ++f)
+      if (deps & bit(field(f)))
+        dependents[f].push_back(&r);
+    r.evaluate(current);
+  }
+
+
+  void engine::set(field f, bool v)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (current.flags[unsigned(f)] != v) {
+      current.flags[unsigned(f)] = v;
+      dirty |= bit(f);
+    }
+  }
+
+
+  void engine::set(field f, const std::string& v)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (current.strings[unsigned(f)] != v) {
+      current.strings[unsigned(f)] = v;
+      dirty |= bit(f);
+    }
+  }
+
+
+  void engine::commit()
+  {
+    static auto& evaluations = metrics::get_counter("rules.evaluations");
+
+    std::vector<key_rules*> changed;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (dirty == 0)
+        return;
+
+      // A key depending on several changed fields is evaluated only once.
+      ++generation;
+      for (unsigned f = 0; f < nfields; ++f)
+        if (dirty & bit(field(f)))
+          for (auto r : dependents[f])
+            if (r->generation != generation) {
+              r->generation = generation;
+              ++evaluations;
+              if (r->evaluate(current))
+                changed.push_back(r);
+            }
+      dirty = 0;
+    }
+
+    for (auto r : changed)
+      if (r->changed)
+        r->changed();
+  }
+
+} // namespace rules
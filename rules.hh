@@ -0,0 +1,125 @@
+#ifndef _RULES_HH
+#define _RULES_HH 1
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Rules which determine whether a key is visible and which icon it shows, depending
+// on the state of an OBS connection.  The conditions are written as expressions like
+//
+//   studio_mode && scene != 'Intro'
+//
+// and compiled when the configuration is read.  Each compiled expression knows which
+// state fields it uses and it is only evaluated again when one of them changes.
+namespace rules {
+
+  enum struct field : unsigned {
+    connected,
+    studio_mode,
+    recording,
+    streaming,
+    ftb,
+    scene,
+    preview,
+    transition,
+
+    nfields
+  };
+  constexpr unsigned nfields = unsigned(field::nfields);
+
+  using field_mask = uint32_t;
+  static_assert(nfields <= 32);
+
+
+  struct state {
+    std::array<bool,nfields> flags{};
+    std::array<std::string,nfields> strings;
+  };
+
+
+  struct expression {
+    // Throws std::runtime_error if the source cannot be parsed.
+    explicit expression(const std::string& src);
+
+    bool eval(const state& s) const;
+
+    // The fields used in the expression.
+    field_mask deps = 0;
+
+  private:
+    enum struct opcode : uint8_t {
+      push_const,
+      push_flag,
+      eq_string,
+      not_,
+      and_,
+      or_,
+    };
+    struct insn {
+      opcode op;
+      uint8_t field = 0;
+      uint16_t arg = 0;
+    };
+    std::vector<insn> code;
+    std::vector<std::string> strings;
+
+    static constexpr unsigned max_depth = 32;
+
+    struct parser;
+  };
+
+
+  // The rules for one key: an optional visibility condition and a list of conditional
+  // icons.  The first icon whose condition is true is used, if none matches the key
+  // shows its normal icon.
+  struct key_rules {
+    std::vector<expression> visible;
+    std::vector<std::pair<expression,int>> icons;
+
+    // Called from the thread changing the state when the result changed.
+    std::function<void()> changed;
+
+    bool is_visible() const { return visible_result; }
+    // The icon handle selected by the rules or -1.
+    int icon() const { return icon_result; }
+
+  private:
+    friend struct engine;
+
+    field_mask deps() const;
+    // Returns true if the result changed.
+    bool evaluate(const state& s);
+
+    std::atomic<bool> visible_result = true;
+    std::atomic<int> icon_result = -1;
+    unsigned generation = 0;
+  };
+
+
+  // The state of one OBS connection and the rules depending on it.  The state is
+  // changed with the set functions, commit then re-evaluates exactly the rules which
+  // depend on one of the changed fields.
+  struct engine {
+    void subscribe(key_rules& r);
+
+    void set(field f, bool v);
+    void set(field f, const std::string& v);
+    void commit();
+
+  private:
+    std::mutex lock;
+    state current;
+    field_mask dirty = 0;
+    unsigned generation = 0;
+    std::array<std::vector<key_rules*>,nfields> dependents;
+  };
+
+} // namespace rules
+
+#endif // rules.hh
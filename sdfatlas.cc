@@ -0,0 +1,153 @@
+#include "sdfatlas.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "metrics.hh"
+
+using namespace std::string_literals;
+
+
+sdf_atlas::sdf_atlas(FT_Library library, std::mutex& face_lock_, const std::filesystem::path& path)
+: face_lock(face_lock_)
+{
+  std::lock_guard<std::mutex> guard(face_lock);
+  if (FT_New_Face(library, path.c_str(), 0, &face) != 0)
+    throw std::runtime_error("cannot load font "s + path.string());
+  FT_Set_Pixel_Sizes(face, 0, ref_size);
+}
+
+
+sdf_atlas::~sdf_atlas()
+{
+  std::lock_guard<std::mutex> guard(face_lock);
+  FT_Done_Face(face);
+}
+
+
+sdf_atlas::entry* sdf_atlas::lookup(FT_UInt index)
+{
+  static auto& misses = metrics::get_counter("text.sdf_misses");
+  static auto& nglyphs = metrics::get_counter("text.sdf_glyphs");
+
+  if (auto it = glyphs.find(index); it != glyphs.end()) {
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return &it->second;
+  }
+
+  ++misses;
+  if (FT_Load_Glyph(face, index, FT_LOAD_DEFAULT | FT_LOAD_NO_HINTING) != 0
+      || FT_Render_Glyph(face->glyph, FT_RENDER_MODE_SDF) != 0)
+    return nullptr;
+
+  if (glyphs.size() == max_glyphs) {
+    glyphs.erase(lru.back());
+    lru.pop_back();
+  }
+
+  const auto& bm = face->glyph->bitmap;
+  lru.push_front(index);
+  auto& e = glyphs[index];
+  e.left = face->glyph->bitmap_left;
+  e.top = face->glyph->bitmap_top;
+  e.width = bm.width;
+  e.rows = bm.rows;
+  e.sdf.resize(e.width * e.rows);
+  for (unsigned y = 0; y < e.rows; ++y)
+    std::copy_n(bm.buffer + y * bm.pitch, e.width, e.sdf.begin() + y * e.width);
+  e.lru = lru.begin();
+  nglyphs.set(glyphs.size());
+
+  return &e;
+}
+
+
+bool sdf_atlas::get(FT_UInt index, double scale, sdf_glyph_image& out)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  auto e = lookup(index);
+  if (e == nullptr)
+    return false;
+
+  unsigned ow = e->width == 0 ? 0 : std::max(1u, unsigned(std::ceil(e->width * scale)));
+  unsigned oh = e->rows == 0 ? 0 : std::max(1u, unsigned(std::ceil(e->rows * scale)));
+  out.left = std::lround(e->left * scale);
+  out.top = std::lround(e->top * scale);
+  out.buffer.resize(ow * oh);
+  out.bitmap = FT_Bitmap{};
+  out.bitmap.width = ow;
+  out.bitmap.rows = oh;
+  out.bitmap.pitch = ow;
+  out.bitmap.buffer = out.buffer.data();
+  out.bitmap.num_grays = 256;
+  out.bitmap.pixel_mode = FT_PIXEL_MODE_GRAY;
+  if (ow == 0 || oh == 0)
+    return true;
+
+  // The sample positions in the distance field.  The horizontal positions and weights
+  // are the same for all rows and are computed only once so that the inner loop is
+  // simple enough to be vectorized.
+  const float inv = 1.0f / scale;
+  std::vector<unsigned> x0(ow);
+  std::vector<unsigned> x1(ow);
+  std::vector<float> fx(ow);
+  for (unsigned ox = 0; ox < ow; ++ox) {
+    auto sx = std::clamp((ox + 0.5f) * inv - 0.5f, 0.0f, float(e->width - 1));
+    x0[ox] = unsigned(sx);
+    x1[ox] = std::min(x0[ox] + 1, e->width - 1);
+    fx[ox] = sx - x0[ox];
+  }
+
+  // A value of 128 is the outline, each step is spread/128 pixels at the reference size.
+  const float k = spread * scale / 128.0f;
+  std::vector<float> row(ow);
+  for (unsigned oy = 0; oy < oh; ++oy) {
+    auto sy = std::clamp((oy + 0.5f) * inv - 0.5f, 0.0f, float(e->rows - 1));
+    auto y0 = unsigned(sy);
+    auto y1 = std::min(y0 + 1, e->rows - 1);
+    auto fy = sy - y0;
+    const uint8_t* r0 = e->sdf.data() + y0 * e->width;
+    const uint8_t* r1 = e->sdf.data() + y1 * e->width;
+
+    for (unsigned ox = 0; ox < ow; ++ox) {
+      float a = r0[x0[ox]] + (r0[x1[ox]] - r0[x0[ox]]) * fx[ox];
+      float b = r1[x0[ox]] + (r1[x1[ox]] - r1[x0[ox]]) * fx[ox];
+      row[ox] = a + (b - a) * fy;
+    }
+
+    uint8_t* dst = out.buffer.data() + oy * ow;
+    for (unsigned ox = 0; ox < ow; ++ox) {
+      float c = std::clamp((row[ox] - 128.0f) * k + 0.5f, 0.0f, 1.0f);
+      dst[ox] = uint8_t(c * 255.0f + 0.5f);
+    }
+  }
+
+  // The distance field has a border of the size of the spread.  Remove the empty
+  // rows and columns, the dimensions are used to measure the text.
+  unsigned minx = ow, maxx = 0, miny = oh, maxy = 0;
+  for (unsigned oy = 0; oy < oh; ++oy)
+    for (unsigned ox = 0; ox < ow; ++ox)
+      if (out.buffer[oy * ow + ox] != 0) {
+        minx = std::min(minx, ox);
+        maxx = std::max(maxx, ox);
+        miny = std::min(miny, oy);
+        maxy = std::max(maxy, oy);
+      }
+  if (minx > maxx) {
+    out.bitmap.width = out.bitmap.rows = out.bitmap.pitch = 0;
+    return true;
+  }
+  unsigned cw = maxx - minx + 1;
+  unsigned ch = maxy - miny + 1;
+  for (unsigned y = 0; y < ch; ++y)
+    std::copy_n(out.buffer.begin() + (miny + y) * ow + minx, cw, out.buffer.begin() + y * cw);
+  out.bitmap.width = cw;
+  out.bitmap.rows = ch;
+  out.bitmap.pitch = cw;
+  out.left += minx;
+  out.top -= miny;
+
+  return true;
+}
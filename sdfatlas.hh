@@ -0,0 +1,63 @@
+#ifndef _SDFATLAS_HH
+#define _SDFATLAS_HH 1
+
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+
+// Coverage bitmap of a glyph computed from the signed distance field.
+struct sdf_glyph_image {
+  FT_Bitmap bitmap;
+  FT_Int left;
+  FT_Int top;
+  std::vector<uint8_t> buffer;
+};
+
+
+// Signed distance fields of the glyphs of one font file.  Each glyph is rendered once
+// at the reference size, the coverage at any other size is computed from the distance
+// field.  This way the glyphs can be shared among all labels, independent of the font
+// size chosen for each label.  The number of glyphs kept is limited, the least recently
+// used glyphs are dropped.
+struct sdf_atlas {
+  // FT_New_Face and FT_Done_Face are called with face_lock held.
+  sdf_atlas(FT_Library library, std::mutex& face_lock_, const std::filesystem::path& path);
+  ~sdf_atlas();
+
+  // Compute the coverage of the glyph for the given scale relative to the reference size.
+  bool get(FT_UInt index, double scale, sdf_glyph_image& out);
+
+  // Pixels per em for the distance fields.
+  static constexpr unsigned ref_size = 64;
+  // Distance (in pixels at the reference size) represented by the full range of values.
+  // This is FreeType's default.
+  static constexpr unsigned spread = 8;
+  static constexpr size_t max_glyphs = 1024;
+
+private:
+  struct entry {
+    FT_Int left;
+    FT_Int top;
+    unsigned width;
+    unsigned rows;
+    std::vector<uint8_t> sdf;
+    std::list<FT_UInt>::iterator lru;
+  };
+
+  entry* lookup(FT_UInt index);
+
+  std::mutex lock;
+  std::mutex& face_lock;
+  FT_Face face = nullptr;
+  std::unordered_map<FT_UInt,entry> glyphs;
+  std::list<FT_UInt> lru;
+};
+
+#endif // sdfatlas.hh
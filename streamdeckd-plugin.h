@@ -0,0 +1,93 @@
+#ifndef _STREAMDECKD_PLUGIN_H
+#define _STREAMDECKD_PLUGIN_H 1
+
+/* Interface for action types implemented outside the daemon.  A plugin is a shared
+   object in the plugin directory which defines the function
+
+     const struct streamdeckd_plugin* streamdeckd_plugin_init(unsigned host_abi_version);
+
+   The function returns a null pointer if the plugin cannot work with the given
+   version of the host.  The returned object must stay valid until the process ends.
+
+   The ABI version is increased whenever any of the structures change in an
+   incompatible way.  New members are only ever added at the end.  */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STREAMDECKD_PLUGIN_ABI_VERSION 1
+
+/* Opaque types.  */
+struct streamdeckd_key;
+struct streamdeckd_setting;
+
+
+/* Functions provided by the daemon.  All functions can be called from any thread.  */
+struct streamdeckd_host {
+  unsigned abi_version;
+
+  /* Access to the configuration of the key.  The functions return nonzero if the
+     value exists and has the correct type.  Strings remain valid as long as the
+     setting object, i.e., they must be copied in the create function.  */
+  int (*lookup_string)(const struct streamdeckd_setting* setting, const char* name, const char** res);
+  int (*lookup_int)(const struct streamdeckd_setting* setting, const char* name, long long* res);
+  int (*lookup_double)(const struct streamdeckd_setting* setting, const char* name, double* res);
+
+  /* Shared render cache.  Images are registered once with the device(s) and are
+     referenced by the returned handle.  Loading the same file twice returns the same
+     handle.  The RGBA data is copied.  The functions return -1 on error.  */
+  int (*register_image_file)(struct streamdeckd_key* key, const char* fname);
+  int (*register_image_rgba)(struct streamdeckd_key* key, unsigned width, unsigned height, const unsigned char* rgba);
+
+  /* Queue an image for the key.  Requests for keys not on the current page are
+     ignored, the plugin's visibility callback is called when the page changes.
+     Invalid handles and images which cannot be used are ignored as well.  */
+  void (*set_key_image)(struct streamdeckd_key* key, int handle);
+  void (*set_key_rgba)(struct streamdeckd_key* key, unsigned width, unsigned height, const unsigned char* rgba);
+
+  /* Dimensions of the key images in pixels.  */
+  unsigned (*key_width)(const struct streamdeckd_key* key);
+  unsigned (*key_height)(const struct streamdeckd_key* key);
+
+  void (*log)(const struct streamdeckd_key* key, const char* msg);
+};
+
+
+/* Description of an action type provided by the plugin.  */
+struct streamdeckd_plugin {
+  unsigned abi_version;
+
+  /* Used as the value of the 'type' entry in the key configuration.  */
+  const char* type_name;
+
+  /* Create an instance for a key.  The host and key pointers remain valid for the
+     lifetime of the instance, the setting only during the call.  Returns a null
+     pointer on failure in which case the key is left unused.  */
+  void* (*create)(const struct streamdeckd_host* host, struct streamdeckd_key* key, const struct streamdeckd_setting* setting);
+  void (*destroy)(void* instance);
+
+  /* PRESS, RELEASE, and VISIBILITY are called from the thread handling the key
+     events, never at the same time.  It is the thread which also calls CREATE.  Each
+     press is followed by one release, even if the page was changed in between.  With
+     mirrored devices the key can be held on several of them, each press has its own
+     release.  The functions should return quickly, longer work belongs in a thread of
+     the plugin.  */
+  void (*press)(void* instance);
+  void (*release)(void* instance);
+
+  /* Called with nonzero VISIBLE when the key's page is shown and zero when another
+     page replaces it.  The plugin should set the key image when it becomes visible.  */
+  void (*visibility)(void* instance, int visible);
+};
+
+
+typedef const struct streamdeckd_plugin* (*streamdeckd_plugin_init_fn)(unsigned host_abi_version);
+
+#define STREAMDECKD_PLUGIN_INIT_NAME "streamdeckd_plugin_init"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* streamdeckd-plugin.h */
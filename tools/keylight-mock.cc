@@ -0,0 +1,219 @@
+// Local stand-in for Elgato KeyLights.  Each emulated light answers the GET and PUT
+// requests of the /elgato/lights endpoint on its own port of the loopback interface.
+// Every request is logged with the time, the light, and the connection it arrived on so
+// that the concurrency of group commands and the reuse of connections can be checked.
+// The counters are printed at exit.  Use with a configuration like
+//
+//   keylights = ( { serial: "MOCK0"; url: "http://127.0.0.1:9123"; },
+//                 { serial: "MOCK1"; url: "http://127.0.0.1:9124"; } );
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <error.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+
+namespace {
+
+  const auto start = std::chrono::steady_clock::now();
+  unsigned delay_ms = 0;
+  bool close_each = false;
+  std::mutex out_lock;
+
+
+  struct light {
+    light(unsigned idx_, unsigned port_) : idx(idx_), port(port_) { }
+
+    const unsigned idx;
+    const unsigned port;
+
+    std::mutex lock;
+    int on = 0;
+    int brightness = 20;
+    int temperature = 213;
+
+    std::atomic<unsigned> connections = 0;
+    std::atomic<unsigned> requests = 0;
+    std::atomic<unsigned> max_concurrent = 0;
+    std::atomic<unsigned> active = 0;
+
+    std::string state()
+    {
+      std::lock_guard guard(lock);
+      return "{\"numberOfLights\":1,\"lights\":[{\"on\":" + std::to_string(on) + ",\"brightness\":" + std::to_string(brightness) + ",\"temperature\":" + std::to_string(temperature) + "}]}";
+    }
+
+    void update(const std::string& body)
+    {
+      std::lock_guard guard(lock);
+      auto field = [&body](const char* name, int& v) {
+        if (auto p = body.find(name); p != std::string::npos)
+          v = std::atoi(body.c_str() + p + strlen(name));
+      };
+      field("\"on\":", on);
+      field("\"brightness\":", brightness);
+      field("\"temperature\":", temperature);
+    }
+
+    void serve(int fd, unsigned conn);
+  };
+  std::list<light> lights;
+
+
+  double now_ms()
+  {
+    return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+  }
+
+
+  void light::serve(int fd, unsigned conn)
+  {
+    std::string buf;
+    char tmp[4096];
+    for (unsigned nreq = 1; ; ++nreq) {
+      size_t hdrend;
+      while ((hdrend = buf.find("\r\n\r\n")) == std::string::npos) {
+        auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+          goto out;
+        buf.append(tmp, n);
+      }
+      std::string hdr = buf.substr(0, hdrend);
+      std::string lower = hdr;
+      std::transform(lower.begin(), lower.end(), lower.begin(), [](char c){ return std::tolower(c); });
+      size_t len = 0;
+      if (auto cl = lower.find("\r\ncontent-length:"); cl != std::string::npos)
+        len = std::strtoul(lower.c_str() + cl + 17, nullptr, 10);
+      while (buf.size() < hdrend + 4 + len) {
+        auto n = ::recv(fd, tmp, sizeof(tmp), 0);
+        if (n <= 0)
+          goto out;
+        buf.append(tmp, n);
+      }
+      std::string body = buf.substr(hdrend + 4, len);
+      buf.erase(0, hdrend + 4 + len);
+
+      auto cur = ++active;
+      for (auto m = max_concurrent.load(); cur > m && ! max_concurrent.compare_exchange_weak(m, cur); )
+        ;
+      ++requests;
+      auto received = now_ms();
+      if (delay_ms != 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+
+      unsigned status = 200;
+      std::string method = hdr.substr(0, hdr.find(' '));
+      if (hdr.find(" /elgato/lights ") == std::string::npos)
+        status = 404;
+      else if (method == "PUT")
+        update(body);
+      else if (method != "GET")
+        status = 405;
+      std::string res = status == 200 ? state() : std::string();
+      --active;
+
+      std::string resp = "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : " Error") +
+        "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(res.size()) +
+        (close_each ? "\r\nConnection: close" : "") + "\r\n\r\n" + res;
+      if (::send(fd, resp.data(), resp.size(), MSG_NOSIGNAL) != ssize_t(resp.size()))
+        goto out;
+
+      {
+        std::lock_guard guard(out_lock);
+        printf("%10.3f light %u conn %u req %u %s %u %s\n", received, idx, conn, nreq, method.c_str(), status, res.c_str());
+        fflush(stdout);
+      }
+
+      if (close_each)
+        break;
+    }
+  out:
+    close(fd);
+  }
+
+
+  void accept_loop(light& l, int sfd)
+  {
+    while (true) {
+      int fd = accept4(sfd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd == -1)
+        continue;
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      std::thread([&l, fd, conn = ++l.connections]{ l.serve(fd, conn); }).detach();
+    }
+  }
+
+
+  void summary(int)
+  {
+    // Only called once, the output lock might be held by the interrupted thread.
+    for (auto& l : lights)
+      fprintf(stderr, "light %u port %u: %u connections, %u requests, at most %u concurrent\n", l.idx, l.port, l.connections.load(), l.requests.load(), l.max_concurrent.load());
+    _exit(0);
+  }
+
+} // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+  unsigned count = 2;
+  unsigned port = 9123;
+  int ch;
+  while ((ch = getopt(argc, argv, "n:p:d:c")) != -1)
+    switch (ch) {
+    case 'n':
+      count = std::max(1, atoi(optarg));
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'd':
+      delay_ms = atoi(optarg);
+      break;
+    case 'c':
+      close_each = true;
+      break;
+    default:
+      error(EXIT_FAILURE, 0, "usage: %s [-n LIGHTS] [-p FIRST_PORT] [-d DELAY_MS] [-c]", argv[0]);
+    }
+
+  std::list<std::thread> threads;
+  for (unsigned i = 0; i < count; ++i) {
+    auto& l = lights.emplace_back(i, port + i);
+    int sfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(l.port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sfd, reinterpret_cast<sockaddr*>(&sa), sizeof(sa)) != 0 || listen(sfd, 16) != 0)
+      error(EXIT_FAILURE, errno, "cannot listen on port %u", l.port);
+    printf("light %u: serial MOCK%u url http://127.0.0.1:%u\n", i, i, l.port);
+    threads.emplace_back([&l, sfd]{ accept_loop(l, sfd); });
+  }
+  fflush(stdout);
+
+  signal(SIGINT, summary);
+  signal(SIGTERM, summary);
+  for (auto& t : threads)
+    t.join();
+}
@@ -0,0 +1,291 @@
+// Emulated Stream Deck for measurements without the hardware.  The device is created
+// through /dev/uhid with the vendor and product ID and the report layout of the chosen
+// model, streamdeckd finds it like a real one.  Feature reports (serial number, firmware
+// version, brightness, reset) are answered, key presses are injected at a fixed rate,
+// and every image written to the device is logged with the time since the start and,
+// for the pressed key, the time since the press.  Needs write access to /dev/uhid.
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <error.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+
+
+namespace {
+
+  using clock_type = std::chrono::steady_clock;
+
+
+  struct model {
+    const char* name;
+    const char* product_name;
+    uint16_t pid;
+    unsigned keys;
+    // The image reports of the first generation have a 16 byte header and number the
+    // keys from one, the later ones an 8 byte header.
+    bool gen1;
+    unsigned output_len;
+    unsigned feature_len;
+    std::vector<uint8_t> features;
+    uint8_t serial_report;
+    unsigned serial_offset;
+    uint8_t firmware_report;
+    unsigned firmware_offset;
+  };
+
+  // The first model is the default.  The first version of the original Stream Deck
+  // (0x0060) uses 8191 byte output reports, more than uhid can pass on.
+  const model models[] = {
+    { "mk2", "Stream Deck MK.2", 0x0080, 15, false, 1024, 32, { 0x03, 0x05, 0x06 }, 0x06, 2, 0x05, 6 },
+    { "original-v2", "Stream Deck Original", 0x006d, 15, false, 1024, 32, { 0x03, 0x05, 0x06 }, 0x06, 2, 0x05, 6 },
+    { "xl", "Stream Deck XL", 0x006c, 32, false, 1024, 32, { 0x03, 0x05, 0x06 }, 0x06, 2, 0x05, 6 },
+    { "mini", "Stream Deck Mini", 0x0063, 6, true, 1024, 17, { 0x03, 0x04, 0x05, 0x0b }, 0x03, 5, 0x04, 5 },
+  };
+  constexpr uint16_t elgato_vid = 0x0fd9;
+
+
+  // The input report carries one byte per key, the later generations have a three byte
+  // header before the key states.
+  unsigned input_len(const model& m) { return (m.gen1 ? 0 : 3) + m.keys; }
+
+
+  std::vector<uint8_t> descriptor(const model& m)
+  {
+    std::vector<uint8_t> d{
+      0x05, 0x0c,                  // Usage Page (Consumer)
+      0x09, 0x01,                  // Usage (Consumer Control)
+      0xa1, 0x01,                  // Collection (Application)
+      0x09, 0x01, 0x05, 0x09,      //   Usage, Usage Page (Button)
+      0x19, 0x01, 0x29, uint8_t(m.keys),
+      0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08,
+      0x95, uint8_t(input_len(m)), 0x85, 0x01, 0x81, 0x02,
+      0x0a, 0x00, 0xff, 0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08,
+      0x96, uint8_t(m.output_len - 1), uint8_t((m.output_len - 1) >> 8), 0x85, 0x02, 0x91, 0x02,
+    };
+    for (auto id : m.features)
+      d.insert(d.end(), { 0x0a, 0x00, 0xff, 0x75, 0x08, 0x95, uint8_t(m.feature_len - 1), 0x85, id, 0xb1, 0x04 });
+    d.emplace_back(0xc0);          // End Collection
+    return d;
+  }
+
+
+  void write_event(int fd, const uhid_event& ev)
+  {
+    if (write(fd, &ev, sizeof(ev)) != sizeof(ev))
+      error(EXIT_FAILURE, errno, "cannot write to /dev/uhid");
+  }
+
+
+  volatile sig_atomic_t terminated = 0;
+
+  void terminate(int)
+  {
+    terminated = 1;
+  }
+
+} // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+  const model* m = &models[0];
+  std::string serial = "EMU0000001";
+  unsigned presses = 100;
+  unsigned interval_ms = 250;
+  int fixed_key = -1;
+  unsigned startup_s = 3;
+  int ch;
+  while ((ch = getopt(argc, argv, "m:s:n:i:k:w:")) != -1)
+    switch (ch) {
+    case 'm':
+      m = std::find_if(std::begin(models), std::end(models), [](const model& e){ return strcmp(e.name, optarg) == 0; });
+      if (m == std::end(models))
+        error(EXIT_FAILURE, 0, "unknown model %s", optarg);
+      break;
+    case 's':
+      serial = optarg;
+      break;
+    case 'n':
+      presses = atoi(optarg);
+      break;
+    case 'i':
+      interval_ms = std::max(1, atoi(optarg));
+      break;
+    case 'k':
+      fixed_key = atoi(optarg);
+      break;
+    case 'w':
+      startup_s = atoi(optarg);
+      break;
+    default:
+      error(EXIT_FAILURE, 0, "usage: %s [-m mk2|original-v2|xl|mini] [-s SERIAL] [-n PRESSES] [-i INTERVAL_MS] [-k KEY] [-w STARTUP_S]", argv[0]);
+    }
+  if (fixed_key >= int(m->keys))
+    error(EXIT_FAILURE, 0, "the model has only %u keys", m->keys);
+
+  int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (fd == -1)
+    error(EXIT_FAILURE, errno, "cannot open /dev/uhid");
+
+  auto rdesc = descriptor(*m);
+  uhid_event ev{};
+  ev.type = UHID_CREATE2;
+  snprintf(reinterpret_cast<char*>(ev.u.create2.name), sizeof(ev.u.create2.name), "Elgato %s (emulated)", m->product_name);
+  snprintf(reinterpret_cast<char*>(ev.u.create2.uniq), sizeof(ev.u.create2.uniq), "%s", serial.c_str());
+  ev.u.create2.rd_size = rdesc.size();
+  memcpy(ev.u.create2.rd_data, rdesc.data(), rdesc.size());
+  ev.u.create2.bus = BUS_USB;
+  ev.u.create2.vendor = elgato_vid;
+  ev.u.create2.product = m->pid;
+  write_event(fd, ev);
+
+  signal(SIGINT, terminate);
+  signal(SIGTERM, terminate);
+
+  const auto start = clock_type::now();
+  auto us = [start](clock_type::time_point t) {
+    return (long long) std::chrono::duration_cast<std::chrono::microseconds>(t - start).count();
+  };
+  printf("# %s %04x:%04x serial %s, %u keys\n", m->product_name, elgato_vid, m->pid, serial.c_str(), m->keys);
+
+  // Give streamdeckd time to open the device and draw the initial icons.
+  auto next = start + std::chrono::seconds(startup_s);
+  unsigned sent = 0;
+  int pressed_key = -1;
+  clock_type::time_point pressed_at;
+  std::vector<unsigned> image_bytes(m->keys);
+  std::vector<long long> latencies;
+  unsigned images = 0;
+
+  while (! terminated && sent < 2 * presses) {
+    auto now = clock_type::now();
+    if (now >= next) {
+      // Alternate presses and releases.
+      unsigned key = fixed_key >= 0 ? fixed_key : (sent / 2) % m->keys;
+      bool down = sent % 2 == 0;
+      uhid_event in{};
+      in.type = UHID_INPUT2;
+      in.u.input2.size = 1 + input_len(*m);
+      in.u.input2.data[0] = 0x01;
+      if (! m->gen1) {
+        in.u.input2.data[2] = m->keys;
+        in.u.input2.data[3] = m->keys >> 8;
+      }
+      in.u.input2.data[1 + input_len(*m) - m->keys + key] = down;
+      write_event(fd, in);
+      if (down) {
+        pressed_key = key;
+        pressed_at = now;
+      }
+      printf("%lld %s %u\n", us(now), down ? "press" : "release", key);
+      ++sent;
+      next = now + std::chrono::milliseconds(interval_ms);
+      continue;
+    }
+
+    pollfd p{ fd, POLLIN, 0 };
+    if (poll(&p, 1, std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1) <= 0)
+      continue;
+    uhid_event e{};
+    if (read(fd, &e, sizeof(e)) <= 0)
+      break;
+    auto t = clock_type::now();
+
+    switch (e.type) {
+    case UHID_OUTPUT:
+      if (e.u.output.size > 16 && e.u.output.data[0] == 0x02) {
+        const auto* d = e.u.output.data;
+        unsigned key;
+        bool last;
+        unsigned len;
+        if (m->gen1) {
+          key = d[5] - 1;
+          last = d[4] != 0;
+          len = e.u.output.size - 16;
+        } else {
+          key = d[2];
+          last = d[3] != 0;
+          len = d[4] | (d[5] << 8);
+        }
+        if (key >= m->keys)
+          break;
+        image_bytes[key] += len;
+        if (last) {
+          ++images;
+          if (int(key) == pressed_key) {
+            latencies.emplace_back(us(t) - us(pressed_at));
+            printf("%lld image %u %u bytes, %lld us after press\n", us(t), key, image_bytes[key], latencies.back());
+            pressed_key = -1;
+          } else
+            printf("%lld image %u %u bytes\n", us(t), key, image_bytes[key]);
+          image_bytes[key] = 0;
+        }
+      }
+      break;
+
+    case UHID_GET_REPORT:
+      {
+        uhid_event r{};
+        r.type = UHID_GET_REPORT_REPLY;
+        r.u.get_report_reply.id = e.u.get_report.id;
+        r.u.get_report_reply.size = m->feature_len;
+        auto* d = r.u.get_report_reply.data;
+        d[0] = e.u.get_report.rnum;
+        if (e.u.get_report.rnum == m->serial_report)
+          memcpy(d + m->serial_offset, serial.data(), std::min<size_t>(serial.size(), m->feature_len - m->serial_offset));
+        else if (e.u.get_report.rnum == m->firmware_report)
+          memcpy(d + m->firmware_offset, "1.00.000", std::min<size_t>(8, m->feature_len - m->firmware_offset));
+        else
+          r.u.get_report_reply.err = EIO;
+        write_event(fd, r);
+        printf("%lld get feature %#x\n", us(t), e.u.get_report.rnum);
+      }
+      break;
+
+    case UHID_SET_REPORT:
+      {
+        uhid_event r{};
+        r.type = UHID_SET_REPORT_REPLY;
+        r.u.set_report_reply.id = e.u.set_report.id;
+        write_event(fd, r);
+        printf("%lld set feature %#x", us(t), e.u.set_report.rnum);
+        for (unsigned i = 1; i < std::min<unsigned>(e.u.set_report.size, 8); ++i)
+          printf(" %02x", e.u.set_report.data[i]);
+        putchar('\n');
+      }
+      break;
+
+    case UHID_OPEN:
+      printf("%lld open\n", us(t));
+      break;
+    case UHID_CLOSE:
+      printf("%lld close\n", us(t));
+      break;
+    default:
+      break;
+    }
+    fflush(stdout);
+  }
+
+  uhid_event d{};
+  d.type = UHID_DESTROY;
+  write_event(fd, d);
+
+  fprintf(stderr, "%u images, %zu after presses", images, latencies.size());
+  if (! latencies.empty()) {
+    std::sort(latencies.begin(), latencies.end());
+    fprintf(stderr, ", press to image: median %lld us, 99%% %lld us, max %lld us", latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+  }
+  fputc('\n', stderr);
+}